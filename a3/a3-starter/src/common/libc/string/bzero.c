@@ -45,32 +45,62 @@
  * memory.
  */
 
+/* See memcpy.c. */
+#define WORDMASK	(sizeof(long) - 1)
+#define BLOCKWORDS	8
+#define BLOCKBYTES	(BLOCKWORDS * sizeof(long))
+
 void
 bzero(void *vblock, size_t len)
 {
 	char *block = vblock;
-	size_t i;
+	long *lb;
+	size_t n;
 
 	/*
-	 * For performance, optimize the common case where the pointer
-	 * and the length are word-aligned, and write word-at-a-time
-	 * instead of byte-at-a-time. Otherwise, write bytes.
+	 * For performance, write words, BLOCKWORDS at a time, wherever
+	 * the alignment allows: a page or other aligned run of whole
+	 * blocks goes straight to the block loop; otherwise write bytes
+	 * up to a word boundary, then blocks, then words, then the
+	 * leftover bytes. Short blocks are just done bytewise.
 	 *
 	 * The alignment logic here should be portable. We rely on the
 	 * compiler to be reasonably intelligent about optimizing the
 	 * divides and moduli out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)block % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-		long *lb = (long *)block;
-		for (i=0; i<len/sizeof(long); i++) {
-			lb[i] = 0;
+	if (((uintptr_t)block & WORDMASK) == 0 && len % BLOCKBYTES == 0) {
+		/* fall through to the block loop with no head or tail */
+	}
+	else if (len >= BLOCKBYTES) {
+		while ((uintptr_t)block & WORDMASK) {
+			*block++ = 0;
+			len--;
 		}
 	}
 	else {
-		for (i=0; i<len; i++) {
-			block[i] = 0;
+		for (n=0; n<len; n++) {
+			block[n] = 0;
 		}
+		return;
+	}
+
+	lb = (long *)block;
+	for (n = len / BLOCKBYTES; n > 0; n--) {
+		lb[0] = 0; lb[1] = 0; lb[2] = 0; lb[3] = 0;
+		lb[4] = 0; lb[5] = 0; lb[6] = 0; lb[7] = 0;
+		lb += BLOCKWORDS;
+	}
+	len %= BLOCKBYTES;
+
+	while (len >= sizeof(long)) {
+		*lb++ = 0;
+		len -= sizeof(long);
+	}
+
+	block = (char *)lb;
+	while (len > 0) {
+		*block++ = 0;
+		len--;
 	}
 }
@@ -44,42 +44,86 @@
  * C standard function - copy a block of memory.
  */
 
+/*
+ * Copying is done by words, BLOCKWORDS of them per loop iteration, as
+ * far as the alignment allows.
+ */
+#define WORDMASK	(sizeof(long) - 1)
+#define BLOCKWORDS	8
+#define BLOCKBYTES	(BLOCKWORDS * sizeof(long))
+
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
+	long *dl;
+	const long *sl;
+	long t0, t1, t2, t3;
+	size_t n;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * Word copies need both pointers word-aligned. Pages and other
+	 * aligned runs of whole blocks, which is what the VM system and
+	 * most of uiomove copy, go straight to the unrolled block loop.
+	 * Otherwise, if the pointers are misaligned by the same amount,
+	 * copy bytes up to a word boundary, then blocks, then words,
+	 * then the bytes left over. If they're misaligned differently
+	 * they can't both be lined up, so copy bytes.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-
-		long *d = dst;
-		const long *s = src;
-
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+	if ((((uintptr_t)d | (uintptr_t)s) & WORDMASK) == 0 &&
+	    len % BLOCKBYTES == 0) {
+		/* fall through to the block loop with no head or tail */
+	}
+	else if ((((uintptr_t)d ^ (uintptr_t)s) & WORDMASK) == 0 &&
+		 len >= BLOCKBYTES) {
+		while ((uintptr_t)d & WORDMASK) {
+			*d++ = *s++;
+			len--;
 		}
 	}
 	else {
-		char *d = dst;
-		const char *s = src;
-
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
+		for (n=0; n<len; n++) {
+			d[n] = s[n];
 		}
+		return dst;
+	}
+
+	dl = (long *)d;
+	sl = (const long *)s;
+
+	/*
+	 * Load four words and then store them, so the loads aren't each
+	 * waiting on the store before.
+	 */
+	for (n = len / BLOCKBYTES; n > 0; n--) {
+		t0 = sl[0]; t1 = sl[1]; t2 = sl[2]; t3 = sl[3];
+		dl[0] = t0; dl[1] = t1; dl[2] = t2; dl[3] = t3;
+		t0 = sl[4]; t1 = sl[5]; t2 = sl[6]; t3 = sl[7];
+		dl[4] = t0; dl[5] = t1; dl[6] = t2; dl[7] = t3;
+		dl += BLOCKWORDS;
+		sl += BLOCKWORDS;
+	}
+	len %= BLOCKBYTES;
+
+	while (len >= sizeof(long)) {
+		*dl++ = *sl++;
+		len -= sizeof(long);
+	}
+
+	d = (char *)dl;
+	s = (const char *)sl;
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
@@ -45,10 +45,20 @@
  * regions correctly.
  */
 
+/* See memcpy.c. */
+#define WORDMASK	(sizeof(long) - 1)
+#define BLOCKWORDS	8
+#define BLOCKBYTES	(BLOCKWORDS * sizeof(long))
+
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
+	long *dl;
+	const long *sl;
+	long t0, t1, t2, t3;
+	size_t n;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +94,57 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copy by words, back to front, in the same cases memcpy does.
+	 * Look in memcpy.c for more information. Each block is loaded
+	 * completely before any of it is stored, so an overlap of less
+	 * than a block doesn't matter.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-
-		long *d = dst;
-		const long *s = src;
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
-
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+	if ((((uintptr_t)d | (uintptr_t)s) & WORDMASK) == 0 &&
+	    len % BLOCKBYTES == 0) {
+		/* fall through to the block loop with no head or tail */
+	}
+	else if ((((uintptr_t)d ^ (uintptr_t)s) & WORDMASK) == 0 &&
+		 len >= BLOCKBYTES) {
+		while ((uintptr_t)d & WORDMASK) {
+			*--d = *--s;
+			len--;
 		}
 	}
 	else {
-		char *d = dst;
-		const char *s = src;
-
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
+		while (len > 0) {
+			*--d = *--s;
+			len--;
 		}
+		return dst;
+	}
+
+	dl = (long *)d;
+	sl = (const long *)s;
+
+	for (n = len / BLOCKBYTES; n > 0; n--) {
+		dl -= BLOCKWORDS;
+		sl -= BLOCKWORDS;
+		t0 = sl[7]; t1 = sl[6]; t2 = sl[5]; t3 = sl[4];
+		dl[7] = t0; dl[6] = t1; dl[5] = t2; dl[4] = t3;
+		t0 = sl[3]; t1 = sl[2]; t2 = sl[1]; t3 = sl[0];
+		dl[3] = t0; dl[2] = t1; dl[1] = t2; dl[0] = t3;
+	}
+	len %= BLOCKBYTES;
+
+	while (len >= sizeof(long)) {
+		*--dl = *--sl;
+		len -= sizeof(long);
+	}
+
+	d = (char *)dl;
+	s = (const char *)sl;
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -0,0 +1,59 @@
+/*
+ * MIPS atomic counters; see <atomic.h>.
+ */
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+#include <cdefs.h>
+
+
+unsigned atomic_get(volatile unsigned *p);
+void atomic_set(volatile unsigned *p, unsigned val);
+unsigned atomic_add(volatile unsigned *p, int delta);
+
+////////////////////////////////////////////////////////////
+
+ATOMIC_INLINE
+unsigned
+atomic_get(volatile unsigned *p)
+{
+	return *p;
+}
+
+ATOMIC_INLINE
+void
+atomic_set(volatile unsigned *p, unsigned val)
+{
+	*p = val;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_add(volatile unsigned *p, int delta)
+{
+	unsigned x;
+	unsigned y;
+
+	/*
+	 * Add using LL/SC, retrying until the SC goes through.
+	 *
+	 * Load the existing value into X and put the sum in Y. After
+	 * the SC, Y contains 1 if the store succeeded, 0 if something
+	 * else wrote *P in between and we have to start over.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addu %1, %0, %3;"	/*   y = x + delta */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if failed, again */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (p), "r" (delta) : "memory");
+	return x + delta;
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
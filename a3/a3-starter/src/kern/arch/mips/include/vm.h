@@ -30,6 +30,9 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <spinlock.h>	/* for struct cpu_vm_machdep */
+
+struct wchan;		/* from <wchan.h> */
 
 /*
  * Machine-dependent VM system definitions.
@@ -110,8 +113,20 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 /*
  * Machine-dependent per-CPU data
+ *
+ * cvm_tlblock protects this cpu's TLB, the fields above it, and the
+ * TLB fields of the coremap entries for pages mapped in this TLB.
+ * cvm_pcache_lock protects the per-cpu page cache below it. Both are
+ * normally only ever taken by their own cpu; other cpus take the
+ * tlblock for lazy TLB shootdown. See coremap.c.
+ *
+ * cvm_shootchan is where threads wait for this cpu to finish TLB
+ * shootdowns they sent it.
  */
 
+/* Number of free pages each cpu can hold in its page cache. */
+#define CVM_PCACHE_SIZE  16
+
 struct cpu_vm_machdep {
 	/* last address space loaded into MMU */
 	struct addrspace *cvm_lastas;
@@ -120,6 +135,18 @@ struct cpu_vm_machdep {
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+	/* TLB slots shot down lazily and not yet flushed, one bit each */
+	uint64_t cvm_tlbstale;
+	struct spinlock cvm_tlblock;
+	struct wchan *cvm_shootchan;
+
+	/* per-cpu cache of free pages (coremap indexes) */
+	uint32_t cvm_pcache[CVM_PCACHE_SIZE];
+	unsigned cvm_pcache_num;	/* pages now in cvm_pcache */
+	unsigned cvm_pcache_folded;	/* cvm_pcache_num at last fold */
+	int cvm_nkernel;		/* unfolded change in kernel pages */
+	int cvm_nuser;			/* unfolded change in user pages */
+	struct spinlock cvm_pcache_lock;
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
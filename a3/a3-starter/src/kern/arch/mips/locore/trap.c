@@ -148,6 +148,11 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/* Charge the time since we left the kernel as user time. */
+	if (!iskern) {
+		thread_acct_fromuser();
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
@@ -321,6 +326,11 @@ mips_trap(struct trapframe *tf)
 	cpu_irqoff();
  done2:
 
+	/* And the time since we entered it as system time. */
+	if (!iskern) {
+		thread_acct_touser();
+	}
+
 	/*
 	 * The boot thread can get here (e.g. on interrupt return) but
 	 * since it doesn't go to userlevel, it can't be returning to
@@ -396,6 +406,9 @@ mips_usermode(struct trapframe *tf)
 	 */
 	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
 
+	/* Time up to here was spent in the kernel. */
+	thread_acct_touser();
+
 	/*
 	 * This actually does it. See exception.S.
 	 */
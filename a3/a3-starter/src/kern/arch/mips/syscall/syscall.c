@@ -117,6 +117,11 @@ syscall(struct trapframe *tf)
 				     (userptr_t)tf->tf_a1);
 		    break;
 
+	    case SYS_nanosleep:
+		    err = sys_nanosleep((userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+		    break;
+
             /* ASST2: These implementations of read and write only work for
              * console I/O (stdin, stdout and stderr file descriptors)
              */
@@ -130,6 +135,39 @@ syscall(struct trapframe *tf)
                                 &retval);
                 break;
 
+	    case SYS_readv:
+		err = sys_readv(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				&retval);
+		break;
+
+	    case SYS_writev:
+		err = sys_writev(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				 &retval);
+		break;
+
+	    case SYS_pread:
+		/*
+		 * off_t is 64-bit and goes in an aligned pair of
+		 * argument slots, so it's past a3, on the user stack.
+		 */
+		err = copyin((userptr_t)(tf->tf_sp+16), &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_pread(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				pos, &retval);
+		break;
+
+	    case SYS_pwrite:
+		/* as for pread */
+		err = copyin((userptr_t)(tf->tf_sp+16), &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_pwrite(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				 pos, &retval);
+		break;
+
 	    /* process calls */
 	
 	    case SYS__exit:
@@ -142,6 +180,14 @@ syscall(struct trapframe *tf)
 		    err = sys_fork(tf, &retval);
 		    break;
 
+	    case SYS_execv:
+		    err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+		    break;
+
+	    case SYS_getrusage:
+		    err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		    break;
+
             /* ASST2 - You need to fill in the code for each of these cases */
             case SYS_getpid:
             case SYS_waitpid:
@@ -166,6 +212,10 @@ syscall(struct trapframe *tf)
 	    case SYS_dup2:
 		err = sys_dup2(tf->tf_a0, tf->tf_a1, &retval);
 		break;
+	    case SYS_sendfile:
+		err = sys_sendfile(tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+		break;
+
 	    case SYS_lseek:
 		    /* Ouch ... off_t is 64-bit, so need a2/a3 register
 		     * pair to get the "pos" argument and need to get 
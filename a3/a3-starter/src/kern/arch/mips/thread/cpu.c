@@ -175,6 +175,26 @@ cpu_irqonoff(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Cycle counter: coprocessor 0 register 9, c0_count. On System/161
+ * setting the timer (c0_compare) can also reset it; see cpu.h.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* read c0_count */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Idling.
  */
@@ -46,6 +46,7 @@
 #include <machine/tlb.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <platform/maxcpus.h>
 
 #include "opt-randpage.h"
 #include "opt-randtlb.h"
@@ -62,6 +63,36 @@
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
  * adding more memory won't help.
+ *
+ * Locking. The coremap is not all under one lock, because on a
+ * multiprocessor coremap_spinlock gets far too hot:
+ *
+ *    - Each cpu has a small cache ("magazine") of free pages,
+ *      c_vm.cvm_pcache, under c_vm.cvm_pcache_lock. Single-page
+ *      allocations and frees go to the local cache, which is
+ *      refilled from and drained to the global free pool in batches
+ *      of CM_PCACHE_BATCH pages under coremap_spinlock. Pages in a
+ *      cache are marked cm_cached and are neither allocated nor
+ *      counted in num_coremap_free.
+ *
+ *    - Each cpu's TLB, and cm_tlbix/cm_cpunum of the pages mapped in
+ *      it, are under that cpu's c_vm.cvm_tlblock. Only the cpu itself
+ *      ever changes its TLB. Another cpu may take the lock to clear
+ *      cm_tlbix/cm_cpunum for a lazy shootdown (see tlb_lazyshoot).
+ *
+ *    - cm_pinned is under one of CM_PINLOCKS striped pin locks.
+ *
+ *    - Everything else (the global free pool, allocation state of
+ *      pages not in a cache, the page counts) is under
+ *      coremap_spinlock.
+ *
+ * The lock order is pcache lock, coremap_spinlock, tlblock, pin lock.
+ * The address spaces' as_vmlock (for RSS accounting) is a leaf, and
+ * may be taken under any of these.
+ *
+ * To make this work the fields of coremap_entry that are changed
+ * under different locks live in different bytes, so updating one
+ * never rewrites another.
  */
 
 
@@ -71,6 +102,30 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * Number of pages moved between a per-cpu page cache and the global
+ * free pool at once.
+ */
+#define CM_PCACHE_BATCH		(CVM_PCACHE_SIZE/2)
+
+/*
+ * Number of pin locks/wait channels. Pages are spread over them by
+ * coremap index.
+ */
+#define CM_PINLOCKS		16
+
+/*
+ * Most pages evicted at once, sharing TLB shootdown IPIs.
+ */
+#define CM_EVICT_BATCH		TLBSHOOTDOWN_MAX
+
+/*
+ * Number of candidates page replacement looks at for a page of a
+ * process over its RSS limit, or outside its working set, before
+ * settling for the best it has seen.
+ */
+#define CM_REPLACE_LOOKAHEAD	8
+
 
 /*
  * Coremap entry structure.
@@ -79,15 +134,15 @@
 struct coremap_entry {
 	struct lpage *cm_lpage;	/* logical page we hold, or NULL */
 
-	volatile
-	int cm_tlbix:7;		/* tlb index number, or -1 */
-	unsigned cm_cpunum:5;	/* cpu number for cm_tlbix */
+	volatile int8_t cm_tlbix;	/* tlb index number, or -1 */
+	volatile uint8_t cm_cpunum;	/* cpu number for cm_tlbix */
+	volatile uint8_t cm_pinned;	/* true if page is busy */
 
-	unsigned cm_kernel:1,	/* true if kernel page */
+	volatile
+	uint8_t cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
-	volatile 
-	unsigned cm_pinned:1;	/* true if page is busy */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_cached:1;	/* true if page in a per-cpu page cache */
 };
 
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
@@ -98,28 +153,53 @@ struct coremap_entry {
 // Variables
 //
 
-static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock coremap_spinlock =
+	SPINLOCK_INITIALIZER_NAMED("coremap_spinlock");
 
 /*
- * Use one wchan for all page-pin waiting. There shouldn't be that
- * much of it or very many threads at once. Also use one wchan for all
- * TLB shootdown waiting. This is less justifiable - it maybe ought to
- * be per-CPU.
+ * Pin locks and the wchans for page-pin waiting, striped by coremap
+ * index. (TLB shootdown waiting uses per-cpu wchans, cvm_shootchan.)
  */
-static struct wchan *coremap_pinchan;
-static struct wchan *coremap_shootchan;
+static struct spinlock coremap_pinlocks[CM_PINLOCKS];
+static struct wchan *coremap_pinchans[CM_PINLOCKS];
 
+#define CM_PINLOCK(ix)	(&coremap_pinlocks[(ix) % CM_PINLOCKS])
+#define CM_PINCHAN(ix)	(coremap_pinchans[(ix) % CM_PINLOCKS])
+
+/*
+ * The page counts. Allocations and frees through the per-cpu caches
+ * are counted in the cpu's cvm_nkernel/cvm_nuser/cvm_pcache_num and
+ * only added in here ("folded") when the cache next touches the free
+ * pool, so these can be off by a few pages per cpu. Each cpu's
+ * unfolded changes always add up to zero, so the sum of the counts is
+ * always exactly num_coremap_entries.
+ */
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
 static uint32_t num_coremap_user;	/* pages allocated to user progs */
 static uint32_t num_coremap_free;	/* pages not allocated at all */
+static uint32_t num_coremap_cached;	/* pages in per-cpu page caches */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
+/* Every cpu's machine-dependent VM data, for draining the page caches. */
+static struct cpu_vm_machdep *coremap_cvms[MAXCPUS];
+static unsigned num_coremap_cvms;
+
+/* Protected by coremap_statlock. */
+static struct spinlock coremap_statlock = SPINLOCK_INITIALIZER;
 static volatile uint32_t ct_shootdowns_sent;
 static volatile uint32_t ct_shootdowns_done;
+static volatile uint32_t ct_shootdowns_lazy;
+static volatile uint32_t ct_shootdown_ipis;
 static volatile uint32_t ct_shootdown_interrupts;
 
+/* Protected by coremap_spinlock. */
+static uint32_t ct_pcache_refills;
+static uint32_t ct_pcache_drains;
+
+static void pcache_drain(struct cpu_vm_machdep *cvm, unsigned keep);
+
 ////////////////////////////////////////////////////////////
 //
 // Per-CPU data
@@ -130,32 +210,174 @@ cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 	cvm->cvm_lastas = NULL;
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+	cvm->cvm_tlbstale = 0;
+	spinlock_init(&cvm->cvm_tlblock);
+	cvm->cvm_shootchan = wchan_create("tlbshoot");
+	if (cvm->cvm_shootchan == NULL) {
+		panic("cpu_vm_machdep_init: Out of memory\n");
+	}
+
+	cvm->cvm_pcache_num = 0;
+	cvm->cvm_pcache_folded = 0;
+	cvm->cvm_nkernel = 0;
+	cvm->cvm_nuser = 0;
+	spinlock_init(&cvm->cvm_pcache_lock);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(num_coremap_cvms < MAXCPUS);
+	coremap_cvms[num_coremap_cvms++] = cvm;
+	spinlock_release(&coremap_spinlock);
 }
 
 void
 cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 {
-	(void)cvm;
-	/* nothing */
+	unsigned i;
+
+	/* give back any cached pages */
+	spinlock_acquire(&cvm->cvm_pcache_lock);
+	pcache_drain(cvm, 0);
+	spinlock_release(&cvm->cvm_pcache_lock);
+
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i<num_coremap_cvms; i++) {
+		if (coremap_cvms[i] == cvm) {
+			coremap_cvms[i] = coremap_cvms[--num_coremap_cvms];
+			break;
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+
+	spinlock_cleanup(&cvm->cvm_pcache_lock);
+	wchan_destroy(cvm->cvm_shootchan);
+	spinlock_cleanup(&cvm->cvm_tlblock);
+}
+
+static void tlb_flushstale(void);
+
+/*
+ * tlb_lock/tlb_unlock: lock and unlock the current cpu's TLB.
+ *
+ * We might get switched to another cpu between looking at curcpu and
+ * acquiring the lock, so check it didn't change; once we hold the
+ * lock interrupts are off and we stay put.
+ *
+ * Every use of the TLB goes through here, so this is also where
+ * slots shot down lazily get flushed.
+ */
+static
+void
+tlb_lock(void)
+{
+	struct cpu *c;
+
+	while (1) {
+		c = curcpu->c_self;
+		spinlock_acquire(&c->c_vm.cvm_tlblock);
+		if (c == curcpu->c_self) {
+			if (c->c_vm.cvm_tlbstale != 0) {
+				tlb_flushstale();
+			}
+			return;
+		}
+		spinlock_release(&c->c_vm.cvm_tlblock);
+	}
+}
+
+static
+void
+tlb_unlock(void)
+{
+	spinlock_release(&curcpu->c_vm.cvm_tlblock);
+}
+
+/*
+ * pcache_lock/pcache_unlock: same for the current cpu's page cache.
+ */
+static
+struct cpu_vm_machdep *
+pcache_lock(void)
+{
+	struct cpu *c;
+
+	while (1) {
+		c = curcpu->c_self;
+		spinlock_acquire(&c->c_vm.cvm_pcache_lock);
+		if (c == curcpu->c_self) {
+			return &c->c_vm;
+		}
+		spinlock_release(&c->c_vm.cvm_pcache_lock);
+	}
+}
+
+static
+void
+pcache_unlock(struct cpu_vm_machdep *cvm)
+{
+	spinlock_release(&cvm->cvm_pcache_lock);
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Stats
 
+/*
+ * coremap_counts: get the page counts including the changes the
+ * per-cpu page caches haven't folded in yet. Reads other cpus' counts
+ * without their locks, so the result is only good for diagnostics.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+coremap_counts(uint32_t *kernel, uint32_t *user, uint32_t *cached)
+{
+	struct cpu_vm_machdep *cvm;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	*kernel = num_coremap_kernel;
+	*user = num_coremap_user;
+	*cached = num_coremap_cached;
+	for (i=0; i<num_coremap_cvms; i++) {
+		cvm = coremap_cvms[i];
+		*kernel += cvm->cvm_nkernel;
+		*user += cvm->cvm_nuser;
+		*cached += cvm->cvm_pcache_num - cvm->cvm_pcache_folded;
+	}
+}
+
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sd, sl, sp, si;
+	uint32_t nk, nu, nc, nf, pr, pd;
 
-	spinlock_acquire(&coremap_spinlock);
+	spinlock_acquire(&coremap_statlock);
 	ss = ct_shootdowns_sent;
 	sd = ct_shootdowns_done;
+	sl = ct_shootdowns_lazy;
+	sp = ct_shootdown_ipis;
 	si = ct_shootdown_interrupts;
+	spinlock_release(&coremap_statlock);
+
+	spinlock_acquire(&coremap_spinlock);
+	coremap_counts(&nk, &nu, &nc);
+	nf = num_coremap_free;
+	pr = ct_pcache_refills;
+	pd = ct_pcache_drains;
 	spinlock_release(&coremap_spinlock);
 
-	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
-		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: shootdowns: %lu sent, %lu done, %lu lazy\n",
+		(unsigned long) ss, (unsigned long) sd, (unsigned long) sl);
+	kprintf("vm: shootdown IPIs: %lu sent, %lu interrupts\n",
+		(unsigned long) sp, (unsigned long) si);
+	kprintf("vm: pages: %lu kernel, %lu user, %lu free, %lu cached\n",
+		(unsigned long) nk, (unsigned long) nu, (unsigned long) nf,
+		(unsigned long) nc);
+	kprintf("vm: page caches: %lu refills, %lu drains\n",
+		(unsigned long) pr, (unsigned long) pd);
 }
 
 ////////////////////////////////////////////////////////////
@@ -166,13 +388,13 @@ vm_printmdstats(void)
  * tlb_replace - TLB replacement algorithm. Returns index of TLB entry
  * to replace.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block.
  */
 static
 uint32_t 
 tlb_replace(void) 
 {
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
 
 #if OPT_RANDTLB
 	/* random */
@@ -188,7 +410,9 @@ tlb_replace(void)
 /*
  * tlb_invalidate: marks a given tlb entry as invalid.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Clears cm_tlbix before cm_cpunum; do_evict relies on this.
+ *
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block.
  */
 static
 void
@@ -198,7 +422,7 @@ tlb_invalidate(int tlbix)
 	paddr_t pa;
 	unsigned cmix;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
 
 	tlb_read(&ehi, &elo, tlbix);
 	if (elo & TLBLO_VALID) {
@@ -220,7 +444,7 @@ tlb_invalidate(int tlbix)
 /*
  * tlb_clear: flushes the TLB by loading it with invalid entries.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block.
  */
 static
 void
@@ -228,7 +452,7 @@ tlb_clear(void)
 {
 	int i;	
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_invalidate(i);
 	}
@@ -236,28 +460,65 @@ tlb_clear(void)
 }
 
 /*
- * Do one TLB shootdown.
+ * tlb_flushstale: invalidate the TLB slots another cpu shot down
+ * lazily. Their coremap entries have already been cleared, so this
+ * only touches the TLB itself.
+ *
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block.
+ */
+static
+void
+tlb_flushstale(void)
+{
+	uint64_t stale;
+	int i;
+
+	COMPILE_ASSERT(NUM_TLB <= 64);
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+	stale = curcpu->c_vm.cvm_tlbstale;
+	for (i=0; i<NUM_TLB; i++) {
+		if (stale & ((uint64_t)1 << i)) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			DEBUG(DB_TLB, "... pa ------- <-- tlb %d (stale)\n",
+			      i);
+		}
+	}
+	curcpu->c_vm.cvm_tlbstale = 0;
+}
+
+/*
+ * Do the TLB shootdowns sent to this cpu, then wake whoever's waiting
+ * for them.
+ *
+ * Synchronization: takes this cpu's tlblock, not coremap_spinlock.
  */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 {
 	int i;
 	int tlbix;
-	unsigned where;
+	unsigned where, done;
 
-	spinlock_acquire(&coremap_spinlock);
-	ct_shootdown_interrupts++;
+	done = 0;
+	tlb_lock();
 	for (i=0; i<num; i++) {
 		tlbix = ts[i].ts_tlbix;
 		where = ts[i].ts_coremapindex;
 		if (coremap[where].cm_tlbix == tlbix &&
 		    coremap[where].cm_cpunum == curcpu->c_number) {
 			tlb_invalidate(tlbix);
-			ct_shootdowns_done++;
+			done++;
 		}
 	}
-	wchan_wakeall(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
+	tlb_unlock();
+
+	spinlock_acquire(&coremap_statlock);
+	ct_shootdown_interrupts++;
+	ct_shootdowns_done += done;
+	spinlock_release(&coremap_statlock);
+
+	wchan_wakeall(curcpu->c_vm.cvm_shootchan);
 }
 
 /*
@@ -266,32 +527,103 @@ vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 void
 vm_tlbshootdown_all(void)
 {
-	spinlock_acquire(&coremap_spinlock);
-	ct_shootdown_interrupts++;
+	tlb_lock();
 	tlb_clear();
+	tlb_unlock();
+
+	spinlock_acquire(&coremap_statlock);
+	ct_shootdown_interrupts++;
 	ct_shootdowns_done += NUM_TLB;
-	wchan_wakeall(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
+	spinlock_release(&coremap_statlock);
+
+	wchan_wakeall(curcpu->c_vm.cvm_shootchan);
 }
 
 /*
- * Wait for shootdown to complete.
+ * Wait for cpu CPUNUM to finish shooting down page WHERE.
+ *
+ * The shootdown handler doesn't take coremap_spinlock, so check the
+ * page with the wchan locked; the handler clears cm_tlbix before it
+ * does its wakeup, so the wakeup can't get lost.
  */
 static
 void
-tlb_shootwait(void)
+tlb_shootwait(unsigned where, unsigned cpunum)
 {
-	wchan_lock(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_shootchan);
-	spinlock_acquire(&coremap_spinlock);
+	struct wchan *wc;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	wc = cpu_bynumber(cpunum)->c_vm.cvm_shootchan;
+	while (1) {
+		wchan_lock(wc);
+		if (coremap[where].cm_tlbix < 0) {
+			wchan_unlock(wc);
+			return;
+		}
+		spinlock_release(&coremap_spinlock);
+		wchan_sleep(wc);
+		spinlock_acquire(&coremap_spinlock);
+	}
+}
+
+/*
+ * Try to shoot down the mapping of page WHERE in slot TLBIX of cpu
+ * CPUNUM without interrupting it. Returns true if the mapping is
+ * gone, false if an IPI is needed after all.
+ *
+ * A cpu only uses its user TLB entries while it's running a thread
+ * with an address space, and any switch to such a thread goes
+ * through mmu_setas and thus tlb_lock. So if the cpu is running the
+ * idle thread or a kernel thread, we can clear the coremap's record
+ * of the mapping ourselves and leave the slot for it to flush the
+ * next time it locks its TLB.
+ *
+ * c_curthread is read without the cpu's runqueue lock; a stale value
+ * is fine, because a thread with an address space that gets switched
+ * in after we look will stop at the tlblock we hold.
+ *
+ * Synchronization: takes cpu CPUNUM's tlblock. Does not block.
+ */
+static
+bool
+tlb_lazyshoot(unsigned where, int tlbix, unsigned cpunum)
+{
+	struct cpu *c;
+	struct thread *t;
+	bool done;
+
+	c = cpu_bynumber(cpunum);
+
+	spinlock_acquire(&c->c_vm.cvm_tlblock);
+	if (coremap[where].cm_tlbix != tlbix ||
+	    coremap[where].cm_cpunum != cpunum) {
+		/* It dropped the mapping on its own. */
+		KASSERT(coremap[where].cm_tlbix == -1);
+		done = true;
+	}
+	else {
+		t = c->c_curthread;
+		if (t != NULL && t->t_addrspace == NULL) {
+			c->c_vm.cvm_tlbstale |= (uint64_t)1 << tlbix;
+			coremap[where].cm_tlbix = -1;
+			coremap[where].cm_cpunum = 0;
+			done = true;
+		}
+		else {
+			done = false;
+		}
+	}
+	spinlock_release(&c->c_vm.cvm_tlblock);
+
+	return done;
 }
 
 /*
  * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
  * it if it exists.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block. 
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block. 
  */
 static
 void
@@ -300,7 +632,7 @@ tlb_unmap(vaddr_t va)
 	int i;
 	uint32_t elo = 0, ehi = 0;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
 
 	KASSERT(va < MIPS_KSEG0);
 
@@ -321,6 +653,8 @@ tlb_unmap(vaddr_t va)
 /*
  * mipstlb_getslot: get a TLB slot for use, replacing an existing one if
  * necessary and peforming any at-replacement actions.
+ *
+ * Synchronization: assumes we hold this cpu's tlblock. Does not block.
  */
 static
 int
@@ -328,6 +662,8 @@ mipstlb_getslot(void)
 {
 	int i;
 
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
 	if (curcpu->c_vm.cvm_nexttlb < NUM_TLB) {
 		return curcpu->c_vm.cvm_nexttlb++;
 	}
@@ -344,12 +680,21 @@ mipstlb_getslot(void)
 //
 
 /*
- * To evict a page, it must be non-kernel and non-pinned.
+ * To evict a page, it must be non-kernel and non-pinned. Pages in a
+ * per-cpu page cache (cm_cached) aren't candidates either.
  *
  * page_replace() takes no arguments and returns an index into the
- * coremap (for the selected victim page).
+ * coremap (for the selected victim page). It only proposes pages;
+ * do_page_replace pins them, and chooses among several according to
+ * the owning processes' RSS limits and working sets.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 
+#define PAGE_REPLACE_OK(ix) \
+	(!coremap[ix].cm_pinned && !coremap[ix].cm_kernel && \
+	 !coremap[ix].cm_cached)
+
 #if OPT_RANDPAGE
 
 /*
@@ -357,13 +702,24 @@ mipstlb_getslot(void)
  *
  * Repeatedly generates a random index into the coremap until the 
  * selected page is not pinned and does not belong to the kernel.
+ * (Gives up after a while and lets the caller sort it out.)
  */
 static
 uint32_t 
 page_replace(void)
 {
-    // Complete this function.
-	return 0;
+	uint32_t where, tries;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	where = 0;
+	for (tries = 0; tries < num_coremap_entries; tries++) {
+		where = random() % num_coremap_entries;
+		if (PAGE_REPLACE_OK(where)) {
+			break;
+		}
+	}
+	return where;
 }
 
 #else /* not OPT_RANDPAGE */
@@ -375,12 +731,25 @@ page_replace(void)
  * pages that are pinned or that belong to the kernel.
  */
 
+static uint32_t page_replace_hand;	/* under coremap_spinlock */
+
 static
 uint32_t
 page_replace(void)
 {
-	// Complete this function.
-	return 0;
+	uint32_t where, tries;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	where = 0;
+	for (tries = 0; tries < num_coremap_entries; tries++) {
+		where = page_replace_hand;
+		page_replace_hand = (where + 1) % num_coremap_entries;
+		if (PAGE_REPLACE_OK(where)) {
+			break;
+		}
+	}
+	return where;
 }
 
 #endif /* OPT_RANDPAGE */
@@ -463,6 +832,7 @@ coremap_bootstrap(void)
 	num_coremap_kernel = 0;
 	num_coremap_user = 0;
 	num_coremap_free = num_coremap_entries;
+	num_coremap_cached = 0;
 
 	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
 
@@ -473,16 +843,19 @@ coremap_bootstrap(void)
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_cached = 0;
 		coremap[i].cm_pinned = 0;
 		coremap[i].cm_tlbix = -1;
 		coremap[i].cm_cpunum = 0;
 		coremap[i].cm_lpage = NULL;
 	}
 
-	coremap_pinchan = wchan_create("vmpin");
-	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
-		panic("Failed allocating coremap wchans\n");
+	for (i=0; i < CM_PINLOCKS; i++) {
+		spinlock_init(&coremap_pinlocks[i]);
+		coremap_pinchans[i] = wchan_create("vmpin");
+		if (coremap_pinchans[i] == NULL) {
+			panic("Failed allocating coremap wchans\n");
+		}
 	}
 }	
 
@@ -506,99 +879,270 @@ piggish_kernel(int proposed_kernel_pages)
 	return 0;
 }
 
+/*
+ * coremap_trypin: pin page IX if it isn't already pinned. Returns 1 if
+ * we pinned it, 0 if not.
+ *
+ * Synchronization: takes the page's pin lock. Does not block.
+ */
+static
+int
+coremap_trypin(unsigned ix)
+{
+	int rv;
+
+	spinlock_acquire(CM_PINLOCK(ix));
+	if (coremap[ix].cm_pinned) {
+		rv = 0;
+	}
+	else {
+		coremap[ix].cm_pinned = 1;
+		rv = 1;
+	}
+	spinlock_release(CM_PINLOCK(ix));
+	return rv;
+}
+
+/*
+ * coremap_unpin_ix: unpin page IX and wake anyone waiting for it.
+ *
+ * Synchronization: takes the page's pin lock. Does not block.
+ */
+static
+void
+coremap_unpin_ix(unsigned ix)
+{
+	spinlock_acquire(CM_PINLOCK(ix));
+	KASSERT(coremap[ix].cm_pinned);
+	coremap[ix].cm_pinned = 0;
+	wchan_wakeall(CM_PINCHAN(ix));
+	spinlock_release(CM_PINLOCK(ix));
+}
+
+/*
+ * do_evict_batch: evict the N pages in WHERE, which the caller has
+ * pinned, so they don't get e.g. paged out by someone else while
+ * we're waiting for TLB shootdown. Leaves them free and unpinned.
+ *
+ * All the TLB shootdowns go out before we wait for any of them, with
+ * one IPI per cpu, so evicting several pages costs about one round
+ * trip rather than one each.
+ */
 static
 void
-do_evict(int where)
+do_evict_batch(const unsigned *where, unsigned n)
 {
 	struct lpage *lp;
+	struct tlbshootdown ts;
+	int tlbix;
+	unsigned i, j, w, cpunum;
+	int shootcpu[CM_EVICT_BATCH];	/* cpu we IPI'd, or -1 */
+	unsigned nsent, nlazy, nipis;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
 	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_allocated);
-	KASSERT(coremap[where].cm_kernel==0);
-
-	lp = coremap[where].cm_lpage;
-	KASSERT(lp != NULL);
+	KASSERT(n <= CM_EVICT_BATCH);
 
 	/*
-	 * Pin it now, so it doesn't get e.g. paged out by someone
-	 * else while we're waiting for TLB shootdown.
+	 * First get rid of the TLB mappings.
 	 */
-	coremap[where].cm_pinned = 1;
+	nsent = nlazy = nipis = 0;
+	for (i=0; i<n; i++) {
+		w = where[i];
+		shootcpu[i] = -1;
 
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
+		KASSERT(coremap[w].cm_pinned);
+		KASSERT(coremap[w].cm_allocated);
+		KASSERT(coremap[w].cm_kernel==0);
+		KASSERT(coremap[w].cm_cached==0);
+		KASSERT(coremap[w].cm_lpage != NULL);
+
+		/*
+		 * Because the page is pinned nobody can map it, but
+		 * the cpu it's mapped on can drop the mapping at any
+		 * time. That cpu clears cm_tlbix before cm_cpunum, so
+		 * if cm_tlbix is still the same after we read
+		 * cm_cpunum, the two go together.
+		 */
+		tlbix = coremap[w].cm_tlbix;
+		cpunum = coremap[w].cm_cpunum;
+		if (tlbix < 0 || coremap[w].cm_tlbix != tlbix) {
+			continue;
+		}
+		if (cpunum == curcpu->c_number) {
+			tlb_lock();
+			if (coremap[w].cm_tlbix >= 0) {
+				tlb_invalidate(coremap[w].cm_tlbix);
 			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
+			tlb_unlock();
+		}
+		else if (tlb_lazyshoot(w, tlbix, cpunum)) {
+			nlazy++;
 		}
 		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
+			/* yay, TLB shootdown */
+			ts.ts_tlbix = tlbix;
+			ts.ts_coremapindex = w;
+			ipi_tlbshootdown_queue(cpunum, &ts);
+			shootcpu[i] = cpunum;
+			nsent++;
 		}
 		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
+		      (unsigned long) COREMAP_TO_PADDR(w));
+	}
+
+	/* One IPI for each cpu with shootdowns queued. */
+	for (i=0; i<n; i++) {
+		if (shootcpu[i] < 0) {
+			continue;
+		}
+		for (j=0; j<i; j++) {
+			if (shootcpu[j] == shootcpu[i]) {
+				break;
+			}
+		}
+		if (j == i) {
+			ipi_send(cpu_bynumber(shootcpu[i]), IPI_TLBSHOOTDOWN);
+			nipis++;
+		}
 	}
 
-	/* properly we ought to lock the lpage to test this */
-	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
+	if (nsent > 0 || nlazy > 0) {
+		spinlock_acquire(&coremap_statlock);
+		ct_shootdowns_sent += nsent;
+		ct_shootdowns_lazy += nlazy;
+		ct_shootdown_ipis += nipis;
+		spinlock_release(&coremap_statlock);
+	}
 
-	/* release the coremap spinlock in case we need to swap out */
-	spinlock_release(&coremap_spinlock);
+	for (i=0; i<n; i++) {
+		if (shootcpu[i] >= 0) {
+			tlb_shootwait(where[i], shootcpu[i]);
+		}
+		KASSERT(coremap[where[i]].cm_tlbix == -1);
+		KASSERT(coremap[where[i]].cm_cpunum == 0);
+	}
 
-	lpage_evict(lp);
+	/*
+	 * Now page them out.
+	 */
+	for (i=0; i<n; i++) {
+		w = where[i];
+		lp = coremap[w].cm_lpage;
+		KASSERT(lp != NULL);
 
-	spinlock_acquire(&coremap_spinlock);
+		/* properly we ought to lock the lpage to test this */
+		KASSERT(COREMAP_TO_PADDR(w) == (lp->lp_paddr & PAGE_FRAME));
 
-	/* because the page is pinned these shouldn't have changed */
-	KASSERT(coremap[where].cm_allocated == 1);
-	KASSERT(coremap[where].cm_lpage == lp);
-	KASSERT(coremap[where].cm_pinned == 1);
+		/* release the coremap spinlock in case we need to swap out */
+		spinlock_release(&coremap_spinlock);
 
-	coremap[where].cm_allocated = 0;
-	coremap[where].cm_lpage = NULL;
-	coremap[where].cm_pinned = 0;
+		lpage_evict(lp);
 
-	num_coremap_user--;
-	num_coremap_free++;
-	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+		spinlock_acquire(&coremap_spinlock);
 
-	wchan_wakeall(coremap_pinchan);
+		/* because the page is pinned these shouldn't have changed */
+		KASSERT(coremap[w].cm_allocated == 1);
+		KASSERT(coremap[w].cm_lpage == lp);
+		KASSERT(coremap[w].cm_pinned == 1);
+
+		coremap[w].cm_allocated = 0;
+		coremap[w].cm_lpage = NULL;
+		as_rss_adjust(lp->lp_as, -1);
+
+		num_coremap_user--;
+		num_coremap_free++;
+		KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+			+num_coremap_cached == num_coremap_entries);
+
+		coremap_unpin_ix(w);
+	}
+}
+
+/*
+ * do_evict: evict the single page WHERE, as above.
+ */
+static
+void
+do_evict(unsigned where)
+{
+	do_evict_batch(&where, 1);
 }
 
 static
 int
 do_page_replace(void)
 {
-	int where;
+	int where, candidate, class, bestclass;
+	uint32_t tries, looked;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(lock_do_i_hold(global_paging_lock));
 
-	where = page_replace();
-
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_kernel==0);
+	/*
+	 * Pinning no longer needs coremap_spinlock, so the page
+	 * page_replace() picked may have been pinned (or handed out by
+	 * a page cache) since it looked. Pin it ourselves to be sure,
+	 * and if that fails ask again.
+	 *
+	 * Look at up to CM_REPLACE_LOOKAHEAD candidates and keep the
+	 * best one pinned: a page of a process over its RSS soft
+	 * limit, else one outside its process's working set, else the
+	 * first. Once pinned, a page's lpage can't go away, so it's
+	 * safe to look at.
+	 */
+	where = -1;
+	bestclass = -1;
+	looked = 0;
+	for (tries = 0; ; tries++) {
+		if (tries > num_coremap_entries) {
+			if (where >= 0) {
+				break;
+			}
+			panic("do_page_replace: no page can be replaced\n");
+		}
+		candidate = page_replace();
+		KASSERT((uint32_t)candidate < num_coremap_entries);
+		if (!coremap_trypin(candidate)) {
+			continue;
+		}
+		if (coremap[candidate].cm_kernel ||
+		    coremap[candidate].cm_cached) {
+			coremap_unpin_ix(candidate);
+			continue;
+		}
+		if (coremap[candidate].cm_allocated) {
+			class = as_evict_class(coremap[candidate].cm_lpage);
+		}
+		else {
+			/* A free page; can't do better than that. */
+			class = AS_EVICT_OVERLIMIT + 1;
+		}
+		if (class > bestclass) {
+			if (where >= 0) {
+				coremap_unpin_ix(where);
+			}
+			where = candidate;
+			bestclass = class;
+		}
+		else {
+			coremap_unpin_ix(candidate);
+		}
+		if (bestclass >= AS_EVICT_OVERLIMIT ||
+		    ++looked >= CM_REPLACE_LOOKAHEAD) {
+			break;
+		}
+	}
 
 	if (coremap[where].cm_allocated) {
 		KASSERT(coremap[where].cm_lpage != NULL);
 		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
 		do_evict(where);
 	}
+	else {
+		coremap_unpin_ix(where);
+	}
 
 	return where;
 }
@@ -613,6 +1157,7 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	for (i=start; i<start+npages; i++) {
 		KASSERT(coremap[i].cm_pinned==0);
 		KASSERT(coremap[i].cm_allocated==0);
+		KASSERT(coremap[i].cm_cached==0);
 		KASSERT(coremap[i].cm_kernel==0);
 		KASSERT(coremap[i].cm_lpage==NULL);
 		KASSERT(coremap[i].cm_tlbix<0);
@@ -638,15 +1183,298 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	}
 	num_coremap_free -= npages;
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+		+num_coremap_cached == num_coremap_entries);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-CPU page caches
+//
+
+/*
+ * pcache_fold: add a page cache's unfolded changes into the global
+ * page counts.
+ *
+ * Synchronization: assumes we hold the cache's lock and coremap_spinlock.
+ */
+static
+void
+pcache_fold(struct cpu_vm_machdep *cvm)
+{
+	KASSERT(spinlock_do_i_hold(&cvm->cvm_pcache_lock));
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	num_coremap_kernel += cvm->cvm_nkernel;
+	num_coremap_user += cvm->cvm_nuser;
+	num_coremap_cached += cvm->cvm_pcache_num - cvm->cvm_pcache_folded;
+	cvm->cvm_nkernel = 0;
+	cvm->cvm_nuser = 0;
+	cvm->cvm_pcache_folded = cvm->cvm_pcache_num;
+
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+		+num_coremap_cached == num_coremap_entries);
+}
+
+/*
+ * pcache_refill: move up to CM_PCACHE_BATCH free pages from the global
+ * pool into an empty page cache. Like coremap_alloc_one_page, take
+ * them from the top end of memory.
+ *
+ * Synchronization: assumes we hold the cache's lock; takes
+ * coremap_spinlock. Does not block.
+ */
+static
+void
+pcache_refill(struct cpu_vm_machdep *cvm)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&cvm->cvm_pcache_lock));
+	KASSERT(cvm->cvm_pcache_num == 0);
+
+	spinlock_acquire(&coremap_spinlock);
+	for (i = num_coremap_entries-1;
+	     i >= 0 && num_coremap_free > 0 &&
+		     cvm->cvm_pcache_num < CM_PCACHE_BATCH;
+	     i--) {
+		if (coremap[i].cm_pinned || coremap[i].cm_allocated ||
+		    coremap[i].cm_cached) {
+			continue;
+		}
+		KASSERT(coremap[i].cm_kernel==0);
+		KASSERT(coremap[i].cm_lpage==NULL);
+		KASSERT(coremap[i].cm_tlbix<0);
+		coremap[i].cm_cached = 1;
+		cvm->cvm_pcache[cvm->cvm_pcache_num++] = i;
+		num_coremap_free--;
+	}
+	ct_pcache_refills++;
+	pcache_fold(cvm);
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * pcache_drain: give all but KEEP pages in a page cache back to the
+ * global pool. The oldest pages go first; the most recently freed
+ * ones are the likeliest to still be in the processor cache.
+ *
+ * Synchronization: assumes we hold the cache's lock; takes
+ * coremap_spinlock. Does not block.
+ */
+static
+void
+pcache_drain(struct cpu_vm_machdep *cvm, unsigned keep)
+{
+	unsigned i, n;
+	uint32_t ix;
+
+	KASSERT(spinlock_do_i_hold(&cvm->cvm_pcache_lock));
+
+	spinlock_acquire(&coremap_spinlock);
+	n = cvm->cvm_pcache_num > keep ? cvm->cvm_pcache_num - keep : 0;
+	for (i=0; i<n; i++) {
+		ix = cvm->cvm_pcache[i];
+		KASSERT(coremap[ix].cm_cached);
+		KASSERT(coremap[ix].cm_allocated==0);
+		coremap[ix].cm_cached = 0;
+		num_coremap_free++;
+	}
+	for (i=n; i<cvm->cvm_pcache_num; i++) {
+		cvm->cvm_pcache[i-n] = cvm->cvm_pcache[i];
+	}
+	cvm->cvm_pcache_num -= n;
+	ct_pcache_drains++;
+	pcache_fold(cvm);
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * pcache_drain_all: empty every cpu's page cache, for when a multipage
+ * allocation can't find room otherwise.
+ *
+ * Synchronization: takes each cache's lock and coremap_spinlock.
+ * cpus are only added during boot, so we look at the list of them
+ * without a lock.
+ */
+static
+void
+pcache_drain_all(void)
+{
+	struct cpu_vm_machdep *cvm;
+	unsigned i;
+
+	KASSERT(!spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<num_coremap_cvms; i++) {
+		cvm = coremap_cvms[i];
+		spinlock_acquire(&cvm->cvm_pcache_lock);
+		pcache_drain(cvm, 0);
+		spinlock_release(&cvm->cvm_pcache_lock);
+	}
 }
 
+/*
+ * pcache_alloc: allocate one page from this cpu's page cache,
+ * refilling it first if it's empty. Returns the coremap index, or -1
+ * if the slow path needs to deal with it.
+ *
+ * User pages stay pinned after coremap_free until the caller unpins
+ * them, and do_page_replace pins pages to look at them, so claim a
+ * cached page by pinning it and skip any we can't pin.
+ *
+ * Synchronization: takes this cpu's pcache lock, a pin lock, and
+ * coremap_spinlock if refilling. Does not block.
+ */
+static
+int
+pcache_alloc(struct lpage *lp, int dopin)
+{
+	struct cpu_vm_machdep *cvm;
+	unsigned i;
+	int where;
+	uint32_t ix;
+
+	cvm = pcache_lock();
+
+	/*
+	 * Don't allow the kernel to eat everything. This only sees our
+	 * own unfolded pages, so it's approximate; if it's at all close
+	 * let the slow path check properly.
+	 */
+	if (lp == NULL &&
+	    num_coremap_kernel + cvm->cvm_nkernel + CVM_PCACHE_SIZE >=
+	    num_coremap_entries - CM_MIN_SLACK) {
+		pcache_unlock(cvm);
+		return -1;
+	}
+
+	if (cvm->cvm_pcache_num == 0) {
+		pcache_refill(cvm);
+	}
+
+	where = -1;
+	for (i = cvm->cvm_pcache_num; i-- > 0; ) {
+		ix = cvm->cvm_pcache[i];
+		if (coremap_trypin(ix)) {
+			where = ix;
+			for (; i+1 < cvm->cvm_pcache_num; i++) {
+				cvm->cvm_pcache[i] = cvm->cvm_pcache[i+1];
+			}
+			cvm->cvm_pcache_num--;
+			break;
+		}
+	}
+	if (where < 0) {
+		pcache_unlock(cvm);
+		return -1;
+	}
+
+	KASSERT(coremap[where].cm_cached);
+	KASSERT(coremap[where].cm_allocated==0);
+	KASSERT(coremap[where].cm_kernel==0);
+	KASSERT(coremap[where].cm_lpage==NULL);
+	KASSERT(coremap[where].cm_tlbix<0);
+	KASSERT(coremap[where].cm_cpunum == 0);
+
+	/*
+	 * do_page_replace and the pin waiters only look at a page's
+	 * fields while they hold its pin, so holding it ourselves keeps
+	 * them off until the page is set up. Set cm_allocated before
+	 * clearing cm_cached so it's never seen as a plain free page.
+	 */
+	coremap[where].cm_lpage = lp;
+	if (lp == NULL) {
+		coremap[where].cm_kernel = 1;
+		cvm->cvm_nkernel++;
+	}
+	else {
+		cvm->cvm_nuser++;
+	}
+	coremap[where].cm_allocated = 1;
+	coremap[where].cm_cached = 0;
+
+	pcache_unlock(cvm);
+
+	if (!dopin) {
+		coremap_unpin_ix(where);
+	}
+	return where;
+}
+
+/*
+ * pcache_free: free one page into this cpu's page cache, draining it
+ * first if it's full.
+ *
+ * Synchronization: takes this cpu's pcache lock and tlblock, and
+ * coremap_spinlock if draining. Does not block.
+ */
+static
+void
+pcache_free(uint32_t ix, bool iskern)
+{
+	struct cpu_vm_machdep *cvm;
+
+	cvm = pcache_lock();
+
+	if (!coremap[ix].cm_allocated) {
+		panic("coremap_free: freeing free page (pa 0x%x)\n",
+		      COREMAP_TO_PADDR(ix));
+	}
+	KASSERT(!coremap[ix].cm_notlast);
+	KASSERT(iskern || coremap[ix].cm_pinned);
+
+	/* flush any live mapping */
+	if (coremap[ix].cm_tlbix >= 0) {
+		tlb_lock();
+		/* should only release one's own pages */
+		KASSERT(coremap[ix].cm_cpunum == curcpu->c_number);
+		tlb_invalidate(coremap[ix].cm_tlbix);
+		tlb_unlock();
+
+		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+			(unsigned long) COREMAP_TO_PADDR(ix));
+	}
+
+	DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n", COREMAP_TO_PADDR(ix));
+
+	if (cvm->cvm_pcache_num == CVM_PCACHE_SIZE) {
+		pcache_drain(cvm, CVM_PCACHE_SIZE - CM_PCACHE_BATCH);
+	}
+
+	/* the reverse of pcache_alloc */
+	coremap[ix].cm_cached = 1;
+	coremap[ix].cm_allocated = 0;
+	if (coremap[ix].cm_kernel) {
+		KASSERT(coremap[ix].cm_lpage == NULL);
+		KASSERT(iskern);
+		coremap[ix].cm_kernel = 0;
+		cvm->cvm_nkernel--;
+	}
+	else {
+		KASSERT(coremap[ix].cm_lpage != NULL);
+		KASSERT(!iskern);
+		cvm->cvm_nuser--;
+	}
+	coremap[ix].cm_lpage = NULL;
+	cvm->cvm_pcache[cvm->cvm_pcache_num++] = ix;
+
+	pcache_unlock(cvm);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation interface
+//
+
 /*
  * coremap_alloc_one_page
  *
  * Allocate one page of memory, mark it pinned if requested, and
  * return its paddr. The page is marked a kernel page iff the lp
  * argument is NULL.
+ *
+ * Most of the time this is satisfied from the per-cpu page cache;
+ * otherwise it falls back to searching the coremap.
  */
 static
 paddr_t
@@ -656,6 +1484,13 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 
 	iskern = (lp == NULL);
 
+	if (CURCPU_EXISTS()) {
+		candidate = pcache_alloc(lp, dopin);
+		if (candidate >= 0) {
+			return COREMAP_TO_PADDR(candidate);
+		}
+	}
+
 	/*
 	 * Hold this while allocating to reduce starvation of multipage
 	 * allocations. (But we can't if we're in an interrupt, or if
@@ -693,7 +1528,8 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 		/* There's a free page. Find it. */
 
 		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
+			if (coremap[i].cm_pinned || coremap[i].cm_allocated ||
+			    coremap[i].cm_cached) {
 				continue;
 			}
 			KASSERT(coremap[i].cm_kernel==0);
@@ -736,8 +1572,9 @@ coremap_alloc_multipages(unsigned npages)
 {
 	int base, bestbase;
 	int badness, bestbadness;
-	int evicted;
+	int retry, drained;
 	unsigned i;
+	unsigned evict[CM_EVICT_BATCH], nevict;
 
 	KASSERT(npages>1);
 
@@ -770,13 +1607,15 @@ coremap_alloc_multipages(unsigned npages)
 	 * Find the block where it's smallest.
 	 */
 
+	drained = 0;
 	do {
 		bestbase = -1;
 		bestbadness = npages*2;
 		base = -1;
 		badness = 0;
 		for (i=0; i<num_coremap_entries; i++) {
-			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
+			if (coremap[i].cm_pinned || coremap[i].cm_kernel ||
+			    coremap[i].cm_cached) {
 				base = -1;
 				badness = 0;
 				continue;
@@ -813,6 +1652,19 @@ coremap_alloc_multipages(unsigned npages)
 			}
 		}
 
+		if (bestbase < 0 && !drained) {
+			/*
+			 * Maybe the pages in the per-cpu caches are in
+			 * the way. Get them out and look again.
+			 */
+			spinlock_release(&coremap_spinlock);
+			pcache_drain_all();
+			spinlock_acquire(&coremap_spinlock);
+			drained = 1;
+			retry = 1;
+			continue;
+		}
+
 		if (bestbase < 0) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
@@ -828,30 +1680,60 @@ coremap_alloc_multipages(unsigned npages)
 		 * global_paging_lock, nobody else *ought* to allocate
 		 * or pin these pages until we're done. But the
 		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * advisory, and the per-cpu page caches and pinning
+		 * don't go through coremap_spinlock -- so tolerate
+		 * and retry if/in case something changes.
+		 *
+		 * An allocated page can only be freed by whoever has
+		 * it pinned, so check cm_allocated again once we've
+		 * pinned it. Free pages only change state under
+		 * coremap_spinlock, so a pass with no evictions has
+		 * seen the whole range stable.
 		 */
 
-		evicted = 0;
+		retry = 0;
+		nevict = 0;
 		for (i=bestbase; i<bestbase+npages; i++) {
-			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
-				/* Whoops... retry */
-				KASSERT(evicted==1);
+			if (coremap[i].cm_kernel) {
+				retry = 1;
 				break;
 			}
 			if (coremap[i].cm_allocated) {
 				if (curthread == NULL ||
 				    curthread->t_in_interrupt) {
 					/* Can't evict here */
+					KASSERT(nevict == 0);
 					spinlock_release(&coremap_spinlock);
 					/* don't need to unlock */
 					return INVALID_PADDR;
 				}
-				do_evict(i);
-				evicted = 1;
+				if (!coremap_trypin(i)) {
+					retry = 1;
+					break;
+				}
+				if (!coremap[i].cm_allocated ||
+				    coremap[i].cm_kernel) {
+					coremap_unpin_ix(i);
+					retry = 1;
+					break;
+				}
+				/* Evict in batches to share shootdowns. */
+				evict[nevict++] = i;
+				retry = 1;
+				if (nevict == CM_EVICT_BATCH) {
+					break;
+				}
+				continue;
 			}
+			if (coremap[i].cm_cached || coremap[i].cm_pinned) {
+				retry = 1;
+				break;
+			}
+		}
+		if (nevict > 0) {
+			do_evict_batch(evict, nevict);
 		}
-	} while (evicted);
+	} while (retry);
 
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
@@ -868,16 +1750,22 @@ coremap_alloc_multipages(unsigned npages)
  * coremap_allocuser
  *
  * Allocate a page for a user-level process, to hold the passed-in
- * logical page.
+ * logical page, and count it in the owning address space's RSS.
  *
- * Synchronization: takes coremap_spinlock.
- * May block to swap pages out.
+ * Synchronization: takes this cpu's pcache lock and/or
+ * coremap_spinlock. May block to swap pages out.
  */
 paddr_t
 coremap_allocuser(struct lpage *lp)
 {
+	paddr_t pa;
+
 	KASSERT(!curthread->t_in_interrupt);
-	return coremap_alloc_one_page(lp, 1 /* dopin */);
+	pa = coremap_alloc_one_page(lp, 1 /* dopin */);
+	if (pa != INVALID_PADDR) {
+		as_rss_adjust(lp->lp_as, 1);
+	}
+	return pa;
 }
 
 /*
@@ -885,9 +1773,11 @@ coremap_allocuser(struct lpage *lp)
  *
  * Deallocates the passed paddr and any subsequent pages allocated in
  * the same block. Cross-checks the iskern flag against the flags
- * maintained in the coremap entry.
+ * maintained in the coremap entry. Single pages go to this cpu's page
+ * cache. User pages stop counting in their address space's RSS.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes this cpu's pcache lock or coremap_spinlock,
+ * and this cpu's tlblock. Does not block.
  */
 void
 coremap_free(paddr_t page, bool iskern)
@@ -896,10 +1786,22 @@ coremap_free(paddr_t page, bool iskern)
 
 	ppn = PADDR_TO_COREMAP(page);	
 	
-	spinlock_acquire(&coremap_spinlock);
-
 	KASSERT(ppn<num_coremap_entries);
 
+	if (!iskern) {
+		/* The page is pinned, so cm_lpage is stable. */
+		KASSERT(coremap[ppn].cm_pinned);
+		KASSERT(coremap[ppn].cm_lpage != NULL);
+		as_rss_adjust(coremap[ppn].cm_lpage->lp_as, -1);
+	}
+
+	if (CURCPU_EXISTS() && !coremap[ppn].cm_notlast) {
+		pcache_free(ppn, iskern);
+		return;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+
 	for (i = ppn; i < num_coremap_entries; i++) {
 		if (!coremap[i].cm_allocated) {
 			panic("coremap_free: freeing free page (pa 0x%x)\n",
@@ -915,12 +1817,11 @@ coremap_free(paddr_t page, bool iskern)
 
 		/* flush any live mapping */
 		if (coremap[i].cm_tlbix >= 0) {
+			tlb_lock();
 			/* should only release one's own pages */
 			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
-
 			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
+			tlb_unlock();
 
 			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
 				(unsigned long) COREMAP_TO_PADDR(i));
@@ -963,8 +1864,8 @@ coremap_free(paddr_t page, bool iskern)
  * Allocate some kernel-space virtual pages.
  * This is the interface kmalloc uses to get pages for its use.
  *
- * Synchronization: takes coremap_spinlock.
- * May block to swap pages out.
+ * Synchronization: takes this cpu's pcache lock and/or
+ * coremap_spinlock. May block to swap pages out.
  */
 vaddr_t 
 alloc_kpages(int npages)
@@ -986,7 +1887,8 @@ alloc_kpages(int npages)
  * free_kpages
  *
  * Free pages allocated with alloc_kpages.
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes this cpu's pcache lock or coremap_spinlock.
+ * Does not block.
  */
 void 
 free_kpages(vaddr_t addr)
@@ -1007,12 +1909,13 @@ void
 coremap_print_short(void)
 {
 	uint32_t i, atbol=1;
+	uint32_t nk, nu, nc;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-		
-	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
-		num_coremap_entries,
-		num_coremap_kernel, num_coremap_user, num_coremap_free);
+
+	coremap_counts(&nk, &nu, &nc);
+	kprintf("Coremap: %u entries, %uk/%uu/%uf/%uc\n",
+		num_coremap_entries, nk, nu, num_coremap_free, nc);
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1031,6 +1934,9 @@ coremap_print_short(void)
 		else if (coremap[i].cm_allocated) {
 			kprintf("*");
 		}
+		else if (coremap[i].cm_cached) {
+			kprintf("c");
+		}
 		else {
 			kprintf(".");
 		}
@@ -1046,22 +1952,23 @@ coremap_print_short(void)
 #undef NCOLS
 
 /*
- * coremap_pinwait: wait for a pinned page to unpin.
+ * coremap_pinwait: wait for pinned page IX to unpin.
  */
 static
 void
-coremap_pinwait(void)
+coremap_pinwait(unsigned ix)
 {
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
+	wchan_lock(CM_PINCHAN(ix));
+	spinlock_release(CM_PINLOCK(ix));
+	wchan_sleep(CM_PINCHAN(ix));
+	spinlock_acquire(CM_PINLOCK(ix));
 }
 
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
- * Synchronization: takes coremap_spinlock. Blocks if page is already pinned.
+ * Synchronization: takes the page's pin lock. Blocks if page is
+ * already pinned.
  */
 void
 coremap_pin(paddr_t paddr)
@@ -1071,18 +1978,18 @@ coremap_pin(paddr_t paddr)
 	ix = PADDR_TO_COREMAP(paddr);
 	KASSERT(ix<num_coremap_entries);
 
-	spinlock_acquire(&coremap_spinlock);
+	spinlock_acquire(CM_PINLOCK(ix));
 	while (coremap[ix].cm_pinned) {
-		coremap_pinwait();
+		coremap_pinwait(ix);
 	}
 	coremap[ix].cm_pinned = 1;
-	spinlock_release(&coremap_spinlock);
+	spinlock_release(CM_PINLOCK(ix));
 }
 
 /*
  * coremap_pageispinned: checks if page is marked pinned.
  *
- * Synchronization: does *not* take coremap_spinlock - we are reading
+ * Synchronization: does *not* take the pin lock - we are reading
  * a single bit and that had *better* be atomic, or the processor is
  * in deep trouble.
  */
@@ -1095,7 +2002,7 @@ coremap_pageispinned(paddr_t paddr)
 	ix = PADDR_TO_COREMAP(paddr);
 	KASSERT(ix<num_coremap_entries);
 
-	/* Do this fast and loose without the spinlock. */
+	/* Do this fast and loose without the pin lock. */
 	rv = coremap[ix].cm_pinned != 0;
 
 	return rv;
@@ -1105,7 +2012,7 @@ coremap_pageispinned(paddr_t paddr)
  * coremap_unpin: unpin a page that was pinned with coremap_pin or
  * coremap_allocuser.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes the page's pin lock. Does not block.
  */
 void
 coremap_unpin(paddr_t paddr)
@@ -1115,11 +2022,7 @@ coremap_unpin(paddr_t paddr)
 	ix = PADDR_TO_COREMAP(paddr);
 	KASSERT(ix<num_coremap_entries);
 
-	spinlock_acquire(&coremap_spinlock);
-	KASSERT(coremap[ix].cm_pinned);
-	coremap[ix].cm_pinned = 0;
-	wchan_wakeall(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
+	coremap_unpin_ix(ix);
 }
 
 /*
@@ -1169,39 +2072,40 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
 /*
  * mmu_setas: Set current address space in MMU.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes this cpu's tlblock. Does not block.
  */
 void
 mmu_setas(struct addrspace *as)
 {
-	spinlock_acquire(&coremap_spinlock);
+	tlb_lock();
 	if (as != curcpu->c_vm.cvm_lastas) {
 		curcpu->c_vm.cvm_lastas = as;
 		tlb_clear();
 	}
-	spinlock_release(&coremap_spinlock);
+	tlb_unlock();
 }
 
 /*
  * mmu_unmap: Remove a translation from the MMU.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes this cpu's tlblock. Does not block.
  */
 void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
-	spinlock_acquire(&coremap_spinlock);
+	tlb_lock();
 	if (as == curcpu->c_vm.cvm_lastas) {
 		tlb_unmap(va);
 	}
-	spinlock_release(&coremap_spinlock);
+	tlb_unlock();
 }
 
 /*
  * mmu_map: Enter a translation into the MMU. (This is the end result
  * of fault handling.)
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * Synchronization: takes this cpu's tlblock, then the page's pin
+ * lock to unpin it. Does not block.
  */
 void
 mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
@@ -1213,7 +2117,7 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
 	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
 	
-	spinlock_acquire(&coremap_spinlock);
+	tlb_lock();
 
 	KASSERT(as == curcpu->c_vm.cvm_lastas);
 
@@ -1248,9 +2152,8 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	tlb_write(ehi, elo, tlbix);
 
-	/* Unpin the page. */
-	coremap[cmix].cm_pinned = 0;
-	wchan_wakeall(coremap_pinchan);
+	tlb_unlock();
 
-	spinlock_release(&coremap_spinlock);
+	/* Unpin the page. */
+	coremap_unpin_ix(cmix);
 }
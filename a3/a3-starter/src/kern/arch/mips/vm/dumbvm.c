@@ -191,6 +191,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
+		/* dumbvm preallocates everything, so no fault needs I/O */
+		thread_acct_fault(false);
 		return 0;
 	}
 
@@ -73,6 +73,7 @@ vm_bootstrap(void)
 #endif
 
 	coremap_bootstrap();
+	lpage_bootstrap();
 
 	global_paging_lock = lock_create("global_paging_lock");
 }
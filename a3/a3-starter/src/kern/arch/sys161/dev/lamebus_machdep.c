@@ -73,6 +73,12 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Don't set the on-chip timer for less than this many cycles, so we
+ * aren't interrupted again before we've even returned from the trap.
+ */
+#define MIPS_TIMER_MINCYCLES 100
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -242,6 +248,21 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Set the on-chip timer.
+ */
+void
+mainbus_settimer(uint32_t nsecs)
+{
+	uint32_t cycles;
+
+	cycles = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (cycles < MIPS_TIMER_MINCYCLES) {
+		cycles = MIPS_TIMER_MINCYCLES;
+	}
+	mips_timer_set(cycles);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -268,10 +289,11 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_clear_ipi(lamebus, curcpu);
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
-		hardclock();
+		/*
+		 * timer_interrupt resets the timer (which clears the
+		 * interrupt) and calls hardclock when a tick is due.
+		 */
+		timer_interrupt();
 	}
 	else {
 		panic("Unknown interrupt; cause register is %08x\n", cause);
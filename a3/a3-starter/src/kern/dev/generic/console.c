@@ -54,6 +54,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -108,14 +109,115 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Output.
+ *
+ * Characters to print go in the output ring, and the write-done
+ * interrupt (con_start) sends the next one for as long as there are
+ * any, so writers only wait when the ring is full. They're woken when
+ * it has drained to half full, not on every character, and again
+ * when it's empty and the device is idle, for putch, which waits for
+ * that so kernel output is still unbuffered.
+ */
+
+#define OUTCOUNT(cs) ((cs)->cs_outchars_head - (cs)->cs_outchars_tail)
+#define INCOUNT(cs) ((cs)->cs_gotchars_head - (cs)->cs_gotchars_tail)
+
+/* bytes moved by each uiomove in con_io */
+#define CON_CHUNK 128
+
+/*
+ * Send the next character in the output ring, if the device isn't
+ * already busy with one.
+ */
+static
+void
+con_kickoutput(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	if (cs->cs_outbusy || OUTCOUNT(cs) == 0) {
+		return;
+	}
+	ch = cs->cs_outchars[cs->cs_outchars_tail % CONSOLE_OUTPUT_BUFFER_SIZE];
+	cs->cs_outchars_tail++;
+	cs->cs_outbusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Wait on a console wchan. Call with cs_lock held; returns with it
+ * held again.
+ */
+static
+void
+con_wait(struct con_softc *cs, struct wchan *wc)
+{
+	wchan_lock(wc);
+	spinlock_release(&cs->cs_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&cs->cs_lock);
+}
+
+/*
+ * Add LEN characters from BUF to the output ring, waiting for room
+ * as needed, and get them going. If CRLF is set, put a \r in front of
+ * each \n.
+ */
+static
+void
+con_enqueue(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	size_t i;
+	bool crdone;
+
+	spinlock_acquire(&cs->cs_lock);
+	i = 0;
+	crdone = false;
+	while (i < len) {
+		if (OUTCOUNT(cs) == CONSOLE_OUTPUT_BUFFER_SIZE) {
+			con_kickoutput(cs);
+			con_wait(cs, cs->cs_wwchan);
+			continue;
+		}
+		if (crlf && buf[i] == '\n' && !crdone) {
+			cs->cs_outchars[cs->cs_outchars_head++ %
+					CONSOLE_OUTPUT_BUFFER_SIZE] = '\r';
+			crdone = true;
+			continue;
+		}
+		cs->cs_outchars[cs->cs_outchars_head++ %
+				CONSOLE_OUTPUT_BUFFER_SIZE] = buf[i++];
+		crdone = false;
+	}
+	con_kickoutput(cs);
+	spinlock_release(&cs->cs_lock);
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
- * I/O completion.
+ * I/O completion. Anything still in the output ring goes first, so
+ * the output stays in order (e.g. for a panic) -- unless we were
+ * interrupted holding the ring's lock, in which case it's stuck.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	unsigned char och;
+
+	if (!spinlock_do_i_hold(&cs->cs_lock)) {
+		spinlock_acquire(&cs->cs_lock);
+		while (OUTCOUNT(cs) > 0) {
+			och = cs->cs_outchars[cs->cs_outchars_tail %
+					      CONSOLE_OUTPUT_BUFFER_SIZE];
+			cs->cs_outchars_tail++;
+			cs->cs_sendpolled(cs->cs_devdata, och);
+		}
+		spinlock_release(&cs->cs_lock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -123,13 +225,21 @@ putch_polled(struct con_softc *cs, int ch)
 
 /*
  * Print a character, using interrupts to wait for I/O completion.
+ * Doesn't return until it's been sent.
  */
 static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_enqueue(cs, &c, 1, false);
+
+	spinlock_acquire(&cs->cs_lock);
+	while (cs->cs_outbusy || OUTCOUNT(cs) > 0) {
+		con_wait(cs, cs->cs_wwchan);
+	}
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
@@ -141,49 +251,55 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_lock);
+	while (INCOUNT(cs) == 0) {
+		con_wait(cs, cs->cs_rwchan);
+	}
+	ret = cs->cs_gotchars[cs->cs_gotchars_tail % CONSOLE_INPUT_BUFFER_SIZE];
+	cs->cs_gotchars_tail++;
+	spinlock_release(&cs->cs_lock);
 	return ret;
 }
 
 /*
  * Called from underlying device when a read-ready interrupt occurs.
- *
- * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
  */
 void
 con_input(void *vcs, int ch)
 {
 	struct con_softc *cs = vcs;
-	unsigned nexthead;
 
-	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	if (nexthead == cs->cs_gotchars_tail) {
+	spinlock_acquire(&cs->cs_lock);
+	if (INCOUNT(cs) == CONSOLE_INPUT_BUFFER_SIZE) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_lock);
 		return;
 	}
 
-	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
-	cs->cs_gotchars_head = nexthead;
-		
-	V(cs->cs_rsem);
+	cs->cs_gotchars[cs->cs_gotchars_head % CONSOLE_INPUT_BUFFER_SIZE] = ch;
+	cs->cs_gotchars_head++;
+
+	wchan_wakeall(cs->cs_rwchan);
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character, if there is one.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_lock);
+	cs->cs_outbusy = false;
+	con_kickoutput(cs);
+	if (!cs->cs_outbusy ||
+	    OUTCOUNT(cs) == CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_wwchan);
+	}
+	spinlock_release(&cs->cs_lock);
 }
 
 //////////////////////////////////////////////////
@@ -245,15 +361,80 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Read up to a newline, or until the buffer is full. Whatever input
+ * is already waiting goes out in one uiomove; we only wait when
+ * there's none.
+ */
 static
 int
-con_io(struct device *dev, struct uio *uio)
+con_read(struct con_softc *cs, struct uio *uio)
 {
+	char buf[CON_CHUNK];
+	size_t n;
+	bool eol;
 	int result;
-	char ch;
-	struct lock *lk;
 
-	(void)dev;  // unused
+	eol = false;
+	while (uio->uio_resid > 0 && !eol) {
+		spinlock_acquire(&cs->cs_lock);
+		while (INCOUNT(cs) == 0) {
+			con_wait(cs, cs->cs_rwchan);
+		}
+		n = 0;
+		while (n < sizeof(buf) && n < uio->uio_resid &&
+		       INCOUNT(cs) > 0 && !eol) {
+			buf[n] = cs->cs_gotchars[cs->cs_gotchars_tail %
+						 CONSOLE_INPUT_BUFFER_SIZE];
+			cs->cs_gotchars_tail++;
+			if (buf[n] == '\r') {
+				buf[n] = '\n';
+			}
+			eol = (buf[n] == '\n');
+			n++;
+		}
+		spinlock_release(&cs->cs_lock);
+
+		result = uiomove(buf, n, uio);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write everything, CON_CHUNK bytes per uiomove.
+ */
+static
+int
+con_write(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CON_CHUNK];
+	size_t n;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		n = uio->uio_resid;
+		if (n > sizeof(buf)) {
+			n = sizeof(buf);
+		}
+		result = uiomove(buf, n, uio);
+		if (result) {
+			return result;
+		}
+		con_enqueue(cs, buf, n, true);
+	}
+	return 0;
+}
+
+static
+int
+con_io(struct device *dev, struct uio *uio)
+{
+	struct con_softc *cs = dev->d_data;
+	struct lock *lk;
+	int result;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -264,36 +445,14 @@ con_io(struct device *dev, struct uio *uio)
 
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
-
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
-		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
-		}
+	if (uio->uio_rw==UIO_READ) {
+		result = con_read(cs, uio);
+	}
+	else {
+		result = con_write(cs, uio);
 	}
 	lock_release(lk);
-	return 0;
+	return result;
 }
 
 static
@@ -345,7 +504,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *rwc, *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -361,33 +520,37 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rwc = wchan_create("console read");
+	if (rwc == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
+		wchan_destroy(rwc);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
+	spinlock_init(&cs->cs_lock);
+	cs->cs_rwchan = rwc;
+	cs->cs_wwchan = wwc;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_outchars_head = 0;
+	cs->cs_outchars_tail = 0;
+	cs->cs_outbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
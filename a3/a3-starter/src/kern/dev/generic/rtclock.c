@@ -62,6 +62,12 @@ config_rtclock(struct rtclock_softc *rtc, int unit)
 	return 0;
 }
 
+bool
+gettime_ready(void)
+{
+	return the_clock != NULL;
+}
+
 void
 gettime(time_t *secs, uint32_t *nsecs)
 {
@@ -48,6 +48,7 @@
 #include <array.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -117,20 +118,6 @@ emu_wreg(struct emu_softc *sc, uint32_t reg, uint32_t val)
 	bus_write_register(sc->e_busdata, sc->e_buspos, reg, val);
 }
 
-/*
- * Called by the underlying bus code when an interrupt happens
- */
-void
-emu_irq(void *dev)
-{
-	struct emu_softc *sc = dev;
-
-	sc->e_result = emu_rreg(sc, REG_RESULT);
-	emu_wreg(sc, REG_RESULT, 0);
-
-	V(sc->e_sem);
-}
-
 /*
  * Convert the error codes reported by the "hardware" to errnos.
  * Or, on cases that indicate a programming error in emu.c, panic.
@@ -160,14 +147,321 @@ translate_err(struct emu_softc *sc, uint32_t code)
 }
 
 /*
- * Wait for an operation to complete, and return an errno for the result.
+ * Start the device on the next piece of request ER. Call with
+ * e_qlock held and the device idle.
+ */
+static
+void
+emu_issue(struct emu_softc *sc, struct emu_request *er)
+{
+	KASSERT(spinlock_do_i_hold(&sc->e_qlock));
+
+	er->er_chunk = er->er_len - er->er_done;
+	if (er->er_chunk > EMU_MAXIO) {
+		er->er_chunk = EMU_MAXIO;
+	}
+
+	switch (er->er_op) {
+	    case EMU_OP_OPEN:
+	    case EMU_OP_CREATE:
+	    case EMU_OP_EXCLCREATE:
+		memcpy(sc->e_iobuf, er->er_buf, er->er_len);
+		emu_wreg(sc, REG_IOLEN, er->er_len);
+		break;
+	    case EMU_OP_READ:
+	    case EMU_OP_READDIR:
+		emu_wreg(sc, REG_IOLEN, er->er_chunk);
+		emu_wreg(sc, REG_OFFSET, er->er_offset + er->er_done);
+		break;
+	    case EMU_OP_WRITE:
+		memcpy(sc->e_iobuf, er->er_buf + er->er_done, er->er_chunk);
+		emu_wreg(sc, REG_IOLEN, er->er_chunk);
+		emu_wreg(sc, REG_OFFSET, er->er_offset + er->er_done);
+		break;
+	    case EMU_OP_TRUNC:
+		emu_wreg(sc, REG_IOLEN, er->er_len);
+		break;
+	}
+	emu_wreg(sc, REG_HANDLE, er->er_handle);
+	emu_wreg(sc, REG_OPER, er->er_op);
+}
+
+/*
+ * Start the next queued request, if the device is idle. Call with
+ * e_qlock held.
+ */
+static
+void
+emu_start(struct emu_softc *sc)
+{
+	struct emu_request *er;
+
+	KASSERT(spinlock_do_i_hold(&sc->e_qlock));
+
+	if (sc->e_cur != NULL || sc->e_qhead == NULL) {
+		return;
+	}
+	er = sc->e_qhead;
+	sc->e_qhead = er->er_next;
+	if (sc->e_qhead == NULL) {
+		sc->e_qtail = NULL;
+	}
+	sc->e_cur = er;
+	emu_issue(sc, er);
+}
+
+/*
+ * Called by the underlying bus code when an interrupt happens.
+ *
+ * Take the results of the piece of the current request that just
+ * finished. If there's more of it, start the next piece; otherwise
+ * wake up whoever is waiting and start the next request.
+ */
+void
+emu_irq(void *dev)
+{
+	struct emu_softc *sc = dev;
+	struct emu_request *er;
+	uint32_t result, len;
+
+	spinlock_acquire(&sc->e_qlock);
+
+	result = emu_rreg(sc, REG_RESULT);
+	emu_wreg(sc, REG_RESULT, 0);
+
+	er = sc->e_cur;
+	if (er == NULL) {
+		spinlock_release(&sc->e_qlock);
+		kprintf("emu%d: stray interrupt\n", sc->e_unit);
+		return;
+	}
+
+	if (result == EMU_RES_SUCCESS) {
+		switch (er->er_op) {
+		    case EMU_OP_OPEN:
+		    case EMU_OP_CREATE:
+		    case EMU_OP_EXCLCREATE:
+			er->er_rethandle = emu_rreg(sc, REG_HANDLE);
+			er->er_retlen = emu_rreg(sc, REG_IOLEN);
+			break;
+		    case EMU_OP_GETSIZE:
+			er->er_retlen = emu_rreg(sc, REG_IOLEN);
+			break;
+		    case EMU_OP_READ:
+		    case EMU_OP_READDIR:
+			len = emu_rreg(sc, REG_IOLEN);
+			KASSERT(len <= er->er_chunk);
+			memcpy(er->er_buf + er->er_done, sc->e_iobuf, len);
+			er->er_done += len;
+			er->er_retoffset = emu_rreg(sc, REG_OFFSET);
+			if (er->er_op == EMU_OP_READ &&
+			    len == er->er_chunk && er->er_done < er->er_len) {
+				emu_issue(sc, er);
+				spinlock_release(&sc->e_qlock);
+				return;
+			}
+			break;
+		    case EMU_OP_WRITE:
+			er->er_done += er->er_chunk;
+			if (er->er_done < er->er_len) {
+				emu_issue(sc, er);
+				spinlock_release(&sc->e_qlock);
+				return;
+			}
+			break;
+		}
+	}
+
+	er->er_result = result;
+	er->er_finished = true;
+	sc->e_cur = NULL;
+	emu_start(sc);
+	wchan_wakeall(sc->e_wchan);
+
+	spinlock_release(&sc->e_qlock);
+}
+
+/*
+ * Put a request on the queue. Call with e_qlock held.
+ */
+static
+void
+emu_submit(struct emu_softc *sc, struct emu_request *er)
+{
+	KASSERT(spinlock_do_i_hold(&sc->e_qlock));
+
+	er->er_done = 0;
+	er->er_finished = false;
+	er->er_next = NULL;
+	if (sc->e_qtail == NULL) {
+		sc->e_qhead = er;
+	}
+	else {
+		sc->e_qtail->er_next = er;
+	}
+	sc->e_qtail = er;
+	emu_start(sc);
+}
+
+/*
+ * Wait for a request to finish. Call with e_qlock held; returns with
+ * it held.
+ */
+static
+void
+emu_wait(struct emu_softc *sc, struct emu_request *er)
+{
+	KASSERT(spinlock_do_i_hold(&sc->e_qlock));
+
+	while (!er->er_finished) {
+		wchan_lock(sc->e_wchan);
+		spinlock_release(&sc->e_qlock);
+		wchan_sleep(sc->e_wchan);
+		spinlock_acquire(&sc->e_qlock);
+	}
+}
+
+/*
+ * Do a request: queue it, wait for it, and return an errno for the
+ * result.
  */
 static
 int
-emu_waitdone(struct emu_softc *sc)
+emu_doreq(struct emu_softc *sc, struct emu_request *er)
+{
+	spinlock_acquire(&sc->e_qlock);
+	emu_submit(sc, er);
+	emu_wait(sc, er);
+	spinlock_release(&sc->e_qlock);
+
+	return translate_err(sc, er->er_result);
+}
+
+/*
+ * Set up a request.
+ */
+static
+void
+emu_mkreq(struct emu_request *er, uint32_t op, uint32_t handle,
+	  uint32_t offset, uint32_t len, void *buf)
 {
-	P(sc->e_sem);
-	return translate_err(sc, sc->e_result);
+	er->er_op = op;
+	er->er_handle = handle;
+	er->er_offset = offset;
+	er->er_len = len;
+	er->er_buf = buf;
+}
+
+/*
+ * Get a kernel buffer for LEN bytes of I/O. If memory is tight, LEN is
+ * cut down to EMU_MAXIO.
+ */
+static
+void *
+emu_getbuf(uint32_t *len)
+{
+	void *buf;
+
+	buf = kmalloc(*len);
+	if (buf == NULL && *len > EMU_MAXIO) {
+		*len = EMU_MAXIO;
+		buf = kmalloc(*len);
+	}
+	return buf;
+}
+
+/*
+ * Throw away the read-ahead, waiting for it to finish if it's in
+ * progress. This is done on every write, truncate, and close, not
+ * just for the same handle, since two handles can be the same file.
+ * Call with e_pflock held.
+ */
+static
+void
+emu_pfinval(struct emu_softc *sc)
+{
+	KASSERT(lock_do_i_hold(sc->e_pflock));
+
+	if (sc->e_pfstate == EMU_PF_NONE) {
+		return;
+	}
+	spinlock_acquire(&sc->e_qlock);
+	emu_wait(sc, &sc->e_pf);
+	spinlock_release(&sc->e_qlock);
+	sc->e_pfstate = EMU_PF_NONE;
+}
+
+/*
+ * Start reading ahead the window at OFFSET in HANDLE, unless there's
+ * read-ahead already going. Call with e_pflock held.
+ */
+static
+void
+emu_readahead(struct emu_softc *sc, uint32_t handle, uint32_t offset)
+{
+	KASSERT(lock_do_i_hold(sc->e_pflock));
+
+	if (sc->e_pfbuf == NULL) {
+		return;
+	}
+
+	if (sc->e_pfstate == EMU_PF_PENDING) {
+		return;
+	}
+	emu_mkreq(&sc->e_pf, EMU_OP_READ, handle, offset, EMU_WINDOW,
+		  sc->e_pfbuf);
+	sc->e_pfstate = EMU_PF_PENDING;
+	spinlock_acquire(&sc->e_qlock);
+	emu_submit(sc, &sc->e_pf);
+	spinlock_release(&sc->e_qlock);
+}
+
+/*
+ * Try to do a read from the read-ahead buffer. Returns true if it
+ * did, with *RESULT set. Call with e_pflock held.
+ */
+static
+bool
+emu_pfread(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	   struct uio *uio, int *result)
+{
+	struct emu_request *pf = &sc->e_pf;
+	uint32_t start, end;
+
+	KASSERT(lock_do_i_hold(sc->e_pflock));
+
+	if (sc->e_pfstate == EMU_PF_NONE || pf->er_handle != handle ||
+	    uio->uio_offset < pf->er_offset ||
+	    uio->uio_offset >= pf->er_offset + pf->er_len) {
+		return false;
+	}
+	spinlock_acquire(&sc->e_qlock);
+	emu_wait(sc, pf);
+	spinlock_release(&sc->e_qlock);
+	sc->e_pfstate = EMU_PF_READY;
+
+	if (pf->er_result != EMU_RES_SUCCESS ||
+	    uio->uio_offset >= pf->er_offset + pf->er_done) {
+		/* failed, or past EOF; let a real read sort it out */
+		sc->e_pfstate = EMU_PF_NONE;
+		return false;
+	}
+
+	/* pf and e_pfbuf don't change while we hold e_pflock */
+	start = uio->uio_offset - pf->er_offset;
+	end = pf->er_done;
+	if (end - start > len) {
+		end = start + len;
+	}
+	*result = uiomove(sc->e_pfbuf + start, end - start, uio);
+	if (*result == 0 && end == pf->er_done) {
+		/* used it all up; get the next window if there is one */
+		sc->e_pfstate = EMU_PF_NONE;
+		if (pf->er_done == pf->er_len) {
+			emu_readahead(sc, handle, uio->uio_offset);
+		}
+	}
+	return true;
 }
 
 /*
@@ -182,6 +476,7 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	 bool create, bool excl, mode_t mode,
 	 uint32_t *newhandle, int *newisdir)
 {
+	struct emu_request er;
 	uint32_t op;
 	int result;
 
@@ -202,20 +497,14 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	/* mode isn't supported (yet?) */
 	(void)mode;
 
-	lock_acquire(sc->e_lock);
-
-	strcpy(sc->e_iobuf, name);
-	emu_wreg(sc, REG_IOLEN, strlen(name));
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_OPER, op);
-	result = emu_waitdone(sc);
+	/* the name is copied to the device as is; it isn't changed */
+	emu_mkreq(&er, op, handle, 0, strlen(name), (char *)name);
+	result = emu_doreq(sc, &er);
 
 	if (result==0) {
-		*newhandle = emu_rreg(sc, REG_HANDLE);
-		*newisdir = emu_rreg(sc, REG_IOLEN)>0;
+		*newhandle = er.er_rethandle;
+		*newisdir = er.er_retlen>0;
 	}
-
-	lock_release(sc->e_lock);
 	return result;
 }
 
@@ -228,21 +517,19 @@ static
 int
 emu_close(struct emu_softc *sc, uint32_t handle)
 {
+	struct emu_request er;
 	int result;
-	bool mine;
 	int retries = 0;
 
-	mine = lock_do_i_hold(sc->e_lock);
-	if (!mine) {
-		lock_acquire(sc->e_lock);
-	}
+	/* the handle number may be reused, so drop any read-ahead */
+	lock_acquire(sc->e_pflock);
+	emu_pfinval(sc);
 
 	while (1) {
 		/* Retry operation up to 10 times */
 
-		emu_wreg(sc, REG_HANDLE, handle);
-		emu_wreg(sc, REG_OPER, EMU_OP_CLOSE);
-		result = emu_waitdone(sc);
+		emu_mkreq(&er, EMU_OP_CLOSE, handle, 0, 0, NULL);
+		result = emu_doreq(sc, &er);
 
 		if (result==EIO && retries < 10) {
 			kprintf("emu%d: I/O error on close, retrying\n", 
@@ -253,55 +540,58 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 		break;
 	}
 
-	if (!mine) {
-		lock_release(sc->e_lock);
-	}
+	lock_release(sc->e_pflock);
 	return result;
 }
 
 /*
- * Common code for read and readdir.
+ * Read from a hardware-level file handle, up to EMU_WINDOW bytes.
+ *
+ * Reads are served from the read-ahead buffer when they can be.
+ * Otherwise the whole window is read into a kernel buffer with one
+ * request. If the read got all it asked for, the next window is read
+ * ahead, on the theory that the file is being read sequentially.
  */
 static
 int
-emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	   uint32_t op, struct uio *uio)
+emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	 struct uio *uio)
 {
+	struct emu_request er;
+	void *buf;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_WINDOW);
 
-	lock_acquire(sc->e_lock);
+	lock_acquire(sc->e_pflock);
+	if (emu_pfread(sc, handle, len, uio, &result)) {
+		lock_release(sc->e_pflock);
+		return result;
+	}
+	lock_release(sc->e_pflock);
 
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
-	emu_wreg(sc, REG_OPER, op);
-	result = emu_waitdone(sc);
-	if (result) {
-		goto out;
+	buf = emu_getbuf(&len);
+	if (buf == NULL) {
+		return ENOMEM;
 	}
-	
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	emu_mkreq(&er, EMU_OP_READ, handle, uio->uio_offset, len, buf);
+	result = emu_doreq(sc, &er);
+	if (result == 0) {
+		result = uiomove(buf, er.er_done, uio);
+		uio->uio_offset = er.er_retoffset;
+	}
+	kfree(buf);
 
- out:
-	lock_release(sc->e_lock);
+	if (result == 0 && er.er_done == len) {
+		lock_acquire(sc->e_pflock);
+		emu_readahead(sc, handle, uio->uio_offset);
+		lock_release(sc->e_pflock);
+	}
 	return result;
 }
 
-/*
- * Read from a hardware-level file handle.
- */
-static
-int
-emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
-{
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
-}
-
 /*
  * Read a directory entry from a hardware-level file handle.
  */
@@ -310,37 +600,64 @@ int
 emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	    struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
+	struct emu_request er;
+	void *buf;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_MAXIO);
+
+	buf = kmalloc(len);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	emu_mkreq(&er, EMU_OP_READDIR, handle, uio->uio_offset, len, buf);
+	result = emu_doreq(sc, &er);
+	if (result == 0) {
+		result = uiomove(buf, er.er_done, uio);
+		uio->uio_offset = er.er_retoffset;
+	}
+	kfree(buf);
+	return result;
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write to a hardware-level file handle, up to EMU_WINDOW bytes.
  */
 static
 int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	struct emu_request er;
+	void *buf;
+	uint32_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(len <= EMU_WINDOW);
 
-	lock_acquire(sc->e_lock);
-
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	buf = emu_getbuf(&len);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
 
-	result = uiomove(sc->e_iobuf, len, uio);
+	offset = uio->uio_offset;
+	result = uiomove(buf, len, uio);
 	if (result) {
 		goto out;
 	}
 
-	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
-	result = emu_waitdone(sc);
+	/* hold e_pflock so no read-ahead starts before the write */
+	lock_acquire(sc->e_pflock);
+	emu_pfinval(sc);
+	emu_mkreq(&er, EMU_OP_WRITE, handle, offset, len, buf);
+	result = emu_doreq(sc, &er);
+	lock_release(sc->e_pflock);
 
  out:
-	lock_release(sc->e_lock);
+	kfree(buf);
 	return result;
 }
 
@@ -351,18 +668,14 @@ static
 int
 emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 {
+	struct emu_request er;
 	int result;
 
-	lock_acquire(sc->e_lock);
-
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_OPER, EMU_OP_GETSIZE);
-	result = emu_waitdone(sc);
+	emu_mkreq(&er, EMU_OP_GETSIZE, handle, 0, 0, NULL);
+	result = emu_doreq(sc, &er);
 	if (result==0) {
-		*retval = emu_rreg(sc, REG_IOLEN);
+		*retval = er.er_retlen;
 	}
-
-	lock_release(sc->e_lock);
 	return result;
 }
 
@@ -373,16 +686,15 @@ static
 int
 emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 {
+	struct emu_request er;
 	int result;
 
-	lock_acquire(sc->e_lock);
-
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OPER, EMU_OP_TRUNC);
-	result = emu_waitdone(sc);
+	lock_acquire(sc->e_pflock);
+	emu_pfinval(sc);
+	emu_mkreq(&er, EMU_OP_TRUNC, handle, 0, len, NULL);
+	result = emu_doreq(sc, &er);
+	lock_release(sc->e_pflock);
 
-	lock_release(sc->e_lock);
 	return result;
 }
 
@@ -535,8 +847,8 @@ emufs_read(struct vnode *v, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		if (amt > EMU_WINDOW) {
+			amt = EMU_WINDOW;
 		}
 
 		oldresid = uio->uio_resid;
@@ -591,8 +903,8 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		if (amt > EMU_WINDOW) {
+			amt = EMU_WINDOW;
 		}
 
 		oldresid = uio->uio_resid;
@@ -1338,14 +1650,30 @@ config_emu(struct emu_softc *sc, int emuno)
 	if (sc->e_lock == NULL) {
 		return ENOMEM;
 	}
-	sc->e_sem = sem_create("emufs-sem", 0);
-	if (sc->e_sem == NULL) {
+	sc->e_pflock = lock_create("emufs-readahead");
+	if (sc->e_pflock == NULL) {
 		lock_destroy(sc->e_lock);
 		sc->e_lock = NULL;
 		return ENOMEM;
 	}
+	sc->e_wchan = wchan_create("emufs");
+	if (sc->e_wchan == NULL) {
+		lock_destroy(sc->e_pflock);
+		lock_destroy(sc->e_lock);
+		sc->e_pflock = NULL;
+		sc->e_lock = NULL;
+		return ENOMEM;
+	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
 
+	spinlock_init(&sc->e_qlock);
+	sc->e_cur = NULL;
+	sc->e_qhead = sc->e_qtail = NULL;
+
+	/* read-ahead is just skipped if there's no memory for it */
+	sc->e_pfstate = EMU_PF_NONE;
+	sc->e_pfbuf = kmalloc(EMU_WINDOW);
+
 	snprintf(name, sizeof(name), "emu%d", emuno);
 
 	return emufs_addtovfs(sc, name);
@@ -30,16 +30,48 @@
 #ifndef _LAMEBUS_EMU_H_
 #define _LAMEBUS_EMU_H_
 
+#include <spinlock.h>
 
-#define EMU_MAXIO       16384
+#define EMU_MAXIO       16384	/* largest single device transfer */
+#define EMU_WINDOW      32768	/* largest transfer per request */
 #define EMU_ROOTHANDLE  0
 
+/*
+ * A request to the device. Reads and writes bigger than EMU_MAXIO are
+ * done in EMU_MAXIO pieces, one after another from the interrupt
+ * handler, to or from er_buf in the kernel. The thread that queued
+ * the request sleeps until er_finished is set.
+ */
+struct emu_request {
+	uint32_t er_op;			/* EMU_OP_* */
+	uint32_t er_handle;		/* file handle */
+	uint32_t er_offset;		/* file offset of er_buf[0] */
+	uint32_t er_len;		/* bytes to move; trunc: new size */
+	char *er_buf;			/* data, or name for open */
+	uint32_t er_chunk;		/* size of the piece in progress */
+	uint32_t er_done;		/* bytes moved so far */
+	uint32_t er_result;		/* EMU_RES_* when finished */
+	uint32_t er_rethandle;		/* open: new handle */
+	uint32_t er_retlen;		/* open: isdir; getsize: size */
+	uint32_t er_retoffset;		/* read/readdir: offset after */
+	bool er_finished;
+	struct emu_request *er_next;	/* queue link */
+};
+
 /*
  * The per-device data used by the emufs device driver.
  * (Note that this is only a small portion of its actual data;
  * all the filesystem stuff goes elsewhere.
+ *
+ * Requests wait in e_qhead..e_qtail; e_cur is the one the device is
+ * working on. The interrupt handler finishes e_cur and starts the
+ * next one itself, so the device doesn't sit idle while the thread
+ * that was waiting wakes up and copies its data out.
+ *
+ * e_pf reads ahead the window after a sequential read into e_pfbuf.
+ * e_pflock is held while using e_pfbuf, and across writes so that
+ * read-ahead never picks up stale data.
  */
-
 struct emu_softc {
 	/* Initialized by lower-level attach code */
 	void *e_busdata;
@@ -47,14 +79,27 @@ struct emu_softc {
 	int e_unit;
 
 	/* Initialized by config_emu() */
-	struct lock *e_lock;
-	struct semaphore *e_sem;
+	struct lock *e_lock;		/* protects the emufs vnode table */
+	struct wchan *e_wchan;		/* threads waiting for requests */
 	void *e_iobuf;
 
-	/* Written by the interrupt handler */
-	uint32_t e_result;
+	/* Protected by e_qlock */
+	struct spinlock e_qlock;
+	struct emu_request *e_cur;	/* request in progress, or NULL */
+	struct emu_request *e_qhead;	/* requests waiting */
+	struct emu_request *e_qtail;
+
+	/* Read-ahead; protected by e_pflock */
+	struct lock *e_pflock;
+	unsigned e_pfstate;		/* EMU_PF_* */
+	struct emu_request e_pf;
+	char *e_pfbuf;			/* EMU_WINDOW bytes, or NULL */
 };
 
+#define EMU_PF_NONE	0	/* e_pf is empty */
+#define EMU_PF_PENDING	1	/* e_pf is queued or in progress */
+#define EMU_PF_READY	2	/* e_pf is finished */
+
 /* Functions called by lower-level drivers */
 void emu_irq(/*struct emu_softc*/ void *);
 
@@ -37,6 +37,7 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <kmem.h>
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
@@ -49,6 +50,9 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Object cache for sfs_vnodes (see sfs_vnode_cache_init) */
+static struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +957,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1303,6 +1307,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		vfs_biglock_release();
 		return result;
 	}
+	vfs_namecache_enter(v, name, &newguy->sv_v);
 
 	/* Update the linkcount of the new file */
 	newguy->sv_i.sfi_linkcount++;
@@ -1339,6 +1344,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 		vfs_biglock_release();
 		return result;
 	}
+	vfs_namecache_enter(dir, name, file);
 
 	/* and update the link count, marking the inode dirty */
 	f->sv_i.sfi_linkcount++;
@@ -1372,6 +1378,9 @@ sfs_remove(struct vnode *dir, const char *name)
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
+		/* Remember it's gone; this also lets go of the file */
+		vfs_namecache_enter(dir, name, NULL);
+
 		/* If we succeeded, decrement the link count. */
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
@@ -1428,6 +1437,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	if (result) {
 		goto puke;
 	}
+	vfs_namecache_remove(d2, n2);
 	
 	/* Increment the link count, and mark inode dirty */
 	g1->sv_i.sfi_linkcount++;
@@ -1438,6 +1448,8 @@ sfs_rename(struct vnode *d1, const char *n1,
 	if (result) {
 		goto puke_harder;
 	}
+	vfs_namecache_enter(d1, n1, NULL);
+	vfs_namecache_enter(d2, n2, &g1->sv_v);
 
 	/*
 	 * Decrement the link count again, and mark the inode dirty again,
@@ -1510,7 +1522,9 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. Names looked up before are answered by the vfs name cache
+ * without reading the directory; sfs_creat, sfs_link, sfs_remove,
+ * and sfs_rename keep the cache up to date.
  */
 static
 int
@@ -1527,11 +1541,21 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 		return ENOTDIR;
 	}
 	
+	/* Try the name cache first; it may know the name isn't there */
+	if (vfs_namecache_lookup(v, path, ret)) {
+		vfs_biglock_release();
+		return *ret != NULL ? 0 : ENOENT;
+	}
+
 	result = sfs_lookonce(sv, path, &final, NULL);
+	if (result == ENOENT) {
+		vfs_namecache_enter(v, path, NULL);
+	}
 	if (result) {
 		vfs_biglock_release();
 		return result;
 	}
+	vfs_namecache_enter(v, path, &final->sv_v);
 
 	*ret = &final->sv_v;
 
@@ -1642,6 +1666,25 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+/*
+ * Set up the object cache for sfs_vnodes, shared by all sfs volumes.
+ * Called by each mount; the first one creates it.
+ */
+int
+sfs_vnode_cache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode));
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1685,7 +1728,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1742,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1779,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1790,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
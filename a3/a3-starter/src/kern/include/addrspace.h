@@ -36,6 +36,7 @@
 
 
 #include <array.h>
+#include <spinlock.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
@@ -65,6 +66,27 @@ struct addrspace {
 #else
         /* Add additional address space objects here as necessary. */
         struct vm_object_array *as_objects;
+
+        /*
+         * Resident-set and working-set accounting (see addrspace.c),
+         * under as_vmlock.
+         */
+        struct spinlock as_vmlock;
+        pid_t as_pid;                   /* process using us, if known */
+        unsigned as_rss;                /* resident pages */
+        unsigned as_rsslimit;           /* soft limit on as_rss, or 0 */
+        uint32_t as_nfaults;            /* faults taken */
+        uint32_t as_nmajfaults;         /* ...on pages not resident */
+        uint32_t as_wsepoch;            /* current working-set interval */
+        unsigned as_wsstart;            /* when it began, in hardclocks */
+        unsigned as_wsrefs;             /* pages faulted on during it */
+        unsigned as_wsfaults;           /* faults during it */
+        unsigned as_ws;                 /* working-set estimate, pages */
+        unsigned as_lastfaults;         /* faults in last whole interval */
+
+        /* List of all address spaces, under as_listlock. */
+        struct addrspace *as_next;
+        struct addrspace *as_prev;
 #endif
 };
 
@@ -129,6 +151,19 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
 
+#if !OPT_DUMBVM
+/*
+ * as_printrss - print resident-set size, working-set estimate, and
+ *               fault counts for every address space.
+ * as_setrsslimit - set the RSS soft limit, in pages (0 for none), of
+ *               process PID's address space, or if PID is
+ *               INVALID_PID the default for new address spaces.
+ *               Returns ESRCH if no such address space.
+ */
+void as_printrss(void);
+int as_setrsslimit(pid_t pid, unsigned npages);
+#endif
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
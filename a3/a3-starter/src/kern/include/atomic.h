@@ -0,0 +1,25 @@
+/*
+ * Atomic counters, for reference counts and the like that are shared
+ * between threads but too small and too hot to be worth a lock.
+ *
+ *    atomic_get - read the value.
+ *    atomic_set - set the value; only safe when nobody else can be
+ *                 changing it at the same time (e.g. when initializing).
+ *    atomic_add - add DELTA (which may be negative) and return the new
+ *                 value, atomically with respect to all cpus.
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+/* Get the machine-dependent bits. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
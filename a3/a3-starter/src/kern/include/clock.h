@@ -41,7 +41,8 @@
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
  *
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day, once
+ * gettime_ready() says a clock device has been attached.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -62,6 +63,7 @@ void hardclock(void);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+bool gettime_ready(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
@@ -70,8 +72,53 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clock_nanosleep() does the same for a number of nanoseconds. Both
+ * use a timer, so they wake up at the deadline rather than on the
+ * next tick.
  */
 void clocksleep(int seconds);
+void clock_nanosleep(uint64_t nsecs);
+
+/*
+ * High-resolution one-shot timers.
+ *
+ * clock_nanotime() returns the current time in nanoseconds. Timer
+ * deadlines are on this clock.
+ *
+ * A timer calls tm_func(tm_data), in interrupt context on the cpu it
+ * was armed on, as soon as possible after its deadline. The on-chip
+ * timer is reprogrammed for the earliest deadline, so this isn't
+ * rounded up to a hardclock.
+ *
+ *    timer_init   - set up a timer with its callback.
+ *    timer_arm    - arm a timer (which must not be armed) on the
+ *                   current cpu for absolute deadline WHEN.
+ *    timer_cancel - disarm a timer. Returns false if it wasn't armed,
+ *                   in which case the callback has run or is about
+ *                   to, and the timer mustn't be freed until it has.
+ *
+ * timer_interrupt() is called by the MD code when the on-chip timer
+ * goes off. It runs expired timers, calls hardclock() if a tick is
+ * due, and sets the next interrupt with mainbus_settimer(), which
+ * also clears the current one. While a cpu is idle the ticks are
+ * suppressed and it is only woken for timers; hardclock_resume() is
+ * called when the cpu stops idling, to start ticking again.
+ * c_hardclocks is advanced by the number of ticks skipped.
+ */
+struct timer {
+	uint64_t tm_deadline;		/* when, on clock_nanotime() */
+	void (*tm_func)(void *);	/* callback */
+	void *tm_data;			/* argument for callback */
+	struct cpu *tm_cpu;		/* cpu armed on, or NULL */
+	struct timer *tm_next;		/* next timer on cpu's list */
+};
+
+uint64_t clock_nanotime(void);
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+void timer_arm(struct timer *tm, uint64_t when);
+bool timer_cancel(struct timer *tm);
+void timer_interrupt(void);
+void hardclock_resume(void);
 
 
 #endif /* _CLOCK_H_ */
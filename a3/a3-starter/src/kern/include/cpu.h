@@ -34,7 +34,17 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <kmem.h>        /* for struct kmem_magazine */
 
+struct timer;	/* from <clock.h> */
+struct lockstat_table;	/* from <lockstat.h> */
+
+
+/*
+ * Number of scheduling levels in each cpu's run queue. Level 0 is the
+ * highest priority and has the shortest quantum; see thread.c.
+ */
+#define SCHED_NLEVELS	4
 
 /*
  * Per-cpu structure
@@ -61,15 +71,48 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
+	struct kmem_magazine c_kmem[KMEM_NMAGS]; /* kmalloc magazines */
+	unsigned c_sched_steals;	/* Threads stolen by this cpu */
+	uint64_t c_nexttick;		/* clock_nanotime() of next hardclock */
+	unsigned c_idleticks;		/* Hardclocks skipped while idle */
+	struct threadlist c_threadcache; /* Exited threads kept for reuse */
+	unsigned c_threadcache_used;	/* c_hardclocks when last taken from */
+	unsigned c_threadcache_hits;	/* Forks that got a cached thread */
+	unsigned c_threadcache_misses;	/* Forks that had to allocate */
+#if OPT_LOCKSTAT
+	struct lockstat_table *c_lockstat; /* Lock statistics, or NULL */
+#endif
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * The run queue is one list per scheduling level;
+	 * c_runqueue_count is the total across all
+	 * levels. The scheduler counters are for the "sched" menu
+	 * command.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queue for this cpu */
+	unsigned c_runqueue_count;	/* Threads on all levels */
+	unsigned c_sched_lastboost;	/* c_hardclocks at last aging boost */
+	unsigned c_sched_demotions;	/* Quantum expiries */
+	unsigned c_sched_preemptions;	/* Yields to a higher level */
+	unsigned c_sched_wakeboosts;	/* Raises on wakeup */
+	unsigned c_sched_boosts;	/* Aging boosts */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the timer lock.
+	 *
+	 * c_timers is sorted by deadline. c_timerprog is the deadline
+	 * the on-chip timer is currently set for.
+	 */
+	struct timer *c_timers;		/* Armed timers */
+	uint64_t c_timerprog;		/* Next timer interrupt */
+	struct spinlock c_timer_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -100,12 +143,18 @@ struct cpu {
  *
  * cpu_create calls cpu_machdep_init.
  *
+ * cpu_bynumber returns the cpu whose c_number is NUMBER.
+ *
+ * cpu_count returns the number of cpus created so far.
+ *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+struct cpu *cpu_bynumber(unsigned number);
+unsigned cpu_count(void);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -123,6 +172,14 @@ const char *cpu_identify(void);
 void cpu_irqoff(void);
 void cpu_irqon(void);
 
+/*
+ * Read the processor's cycle counter. On some machines (sys161 among
+ * them) the counter is also used for the timer interrupt and may be
+ * reset, so this is only good for timing short intervals, and an
+ * interval that comes out negative must be thrown away.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Idle or shut down (respectively) the processor.
  *
@@ -153,6 +210,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_queue adds the shootdown data without sending the
+ * IPI, so several shootdowns can go in one IPI_TLBSHOOTDOWN.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +226,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_queue(unsigned targetcpu,
+			   const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
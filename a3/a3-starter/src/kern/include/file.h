@@ -22,16 +22,26 @@ struct filetable {
 	struct openfiles *file[__OPEN_MAX];
 };
 
+/*
+ * An open file, which can be in several filetables at once (after fork
+ * or dup2). refcount counts the filetable slots pointing to it and is
+ * changed atomically, without file_lock. flag and vn never change
+ * after open, so only the offset needs file_lock; operations that
+ * don't use the offset (fstat, pread, pwrite) don't take it.
+ */
 struct openfiles {
 	char *filename;
 	int flag;		//the w/r flag
-	off_t offset;		//the file offset
-	int links;		//keep track of the number of links to the file
+	off_t offset;		//the file offset, protected by file_lock
+	volatile unsigned refcount; //filetable slots pointing here; atomic
 
-	struct lock *file_lock;	//to lock the file info
+	struct lock *file_lock;	//to lock the offset
 	struct vnode *vn;	//the files vnode
 };
 
+/* sets up the openfiles object cache; called once during boot */
+void file_bootstrap(void);
+
 /* these all have an implicit arg of the curthread's filetable */
 int filetable_init(void);
 void filetable_destroy(struct filetable *ft);
@@ -53,6 +63,13 @@ int insert_file(struct openfiles *file, int *retfd);
 /* checks that the fd is valid */
 int check_fd(int fd);
 
+/* looks up the open file for fd in the curthread's filetable */
+int file_get(int fd, struct openfiles **retfile);
+
+/* adds and drops a filetable reference; the last drop closes the file */
+void file_incref(struct openfiles *file);
+void file_decref(struct openfiles *file);
+
 /* duplicates the current threads filetable */
 int duplicate_filetable(struct filetable **duplicate);
 
@@ -0,0 +1,46 @@
+/*
+ * Kernel object caches (slab allocator).
+ *
+ * kmalloc is built on these; they can also be used directly for
+ * kernel objects that are allocated and freed a lot, which saves the
+ * rounding up to a kmalloc size class.
+ *
+ *    kmem_cache_create  - make a cache for objects of SIZE bytes. NAME
+ *                         is used for statistics and must stay valid.
+ *                         Returns NULL if out of memory.
+ *    kmem_cache_alloc   - allocate an object. Returns NULL if out of
+ *                         memory.
+ *    kmem_cache_free    - free an object allocated from the same cache.
+ *                         (kfree also works.)
+ *
+ * Caches are never destroyed.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+struct kmem_cache;	/* Opaque. */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *ptr);
+
+/*
+ * Per-cpu magazines: each cpu keeps a few free objects of each of the
+ * first KMEM_NMAGS caches created, so most allocations and frees
+ * don't touch the cache's lock. Only ever used by their own cpu, with
+ * interrupts off.
+ */
+#define KMEM_NMAGS	16
+#define KMEM_MAGSIZE	8
+
+struct kmem_magazine {
+	unsigned km_num;		/* number of objects in km_objs */
+	void *km_objs[KMEM_MAGSIZE];
+};
+
+struct cpu;
+void kmem_cpu_init(struct cpu *c);
+
+
+#endif /* _KMEM_H_ */
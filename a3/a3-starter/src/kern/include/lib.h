@@ -145,6 +145,16 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Allocation-site statistics; only with "options kheapprof".
+ * kheap_printsites prints the NUM sites with the most live bytes;
+ * kheap_printdiff the NUM whose live bytes changed most since the
+ * last kheap_snapshot.
+ */
+void kheap_printsites(unsigned num);
+void kheap_snapshot(void);
+void kheap_printdiff(unsigned num);
+
 /*
  * C string functions. 
  *
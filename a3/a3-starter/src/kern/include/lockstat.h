@@ -0,0 +1,65 @@
+/*
+ * Lock statistics; only with "options lockstat".
+ *
+ * Every spinlock and sleep lock release records, per lock name, the
+ * number of acquisitions, how many had to wait, the total wait and
+ * hold times, and the longest hold along with who held it. Spinlocks
+ * without a name (see spinlock_setname) are kept by acquire site.
+ * Spinlock times are in cycles; sleep lock times are in nanoseconds.
+ *
+ * The numbers go in a per-cpu table so recording needs no locks, only
+ * interrupts off, which they already are on a lock release.
+ *
+ *    lockstat_cpu_init  - set up the table for a new cpu.
+ *    lockstat_cycles    - cycles from START to END, or 0 if the cycle
+ *                         counter went backwards in between.
+ *    lockstat_spinlock  - record a spinlock release at cycle count NOW.
+ *    lockstat_sleeplock - record a sleep lock release.
+ *    lockstat_print     - print the NUM locks with the most wait time.
+ *    lockstat_reset     - throw away everything recorded so far.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+#define LOCKSTAT_NAMELEN	20	/* names are truncated to this */
+#define LOCKSTAT_NSLOTS		128	/* table size per cpu */
+#define LOCKSTAT_PROBES		8	/* slots tried before giving up */
+
+struct lockstat {
+	char ls_name[LOCKSTAT_NAMELEN];	/* lock name, or "" */
+	vaddr_t ls_site;		/* acquire site, for unnamed spinlocks */
+	bool ls_sleep;			/* sleep lock or spinlock */
+	unsigned ls_acquires;		/* times acquired; 0 if slot is free */
+	unsigned ls_contended;		/* times the acquirer had to wait */
+	uint64_t ls_wait;		/* total time waiting */
+	uint64_t ls_hold;		/* total time held */
+	uint64_t ls_maxhold;		/* longest single hold */
+	vaddr_t ls_maxsite;		/* spinlocks: where the longest was taken */
+	char ls_maxholder[LOCKSTAT_NAMELEN]; /* sleep locks: thread holding it */
+};
+
+struct lockstat_table {
+	unsigned lt_gen;		/* lockstat_reset count when cleared */
+	unsigned lt_dropped;		/* releases that found no free slot */
+	struct lockstat lt_slots[LOCKSTAT_NSLOTS];
+};
+
+struct cpu;
+struct spinlock;
+
+void lockstat_cpu_init(struct cpu *c);
+uint32_t lockstat_cycles(uint32_t start, uint32_t end);
+void lockstat_spinlock(struct spinlock *splk, uint32_t now);
+void lockstat_sleeplock(const char *name, bool contended,
+			uint64_t waitnsecs, uint64_t holdnsecs);
+void lockstat_print(unsigned num);
+void lockstat_reset(void);
+
+#endif /* OPT_LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
@@ -55,6 +55,12 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Set the current cpu's timer to interrupt once, NSECS nanoseconds from
+ * now. Also clears any pending timer interrupt. (Low-level.)
+ */
+void mainbus_settimer(uint32_t nsecs);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -70,5 +70,22 @@ void pid_exit(int status, bool dodetach);
  */
 int pid_join(pid_t targetpid, int *status, int flags);
 
+/*
+ * Resource usage.
+ *
+ * pid_setthread records the thread running as PID, so its usage can
+ * be looked at while it runs. pid_exitusage records the current
+ * thread's final usage as it exits, and adds it (and that of its own
+ * exited children) to its parent's total for exited children, which
+ * pid_childusage returns. pid_printusage prints the usage of every
+ * process in the table.
+ */
+struct thread;
+struct threadusage;
+void pid_setthread(pid_t pid, struct thread *t);
+void pid_exitusage(const struct threadusage *usage);
+void pid_childusage(struct threadusage *usage);
+void pid_printusage(void);
+
 
 #endif /* _PID_H_ */
@@ -90,5 +90,8 @@ struct vnode *sfs_getroot(struct fs *fs);
 /* Get directory */
 int sfs_getdirentry(struct vnode *vnode, struct uio *uio);
 
+/* Set up the sfs_vnode object cache (called at mount time) */
+int sfs_vnode_cache_init(void);
+
 
 #endif /* _SFS_H_ */
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -57,12 +58,33 @@
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	const char *splk_name;		    /* Name for lockstat, or NULL. */
+	vaddr_t splk_site;		    /* Where it was acquired. */
+	uint32_t splk_acquired;		    /* Cycle count when acquired. */
+	uint32_t splk_spun;		    /* Cycles spent spinning for it. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_NAMED(NULL)
+#else
 #define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
+
+/*
+ * The same, for locks that should show up under a name in the lock
+ * statistics. (Unnamed spinlocks are reported by acquire site.)
+ */
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER_NAMED(name) \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, name, 0, 0, 0 }
+#else
+#define SPINLOCK_INITIALIZER_NAMED(name)	SPINLOCK_INITIALIZER
+#endif
 
 /*
  * Spinlock functions.
@@ -74,6 +96,8 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ * setname	Set the name used in the lock statistics. NAME must stay
+ *		valid. Does nothing unless the kernel has lockstat.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +108,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_setname(struct spinlock *lk, const char *name);
+
 
 #endif /* _SPINLOCK_H_ */
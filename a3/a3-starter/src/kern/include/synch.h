@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <cpu.h>	/* for SCHED_NLEVELS */
 
 /*
  * Dijkstra-style semaphore.
@@ -71,15 +72,45 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * An adaptive lock (from lock_create_adaptive) is for short critical
+ * sections: a thread that finds it held by a thread running on
+ * another cpu spins for a while instead of going straight to sleep,
+ * and lock_release hands it directly to the first sleeping waiter,
+ * if any, so nobody can barge in ahead of it.
+ *
+ * Every lock counts its acquisitions, how many of those had to wait,
+ * and the total time spent waiting; these are protected by lk_lock.
+ * With lockstat, the current holder's acquire time and wait are kept
+ * too, so the release can report them.
+ *
+ * Locks do priority inheritance: threads asleep waiting for a lock
+ * are counted in lk_waitlevels by scheduling level, and the holder
+ * runs at the best of those levels if that's better than its own.
+ * lk_waitlevels is protected by pi_lock in synch.c; lk_nwaiters
+ * changes only with both that and lk_lock held.
  */
 struct lock {
         char *lk_name;
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+	bool lk_adaptive;		/* spin, and hand off on release */
+	unsigned lk_acquires;		/* number of acquisitions */
+	unsigned lk_contended;		/* acquisitions that had to wait */
+	uint64_t lk_waitnsecs;		/* total time spent waiting */
+	unsigned lk_waitlevels[SCHED_NLEVELS]; /* sleeping waiters per level */
+	unsigned lk_nwaiters;		/* total of lk_waitlevels */
+	struct lock *lk_heldnext;	/* next in holder's t_heldlocks */
+#if OPT_LOCKSTAT
+	uint64_t lk_acqtime;		/* when the holder got it */
+	uint64_t lk_lastwait;		/* how long the holder waited */
+	bool lk_lastcontended;		/* whether the holder had to wait */
+#endif
 };
 
 struct lock *lock_create(const char *name);
+struct lock *lock_create_adaptive(const char *name);
 void lock_acquire(struct lock *);
 
 /*
@@ -138,4 +169,57 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a stream of readers can't starve writers. That also
+ * means a thread must not acquire a read lock it already holds, or it
+ * can deadlock against a waiting writer.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+
+struct rwlock {
+        char *rwl_name;
+	struct wchan *rwl_rwchan;	/* readers wait here */
+	struct wchan *rwl_wwchan;	/* writers wait here */
+	struct spinlock rwl_lock;
+	unsigned rwl_readers;		/* readers holding the lock */
+	unsigned rwl_wwaiting;		/* writers waiting for it */
+	struct thread *rwl_writer;	/* writer holding it, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read     - Get the lock for reading.
+ *    rwlock_release_read     - Give up a read lock.
+ *    rwlock_acquire_write    - Get the lock for writing.
+ *    rwlock_release_write    - Give up a write lock. Only the thread
+ *                              holding it may do this.
+ *    rwlock_tryacquire_read  - Like rwlock_acquire_read, but return
+ *                              false instead of waiting.
+ *    rwlock_tryacquire_write - Like rwlock_acquire_write, but return
+ *                              false instead of waiting.
+ *    rwlock_downgrade        - Turn a write lock into a read lock,
+ *                              without letting any writer in between.
+ *    rwlock_do_i_hold_write  - Return true if the current thread holds
+ *                              the lock for writing. (Readers aren't
+ *                              tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_tryacquire_read(struct rwlock *);
+bool rwlock_tryacquire_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
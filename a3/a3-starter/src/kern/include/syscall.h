@@ -61,11 +61,19 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 /* ASST2 setup */
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_execv(userptr_t prog, userptr_t args);
+int sys_getrusage(int who, userptr_t usage);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int *retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t offset, int *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t offset, int *retval);
+int sys_sendfile(int outfd, int infd, size_t len, int *retval);
 
 /*
  * ASST2 - Prototypes for new bootstrap/shutdown functions needed by syscalls
@@ -45,6 +45,7 @@ int whalemating(int, char **);
 
 /* For testing the wait implementation. */
 int waittest(int, char **);
+int pidalloctest(int, char **);
 
 /* lib tests */
 int arraytest(int, char **);
@@ -55,9 +56,13 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
+int threadtest5(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int pitest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -67,10 +72,12 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int printfile(int, char **);
 int inlinetest(int, char **);
+int namecachetest(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int kmemcachetest(int, char **);
 int coremaptest(int, char **);
 int coremapstress(int, char **);
 int nettest(int, char **);
@@ -41,6 +41,7 @@
 
 struct addrspace;
 struct cpu;
+struct lock;
 struct vnode;
 
 /* BEGIN A3 SETUP */
@@ -69,6 +70,19 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Resource usage. Times are in nanoseconds. Each thread's is only
+ * updated by the thread itself.
+ */
+struct threadusage {
+	uint64_t tu_utime;		/* Time in user mode */
+	uint64_t tu_stime;		/* Time in the kernel */
+	unsigned tu_nvcsw;		/* Voluntary context switches */
+	unsigned tu_nivcsw;		/* Involuntary (preemptions) */
+	unsigned tu_minflt;		/* Page faults not needing I/O */
+	unsigned tu_majflt;		/* Page faults needing I/O */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -87,6 +101,29 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	unsigned t_priority;		/* Scheduling level (0 is highest) */
+	unsigned t_quantum;		/* Hardclocks left at this level */
+	unsigned t_lastran;		/* t_cpu->c_hardclocks when last run */
+	unsigned t_runlevel;		/* Run queue level, if on one */
+
+	/*
+	 * Priority inheritance; see synch.c. t_heldlocks is only
+	 * used by the thread itself; the rest is protected by pi_lock.
+	 * The effective scheduling level is the better of t_priority
+	 * and t_inherited.
+	 */
+	unsigned t_inherited;		/* Best level donated by waiters */
+	struct lock *t_blockedon;	/* Lock being waited for, or NULL */
+	unsigned t_blocklevel;		/* Level counted in t_blockedon */
+	struct lock *t_heldlocks;	/* Locks held, via lk_heldnext */
+
+	/*
+	 * CPU accounting: the time since t_acctstamp is charged to
+	 * user or system time at the next crossing between user mode
+	 * and the kernel, or when the thread is switched out.
+	 */
+	struct threadusage t_usage;	/* Usage so far */
+	uint64_t t_acctstamp;		/* clock_nanotime() of last charge */
 
 	/*
 	 * Interrupt state fields.
@@ -169,6 +206,51 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for one hardclock of its quantum, and
+ * yield if the quantum ran out or a higher-priority thread is ready.
+ * Called from the timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Priority inheritance hooks for the lock code.
+ *
+ * thread_getlevel returns T's effective scheduling level.
+ * thread_inherit sets the level T inherits from threads waiting on
+ * locks it holds (SCHED_NLEVELS for none), moving it within its run
+ * queue if it's on one. The caller must hold pi_lock (in synch.c).
+ */
+unsigned thread_getlevel(struct thread *t);
+void thread_inherit(struct thread *t, unsigned level);
+
+/*
+ * Resource accounting.
+ *
+ * thread_acct_fromuser and thread_acct_touser are called by the trap
+ * code on entry from and return to user mode; thread_acct_fault
+ * counts a page fault; thread_getusage gets the current thread's
+ * usage up to now. threadusage_add adds FROM into TO.
+ */
+void thread_acct_fromuser(void);
+void thread_acct_touser(void);
+void thread_acct_fault(bool major);
+void thread_getusage(struct threadusage *tu);
+void threadusage_add(struct threadusage *to, const struct threadusage *from);
+
+/*
+ * Print per-cpu, per-level run queue lengths, scheduler counters and
+ * thread cache counters.
+ */
+void thread_printsched(void);
+
+/*
+ * Set how many exited threads (with their stacks) each cpu keeps for
+ * reuse by thread_fork. Returns the old setting. 0 turns the cache
+ * off; what's already cached drains away.
+ */
+unsigned thread_setcachemax(unsigned max);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
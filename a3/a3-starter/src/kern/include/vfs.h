@@ -114,6 +114,32 @@ int vfs_rename(char *oldpath, char *newpath);
 int vfs_chdir(char *path);
 int vfs_getcwd(struct uio *buf);
 
+/*
+ * Name lookup cache, for filesystems to use in VOP_LOOKUP. All of
+ * these require the vfs big lock.
+ *
+ *    vfs_namecache_lookup  - Look up NAME in DIR. Returns false on a
+ *                            miss; otherwise *RESULT is the vnode,
+ *                            increfed, or NULL if NAME doesn't exist.
+ *    vfs_namecache_enter   - Record that NAME in DIR is VN, or doesn't
+ *                            exist if VN is NULL.
+ *    vfs_namecache_remove  - Forget NAME in DIR. Filesystems must call
+ *                            this whenever a name is created, removed,
+ *                            or renamed.
+ *    vfs_namecache_purgefs - Forget everything on filesystem FS.
+ *    vfs_namecache_stats   - Get the hit, negative hit, and miss counts.
+ */
+
+void vfs_namecache_bootstrap(void);
+bool vfs_namecache_lookup(struct vnode *dir, const char *name,
+			  struct vnode **result);
+void vfs_namecache_enter(struct vnode *dir, const char *name,
+			 struct vnode *vn);
+void vfs_namecache_remove(struct vnode *dir, const char *name);
+void vfs_namecache_purgefs(struct fs *fs);
+void vfs_namecache_stats(unsigned *hits, unsigned *neghits,
+			 unsigned *misses);
+
 /*
  * Misc
  *
@@ -80,13 +80,18 @@ struct addrspace;
  * to a virtual page in the address space of a process.
  *
  * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * between processes. lp_as is the address space the page belongs to;
+ * its resident pages are counted against it. lp_wsepoch is the
+ * working-set interval (as_wsepoch) in which the page was last
+ * faulted on, and is protected by the address space's as_vmlock.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
 	struct spinlock lp_spinlock;
+	struct addrspace *lp_as;
+	uint32_t lp_wsepoch;
 };
 
 /* lpage flags */
@@ -101,7 +106,9 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
- *    lpage_create - create a blank, non-materialized lpage structure.
+ *    lpage_bootstrap - set up the lpage object cache
+ *    lpage_create - create a blank, non-materialized lpage structure
+ *                   belonging to an address space.
  *    lpage_destroy - destroy an lpage
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
@@ -111,14 +118,16 @@ struct lpage {
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
  */
-struct lpage     *lpage_create(void);
+void              lpage_bootstrap(void);
+struct lpage     *lpage_create(struct addrspace *as);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
-int	              lpage_copy(struct lpage *from, struct lpage **toret);
-int               lpage_zerofill(struct lpage **lpret);
+int	              lpage_copy(struct lpage *from, struct addrspace *newas,
+			                 struct lpage **toret);
+int               lpage_zerofill(struct addrspace *as, struct lpage **lpret);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
 			                  int faulttype, vaddr_t va);
 void              lpage_evict(struct lpage *victim);
@@ -216,6 +225,38 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
  */
 extern struct lock *global_paging_lock;
 
+////////////////////////////////////////////////////////////
+//
+// resident-set and working-set accounting
+//
+
+/*
+ * Functions in addrspace.c:
+ *
+ *    as_rss_adjust:    count pages becoming resident (DELTA > 0) or
+ *                      not (DELTA < 0) against an address space.
+ *                      Called by the coremap.
+ *
+ *    as_reference:     note a fault on LP, for the fault counts and
+ *                      the working-set estimate. MAJOR is true if the
+ *                      page wasn't resident.
+ *
+ *    as_evict_class:   how good a victim a resident page is, for
+ *                      page replacement: AS_EVICT_OVERLIMIT if its
+ *                      address space is over its RSS soft limit,
+ *                      AS_EVICT_COLD if it's outside the working set,
+ *                      otherwise AS_EVICT_WARM. The page must be
+ *                      pinned, so it can't be destroyed under us.
+ */
+#define AS_EVICT_WARM		0
+#define AS_EVICT_COLD		1
+#define AS_EVICT_OVERLIMIT	2
+
+void		as_rss_adjust(struct addrspace *as, int delta);
+void		as_reference(struct addrspace *as, struct lpage *lp,
+			     bool major);
+int		as_evict_class(struct lpage *lp);
+
 ////////////////////////////////////////////////////////////
 //
 // other bits
@@ -77,8 +77,14 @@ void wchan_sleep(struct wchan *wc);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if there was none.
+ * The thread may already be running by then; the pointer is only
+ * safe to use if the caller knows it can't have exited, e.g. because
+ * it's waiting for something the caller holds.
  */
-void wchan_wakeone(struct wchan *wc);
+struct thread;	/* from <thread.h> */
+struct thread *wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
 
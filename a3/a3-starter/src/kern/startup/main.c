@@ -49,6 +49,7 @@
 #include <test.h>
 #include <version.h>
 #include <pid.h> /* to bootstrap process ID system - New for ASST2 */
+#include <file.h> /* to bootstrap the open file cache */
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -111,6 +112,7 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	file_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
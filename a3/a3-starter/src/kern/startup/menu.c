@@ -46,11 +46,20 @@
 #include "opt-dumbvm.h"
 /* Needed to include optional sfs code */
 #include "opt-sfs.h"
+/* Needed to include the kmalloc site profiling commands */
+#include "opt-kheapprof.h"
+/* Needed to include the lock statistics command */
+#include <lockstat.h>
 
 #if OPT_SFS
 #include <sfs.h>
 #endif
 
+#if !OPT_DUMBVM
+#include <addrspace.h>
+#endif
+#include <pid.h>
+
 /* Hacky semaphore solution to make menu thread wait for command
  * thread, in absence of thread_join solution.
  */
@@ -533,6 +542,155 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_KHEAPPROF
+
+/* Number of sites khs and khdiff print by default. */
+#define KHEAPPROF_DEFNUM 10
+
+/*
+ * Command for printing the busiest kmalloc sites.
+ */
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: khs [count]\n");
+		return EINVAL;
+	}
+
+	kheap_printsites(nargs == 2 ? (unsigned)atoi(args[1])
+			 : KHEAPPROF_DEFNUM);
+	return 0;
+}
+
+/*
+ * Commands for finding kmalloc leaks: take a snapshot with khsnap,
+ * run a test (e.g. km2 or fs5), then khdiff shows what's still
+ * allocated that wasn't before.
+ */
+static
+int
+cmd_kheapsnap(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_snapshot();
+	return 0;
+}
+
+static
+int
+cmd_kheapdiff(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: khdiff [count]\n");
+		return EINVAL;
+	}
+
+	kheap_printdiff(nargs == 2 ? (unsigned)atoi(args[1])
+			: KHEAPPROF_DEFNUM);
+	return 0;
+}
+
+#endif /* OPT_KHEAPPROF */
+
+#if OPT_LOCKSTAT
+
+/* Number of locks lockstat prints by default. */
+#define LOCKSTAT_DEFNUM 15
+
+/*
+ * Command for printing the most contended locks, or with "reset",
+ * clearing the statistics (e.g. before running a benchmark).
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: lockstat [count | reset]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+		return 0;
+	}
+	lockstat_print(nargs == 2 ? (unsigned)atoi(args[1])
+		       : LOCKSTAT_DEFNUM);
+	return 0;
+}
+
+#endif /* OPT_LOCKSTAT */
+
+/*
+ * Command for printing the scheduler's run queue lengths per level.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printsched();
+	return 0;
+}
+
+/*
+ * Command for printing each process's cpu time, context switches and
+ * page faults.
+ */
+static
+int
+cmd_rusage(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pid_printusage();
+	return 0;
+}
+
+#if !OPT_DUMBVM
+
+/*
+ * Command for printing per-process resident-set sizes, working-set
+ * estimates, and fault counts.
+ */
+static
+int
+cmd_vmrss(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	as_printrss();
+	return 0;
+}
+
+/*
+ * Command for setting RSS soft limits (in pages; 0 for none), either
+ * for one process or for processes started from now on.
+ */
+static
+int
+cmd_rsslimit(int nargs, char **args)
+{
+	if (nargs == 2) {
+		return as_setrsslimit(INVALID_PID, atoi(args[1]));
+	}
+	if (nargs == 3) {
+		return as_setrsslimit(atoi(args[1]), atoi(args[2]));
+	}
+	kprintf("Usage: rsslimit [pid] pages\n");
+	return EINVAL;
+}
+
+#endif /* !OPT_DUMBVM */
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -594,15 +752,21 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmem cache test               ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread sleep test             ",
+	"[tt5] Fork latency test             ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test                  ",
+	"[sy5] Priority inheritance test     ",
+	"[pidt] Pid allocation test          ",
 	"[cm] Coremap test           (3)     ",
 	"[cm2] Coremap stress test   (3)     ",
 	"[fs1] Filesystem test               ",
@@ -610,6 +774,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS long stress        (4)     ",
+	"[fs7] Name cache test               ",
 	NULL
 };
 
@@ -634,6 +799,20 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[sched] Scheduler queue stats       ",
+	"[ru] Process CPU usage              ",
+#if !OPT_DUMBVM
+	"[vmrss] Process memory stats        ",
+	"[rsslimit] Set RSS soft limit       ",
+#endif
+#if OPT_KHEAPPROF
+	"[khs] Kernel heap top sites         ",
+	"[khsnap] Kernel heap snapshot       ",
+	"[khdiff] Kernel heap since snapshot ",
+#endif
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -682,27 +861,47 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "sched",	cmd_sched },
+	{ "ru",		cmd_rusage },
+#if !OPT_DUMBVM
+	{ "vmrss",	cmd_vmrss },
+	{ "rsslimit",	cmd_rsslimit },
+#endif
+#if OPT_KHEAPPROF
+	{ "khs",	cmd_kheapsites },
+	{ "khsnap",	cmd_kheapsnap },
+	{ "khdiff",	cmd_kheapdiff },
+#endif
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	kmemcachetest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
+	{ "tt5",	threadtest5 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	pitest },
 
 	/* ASST2 tests */
 	/* For testing the wait implementation. */
 	{ "wt",		waittest },
+	{ "pidt",	pidalloctest },
 
 /* BEGIN A3 SETUP */
 /* Only include coremap tests if not using dumbvm */	
@@ -720,6 +919,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
         { "fs6",        inlinetest },
+	{ "fs7",	namecachetest },
 
 	{ NULL, NULL }
 };
@@ -13,15 +13,33 @@
 #include <syscall.h>
 #include <vfs.h>
 #include <lib.h>
+#include <kmem.h>
 #include <synch.h>
+#include <atomic.h>
 #include <thread.h>
 #include <current.h>
 #include <vnode.h>
 #include <uio.h>
 #include <kern/fcntl.h>
 
+/* object cache for openfiles */
+static struct kmem_cache *openfiles_cache;
+
 /*** openfile functions ***/
 
+/*
+ * file_bootstrap
+ * sets up the openfiles object cache. called once during boot.
+ */
+void
+file_bootstrap(void)
+{
+	openfiles_cache = kmem_cache_create("openfiles",
+					    sizeof(struct openfiles));
+	if(openfiles_cache == NULL)
+		panic("file_bootstrap: Out of memory\n");
+}
+
 /*
  * file_open
  * opens a file, places it in the filetable, sets RETFD to the file
@@ -44,7 +62,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
 		return error;
 
 	//allocate space for the file info
-	file = kmalloc(sizeof(struct openfiles));
+	file = kmem_cache_alloc(openfiles_cache);
 	if(file == NULL) {
 		vfs_close(vn);
 		return ENOMEM;
@@ -54,13 +72,13 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	file->filename = filename;
 	file->flag = flags;
 	file->offset = 0;
-	file->links = 1;
+	atomic_set(&file->refcount, 1);
 	file->vn = vn;
 
-	file->file_lock = lock_create("file_lock");
+	file->file_lock = lock_create_adaptive("file_lock");
 	if(file->file_lock == NULL) {
 		vfs_close(vn);
-		kfree(file);
+		kmem_cache_free(openfiles_cache, file);
 		return ENOMEM;
 	}
 
@@ -69,7 +87,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	if(error) {
 		vfs_close(vn);
 		lock_destroy(file->file_lock);
-		kfree(file);
+		kmem_cache_free(openfiles_cache, file);
 		return error;
 	}
 	return 0;
@@ -88,34 +106,44 @@ file_close(int fd)
 	struct openfiles *file;
 	int error;
 
-	//check that the fd is valid
-	error = check_fd(fd);
+	error = file_get(fd, &file);
 	if(error)
 		return error;
 
-	file = curthread->t_filetable->file[fd];
-	if(file == NULL)
-		return EBADF;
+	curthread->t_filetable->file[fd] = NULL;
+	file_decref(file);
 
-	lock_acquire(file->file_lock);
+	return 0;
+}
 
-    //decrease the files link
-	file->links--;
+/*
+ * file_incref
+ * adds a reference for another filetable slot pointing to FILE.
+ */
+void
+file_incref(struct openfiles *file)
+{
+	atomic_add(&file->refcount, 1);
+}
 
-	//if the link is zero so close the file
-	if(file->links < 0) {
-		if(file->vn != NULL)
-			vfs_close(file->vn);
-		lock_release(file->file_lock);
-		lock_destroy(file->file_lock);
-		kfree(file);
-	}
-	else
-		lock_release(file->file_lock);
+/*
+ * file_decref
+ * drops a filetable slot's reference to FILE, and closes the file if
+ * it was the last one. Nobody else can find the file by then, so the
+ * lock isn't needed to tear it down.
+ */
+void
+file_decref(struct openfiles *file)
+{
+	KASSERT(atomic_get(&file->refcount) > 0);
 
-	curthread->t_filetable->file[fd] = NULL;
+	if(atomic_add(&file->refcount, -1) > 0)
+		return;
 
-	return 0;
+	if(file->vn != NULL)
+		vfs_close(file->vn);
+	lock_destroy(file->file_lock);
+	kmem_cache_free(openfiles_cache, file);
 }
 
 /*** filetable functions ***/
@@ -223,8 +251,7 @@ insert_file(struct openfiles *file, int *retfd)
 
 
 /*
- * Checks if the fd is valid and is in the filetable. Return the openfile if it
- * is, null otherwise.
+ * Checks if the fd is in range for the filetable.
  */
 int
 check_fd(int fd)
@@ -235,6 +262,30 @@ check_fd(int fd)
 	return 0;
 }
 
+/*
+ * Looks up the open file for FD in the curthread's filetable, or returns
+ * EBADF if there isn't one.
+ *
+ * This takes no lock: a filetable belongs to a single thread, which is
+ * the only one that changes it, and the slot's reference keeps the open
+ * file alive until this same thread closes it.
+ */
+int
+file_get(int fd, struct openfiles **retfile)
+{
+	struct openfiles *file;
+
+	if(check_fd(fd))
+		return EBADF;
+
+	file = curthread->t_filetable->file[fd];
+	if(file == NULL)
+		return EBADF;
+
+	*retfile = file;
+	return 0;
+}
+
 
 /*
  * Duplicates the current threads filetable and puts it into duplicate.
@@ -249,18 +300,15 @@ duplicate_filetable(struct filetable **duplicate)
 
 	//allocate space for the filetable
 	*duplicate = kmalloc(sizeof(struct filetable));
-	if(duplicate == NULL)
+	if(*duplicate == NULL)
 		return ENOMEM;
 
-	//copy all entries to the duplicate table and increase all the link counts
-	//by 1
+	//copy all entries to the duplicate table and add a reference to each
 	for(int i=0; i < __OPEN_MAX; i++) {
 		if(curthread->t_filetable->file[i] == NULL)
 			(*duplicate)->file[i] = NULL;
 		else {
-			lock_acquire(curthread->t_filetable->file[i]->file_lock);
-			curthread->t_filetable->file[i]->links++;
-			lock_release(curthread->t_filetable->file[i]->file_lock);
+			file_incref(curthread->t_filetable->file[i]);
 			(*duplicate)->file[i] = curthread->t_filetable->file[i];
 		}
 	}
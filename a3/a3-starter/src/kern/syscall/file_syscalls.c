@@ -23,6 +23,7 @@
 #include <synch.h>
 #include <file.h>
 #include <kern/seek.h>
+#include <limits.h>
 
 
 /*
@@ -46,6 +47,170 @@ mk_useruio(struct iovec *iov, struct uio *u, userptr_t buf,
 	u->uio_space = curthread->t_addrspace;
 }
 
+/*
+ * Small iovec arrays for readv and writev go on the stack; larger
+ * ones are allocated. The total length has to fit in the return value.
+ */
+#define UIO_SMALLIOV	8
+#define UIO_MAXTOTAL	0x7fffffff
+
+/* sendfile copies this much at a time; 16 SFS blocks */
+#define SENDFILE_CHUNK	8192
+
+/*
+ * iov_copyin
+ * copies in and checks the user's iovec array for readv or writev,
+ * and sets up the uio. The array is put in SMALL if it fits and
+ * allocated otherwise; *RETIOV is what to pass to iov_free.
+ */
+static
+int
+iov_copyin(userptr_t uiov, int iovcnt, struct iovec *small,
+	   struct iovec **retiov, struct uio *u, enum uio_rw rw)
+{
+	struct iovec *iov;
+	size_t total;
+	int i, result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	if (iovcnt <= UIO_SMALLIOV) {
+		iov = small;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(*iov));
+		if (iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		goto fail;
+	}
+
+	total = 0;
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len > UIO_MAXTOTAL - total) {
+			result = EINVAL;
+			goto fail;
+		}
+		total += iov[i].iov_len;
+	}
+
+	u->uio_iov = iov;
+	u->uio_iovcnt = iovcnt;
+	u->uio_offset = 0;
+	u->uio_resid = total;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = curthread->t_addrspace;
+
+	*retiov = iov;
+	return 0;
+
+ fail:
+	if (iov != small) {
+		kfree(iov);
+	}
+	return result;
+}
+
+static
+void
+iov_free(struct iovec *iov, struct iovec *small)
+{
+	if (iov != small) {
+		kfree(iov);
+	}
+}
+
+/*
+ * file_doio
+ * common code for the read and write calls: moves data between FILE
+ * and the buffers in UIO, and returns the amount moved in RETVAL.
+ *
+ * Normally the transfer is at the file's offset, which is read and
+ * advanced under the file lock. If POSITIONAL is set (pread/pwrite)
+ * the transfer is at UIO's own offset instead and the file's offset
+ * isn't touched, so the lock isn't taken and several threads can do
+ * I/O on the same open file at once.
+ */
+static
+int
+file_doio(struct openfiles *file, struct uio *u, bool positional,
+	  int *retval)
+{
+	size_t len;
+	int result;
+
+	//check that the file is open the right way; the mode never changes
+	if ((file->flag & O_ACCMODE) ==
+	    (u->uio_rw == UIO_READ ? O_WRONLY : O_RDONLY))
+		return EBADF;
+
+	len = u->uio_resid;
+
+	if (positional) {
+		if (u->uio_offset < 0)
+			return EINVAL;
+		//the console can't do I/O at an offset
+		if (VOP_TRYSEEK(file->vn, u->uio_offset))
+			return ESPIPE;
+
+		if (u->uio_rw == UIO_READ)
+			result = VOP_READ(file->vn, u);
+		else
+			result = VOP_WRITE(file->vn, u);
+		if (result)
+			return result;
+	}
+	else {
+		lock_acquire(file->file_lock);
+
+		u->uio_offset = file->offset;
+		if (u->uio_rw == UIO_READ)
+			result = VOP_READ(file->vn, u);
+		else
+			result = VOP_WRITE(file->vn, u);
+		if (result) {
+			lock_release(file->file_lock);
+			return result;
+		}
+
+		//set the offset
+		file->offset = u->uio_offset;
+		lock_release(file->file_lock);
+	}
+
+	/*
+	 * The amount moved is the size of the buffers originally,
+	 * minus how much is left in them.
+	 */
+	*retval = len - u->uio_resid;
+	return 0;
+}
+
+/*
+ * file_rw
+ * file_doio on the file open as FD.
+ */
+static
+int
+file_rw(int fd, struct uio *u, bool positional, int *retval)
+{
+	struct openfiles *file;
+	int result;
+
+	result = file_get(fd, &file);
+	if (result)
+		return result;
+
+	return file_doio(file, u, positional, retval);
+}
+
 /*
  * sys_open
  * just copies in the filename, then passes work to file_open.
@@ -93,8 +258,8 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	int error;
 	struct openfiles *oldfile;
 
-	//check that both fds ae valid, and that oldfd isn't null
-	error = check_fd(oldfd);
+	//check that both fds are valid, and that oldfd isn't null
+	error = file_get(oldfd, &oldfile);
 	if(error)
 		return error;
 
@@ -102,10 +267,6 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	if(error)
 		return error;
 
-	oldfile = curthread->t_filetable->file[oldfd];
-	if(oldfile == NULL)
-		return EBADF;
-
 	//if both fd's are the same, do nothing
 	if(oldfd == newfd) {
 		*retval = newfd;
@@ -113,17 +274,14 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	}
 
 	//if the newfd has a file in it close it
-	if(curthread->t_filetable->file[newfd] != NULL)
+	if(curthread->t_filetable->file[newfd] != NULL) {
 		error = file_close(newfd);
 		if(error)
 			return error;
-
-	//increase the oldfile's links count
-	lock_acquire(oldfile->file_lock);
-	oldfile->links++;
-	lock_release(oldfile->file_lock);
+	}
 
 	//link file[newfd] to oldfile
+	file_incref(oldfile);
 	curthread->t_filetable->file[newfd] = oldfile;
 
 	*retval = newfd;
@@ -152,53 +310,16 @@ sys_dup2(int oldfd, int newfd, int *retval)
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	struct openfiles *file;
 	struct uio user_uio;
 	struct iovec user_iov;
-	int result;
-	int error;
 
 	if(buf == NULL)
 		return EFAULT;
 
-	//check if the fd is valid
-	error = check_fd(fd);
-	if (error)
-		return error;
-
-	file = curthread->t_filetable->file[fd];
-	if(file == NULL)
-		return EBADF;
-
-	lock_acquire(file->file_lock);
-
-	//check that the file is open for reading
-	if(file->flag == O_WRONLY){
-		lock_release(file->file_lock);
-		return EBADF;
-	}
-
-	/* set up a uio with the buffer, its size, and the current offset */
-	mk_useruio(&user_iov, &user_uio, buf, size, file->offset, UIO_READ);
-
-	/* does the read */
-	result = VOP_READ(file->vn, &user_uio);
-	if (result) {
-		lock_release(file->file_lock);
-		return result;
-	}
-
-	//set the offset
-	file->offset = user_uio.uio_offset;
-	lock_release(file->file_lock);
-
-	/*
-	 * The amount read is the size of the buffer originally, minus
-	 * how much is left in it.
-	 */
-	*retval = size - user_uio.uio_resid;
+	/* set up a uio with the buffer and its size; file_rw does the rest */
+	mk_useruio(&user_iov, &user_uio, buf, size, 0, UIO_READ);
 
-	return 0;
+	return file_rw(fd, &user_uio, false, retval);
 }
 
 /*
@@ -223,53 +344,170 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 int
 sys_write(int fd, userptr_t buf, size_t len, int *retval)
 {
-	struct openfiles *file;
-        struct uio user_uio;
-        struct iovec user_iov;
-        int result;
-	int error;
+	struct uio user_uio;
+	struct iovec user_iov;
 
 	if(buf == NULL)
 		return EFAULT;
 
-        //check if the fd is valid
-	error = check_fd(fd);
-        if(error)
-        	return error;
+	/* set up a uio with the buffer and its size; file_rw does the rest */
+	mk_useruio(&user_iov, &user_uio, buf, len, 0, UIO_WRITE);
 
-	file = curthread->t_filetable->file[fd];
-	if(file == NULL)
-		return EBADF;
+	return file_rw(fd, &user_uio, false, retval);
+}
 
-	lock_acquire(file->file_lock);
+/*
+ * sys_readv, sys_writev
+ * like read and write, but gather from/scatter to IOVCNT buffers
+ * described by the iovec array at IOV, in one transfer.
+ */
+int
+sys_readv(int fd, userptr_t iov, int iovcnt, int *retval)
+{
+	struct iovec small[UIO_SMALLIOV];
+	struct iovec *kiov;
+	struct uio user_uio;
+	int result;
 
-	//check that the file is open for writing
-	if(file->flag == O_RDONLY){
-		lock_release(file->file_lock);
-		return EBADF;
-	}
+	result = iov_copyin(iov, iovcnt, small, &kiov, &user_uio, UIO_READ);
+	if (result)
+		return result;
 
-        /* set up a uio with the buffer, its size, and the current offset */
-        mk_useruio(&user_iov, &user_uio, buf, len, file->offset, UIO_WRITE);
+	result = file_rw(fd, &user_uio, false, retval);
+	iov_free(kiov, small);
+	return result;
+}
 
-        /* does the write */
-        result = VOP_WRITE(file->vn, &user_uio);
-        if (result) {
-		lock_release(file->file_lock);
-                return result;
-        }
+int
+sys_writev(int fd, userptr_t iov, int iovcnt, int *retval)
+{
+	struct iovec small[UIO_SMALLIOV];
+	struct iovec *kiov;
+	struct uio user_uio;
+	int result;
 
-	//set the offset
-	file->offset = user_uio.uio_offset;
-	lock_release(file->file_lock);
+	result = iov_copyin(iov, iovcnt, small, &kiov, &user_uio, UIO_WRITE);
+	if (result)
+		return result;
 
-        /*
-         * the amount written is the size of the buffer originally,
-         * minus how much is left in it.
-         */
-        *retval = len - user_uio.uio_resid;
+	result = file_rw(fd, &user_uio, false, retval);
+	iov_free(kiov, small);
+	return result;
+}
 
-        return 0;
+/*
+ * sys_pread, sys_pwrite
+ * like read and write, but at OFFSET rather than the file's offset,
+ * which is left alone.
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t offset, int *retval)
+{
+	struct uio user_uio;
+	struct iovec user_iov;
+
+	if(buf == NULL)
+		return EFAULT;
+
+	mk_useruio(&user_iov, &user_uio, buf, size, offset, UIO_READ);
+	return file_rw(fd, &user_uio, true, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf, size_t len, off_t offset, int *retval)
+{
+	struct uio user_uio;
+	struct iovec user_iov;
+
+	if(buf == NULL)
+		return EFAULT;
+
+	mk_useruio(&user_iov, &user_uio, buf, len, offset, UIO_WRITE);
+	return file_rw(fd, &user_uio, true, retval);
+}
+
+/*
+ * sys_sendfile
+ * copies up to LEN bytes from INFD to OUTFD, at and advancing both
+ * files' offsets, without the data going out to userspace and back.
+ * Returns the amount copied, which is 0 at end of file.
+ *
+ * There's no buffer cache to copy between, so the data goes through
+ * a kernel buffer SENDFILE_CHUNK bytes at a time. Each chunk is read
+ * and then written under the respective file's lock, never both at
+ * once, so INFD and OUTFD can be the same file and two sendfiles in
+ * opposite directions can't deadlock. Like read, this stops early on
+ * a short read (e.g. a line from the console). On a short write the
+ * input's offset is wound back to just past what was written, unless
+ * the input can't seek.
+ */
+int
+sys_sendfile(int outfd, int infd, size_t len, int *retval)
+{
+	struct openfiles *in, *out;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t total, chunk;
+	int got, put;
+	int result;
+
+	result = file_get(infd, &in);
+	if (result)
+		return result;
+	result = file_get(outfd, &out);
+	if (result)
+		return result;
+
+	//the total has to fit in the return value
+	if (len > UIO_MAXTOTAL)
+		len = UIO_MAXTOTAL;
+
+	buf = kmalloc(SENDFILE_CHUNK);
+	if (buf == NULL)
+		return ENOMEM;
+
+	total = 0;
+	while (total < len) {
+		chunk = len - total;
+		if (chunk > SENDFILE_CHUNK)
+			chunk = SENDFILE_CHUNK;
+
+		uio_kinit(&iov, &ku, buf, chunk, 0, UIO_READ);
+		result = file_doio(in, &ku, false, &got);
+		if (result || got == 0)
+			break;
+
+		uio_kinit(&iov, &ku, buf, got, 0, UIO_WRITE);
+		result = file_doio(out, &ku, false, &put);
+		if (result)
+			put = 0;
+		total += put;
+
+		if (put < got) {
+			/*
+			 * Give back what was read but not written, if
+			 * the input can seek; from the console it's
+			 * just lost, as after a short write anywhere.
+			 */
+			lock_acquire(in->file_lock);
+			if (!VOP_TRYSEEK(in->vn, in->offset - (got - put)))
+				in->offset -= got - put;
+			lock_release(in->file_lock);
+			break;
+		}
+		if ((size_t)got < chunk)
+			break;
+	}
+
+	kfree(buf);
+
+	//as with a short write, an error after some data moved isn't reported
+	if (result && total == 0)
+		return result;
+
+	*retval = total;
+	return 0;
 }
 
 /*
@@ -281,49 +519,49 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 {
 	int error;
 	struct stat info;
+	struct openfiles *file;
 
 	//check that fd is valid
-	error = check_fd(fd);
+	error = file_get(fd, &file);
 	if(error)
 		return error;
 
-	if(curthread->t_filetable->file[fd] == NULL)
-		return EBADF;
-
-	lock_acquire(curthread->t_filetable->file[fd]->file_lock);
+	lock_acquire(file->file_lock);
 
 	//get the new offset value
 	if(whence == SEEK_SET)
 		*retval = offset;
 	else if(whence == SEEK_CUR)
-		*retval = curthread->t_filetable->file[fd]->offset + offset;
+		*retval = file->offset + offset;
 	else if(whence == SEEK_END) {
-		error = VOP_STAT(curthread->t_filetable->file[fd]->vn, &info);
-		if(error)
+		error = VOP_STAT(file->vn, &info);
+		if(error) {
+			lock_release(file->file_lock);
 			return error;
+		}
 
 		*retval = info.st_size + offset;
 	}
 	else {
-		lock_release(curthread->t_filetable->file[fd]->file_lock);
+		lock_release(file->file_lock);
 		return EINVAL;
 	}
 
 	//check that the new offset isn't negative
 	if(*retval < 0){
-		lock_release(curthread->t_filetable->file[fd]->file_lock);
+		lock_release(file->file_lock);
 		return EINVAL;
 	}
 
 	//check that fd is not a console device
-	error = VOP_TRYSEEK(curthread->t_filetable->file[fd]->vn, *retval);
+	error = VOP_TRYSEEK(file->vn, *retval);
 	if(error) {
-		lock_release(curthread->t_filetable->file[fd]->file_lock);
+		lock_release(file->file_lock);
 		return ESPIPE;
 	}
 
-	curthread->t_filetable->file[fd]->offset = *retval;
-	lock_release(curthread->t_filetable->file[fd]->file_lock);
+	file->offset = *retval;
+	lock_release(file->file_lock);
 	return 0;
 }
 
@@ -415,30 +653,27 @@ sys___getcwd(userptr_t buf, size_t buflen, int *retval)
 int
 sys_fstat(int fd, userptr_t statptr)
 {
-		// If it is a bad file descriptor
-        if ( fd < 0 || fd >= __OPEN_MAX )
-        {
-        	return EBADF;
-        }
-        struct openfiles *file = curthread->t_filetable->file[fd];
-        if (file == NULL)
+        struct openfiles *file;
+        struct vnode *file_vnode;
+        struct stat stats;
+        struct uio 	user_uio;
+        struct iovec user_iov;
+        int result;
+
+        // If it is a bad file descriptor; no lock, since vn never changes
+        result = file_get(fd, &file);
+        if (result)
         {
-        	return EBADF;
+        	return result;
         }
 
         // If it is a bad address
-        if ( statptr == NULL || curthread->t_filetable->file[fd]->vn == NULL )
+        if ( statptr == NULL )
         {
         	return EFAULT;
         }
 
-        struct vnode *file_vnode;
-        struct stat stats;
-        struct uio 	user_uio;
-        struct iovec user_iov;
-        int result;
-
-        file_vnode = curthread->t_filetable->file[fd]->vn;
+        file_vnode = file->vn;
 
         // If file does not exist
         if ( !file_vnode )
@@ -465,26 +700,25 @@ sys_fstat(int fd, userptr_t statptr)
 int
 sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
 {
+        struct openfiles *file;
+        struct uio user_uio;
+        struct iovec user_iov;
+        struct vnode *file_vnode;
+        int result;
+
         // If it is a bad file descriptor
-        if ( fd < 0 || fd >= __OPEN_MAX )
-        {
-        	return EBADF;
-        }
-        if ( curthread->t_filetable->file[fd] == NULL )
+        result = file_get(fd, &file);
+        if ( result )
         {
-        	return EBADF;
+        	return result;
         }
         // If it is a bad address
-        if ( buf == NULL || curthread->t_filetable->file[fd]->vn == NULL )
+        if ( buf == NULL )
         {
         	return EFAULT;
         }
-        struct uio user_uio;
-        struct iovec user_iov;
-        struct vnode *file_vnode;
-        int result;
 
-        file_vnode = curthread->t_filetable->file[fd]->vn;
+        file_vnode = file->vn;
 
         // If file does not exist
         if (!file_vnode)
@@ -493,20 +727,23 @@ sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
         	return EBADF;
         }
 
-        mk_useruio(&user_iov, &user_uio, buf, buflen, curthread->t_filetable->file[fd]->offset, UIO_READ);
+        // the offset moves, so this has to hold the file lock
+        lock_acquire(file->file_lock);
+        mk_useruio(&user_iov, &user_uio, buf, buflen, file->offset, UIO_READ);
         result = VOP_GETDIRENTRY(file_vnode, &user_uio);
 
         // if VOP_GETDIRENTRY fails
         if ( result )
         {
+        	lock_release(file->file_lock);
         	return result;
         }
 
         // return the size of file name 
         *retval = buflen - user_uio.uio_resid;
 
-        // better take this out into a function
-        curthread->t_filetable->file[fd]->offset = user_uio.uio_offset;
+        file->offset = user_uio.uio_offset;
+        lock_release(file->file_lock);
         return 0;
 }
 
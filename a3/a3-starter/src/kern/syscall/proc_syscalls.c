@@ -5,11 +5,20 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/signal.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/wait.h>
+#include <limits.h>
 #include <lib.h>
 #include <thread.h>
 #include <current.h>
 #include <pid.h>
+#include <addrspace.h>
+#include <vfs.h>
 #include <machine/trapframe.h>
+#include <copyinout.h>
 #include <syscall.h>
 
 /*
@@ -47,6 +56,233 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * execv
+ *
+ * The arguments are copied into one ARG_MAX-sized kernel buffer,
+ * already laid out the way they go at the top of the new user stack:
+ * the argv array, then the strings. The argv array is copied in
+ * EXEC_PTRCHUNK pointers at a time, and each string is copyinstr'd
+ * straight into place after the array, so the only allocations are
+ * the buffer and the path and everything is bounds-checked by the
+ * buffer size as it goes. Once the stack top is known the offsets in
+ * the array become user addresses and the whole thing goes out with
+ * one copyout.
+ *
+ * The old address space is destroyed before the new program is
+ * loaded rather than after, so the two images never need memory at
+ * the same time. (With the full VM system, not dumbvm, the old
+ * image's frames also go into this cpu's page cache, where the new
+ * image's first page faults find them.) That means there's nothing
+ * to return to if loading fails, so everything that can be checked
+ * is checked first; after that, failure kills the process.
+ */
+
+#define EXEC_PTRCHUNK	64	/* argv pointers copied in at a time */
+
+/*
+ * Copy the NULL-terminated pointer array at UARGV into PTRS, which has
+ * room for MAXPTRS entries, and return the count (not including the
+ * NULL) in ARGC.
+ */
+static
+int
+exec_copyinptrs(userptr_t uargv, userptr_t *ptrs, unsigned maxptrs,
+		int *argc)
+{
+	vaddr_t uaddr;
+	unsigned n, chunk, i;
+	int result;
+
+	uaddr = (vaddr_t)uargv;
+	for (n = 0; n < maxptrs; n += chunk) {
+		chunk = maxptrs - n;
+		if (chunk > EXEC_PTRCHUNK) {
+			chunk = EXEC_PTRCHUNK;
+		}
+
+		result = copyin((userptr_t)(uaddr + n*sizeof(userptr_t)),
+				&ptrs[n], chunk*sizeof(userptr_t));
+		for (i=0; i<chunk; i++) {
+			if (result) {
+				/*
+				 * The chunk ran past the end of valid
+				 * memory, perhaps after the NULL; go
+				 * one at a time.
+				 */
+				result = copyin((userptr_t)(uaddr +
+					 (n+i)*sizeof(userptr_t)),
+					 &ptrs[n+i], sizeof(userptr_t));
+				if (result) {
+					return result;
+				}
+				result = EFAULT;
+			}
+			if (ptrs[n+i] == NULL) {
+				*argc = n+i;
+				return 0;
+			}
+		}
+	}
+	return E2BIG;
+}
+
+/*
+ * Copy in the argument vector UARGV into BUF (ARG_MAX bytes). On
+ * success the argv array is at the start of BUF with the strings
+ * after it, but the array holds each string's offset in BUF rather
+ * than a pointer. Returns the argument count in ARGC and the total
+ * size in LEN.
+ */
+static
+int
+exec_copyinargs(userptr_t uargv, char *buf, int *argc, size_t *len)
+{
+	userptr_t *argv = (userptr_t *)buf;
+	size_t off, got;
+	int i, result;
+
+	result = exec_copyinptrs(uargv, argv, ARG_MAX / sizeof(userptr_t),
+				 argc);
+	if (result) {
+		return result;
+	}
+
+	off = (*argc + 1) * sizeof(userptr_t);
+	for (i=0; i<*argc; i++) {
+		if (off >= ARG_MAX) {
+			return E2BIG;
+		}
+		result = copyinstr(argv[i], buf + off, ARG_MAX - off, &got);
+		if (result == ENAMETOOLONG) {
+			return E2BIG;
+		}
+		if (result) {
+			return result;
+		}
+		argv[i] = (userptr_t)off;
+		off += got;
+	}
+
+	*len = off;
+	return 0;
+}
+
+/*
+ * sys_execv
+ * replaces the current program with PROG, run with arguments ARGS.
+ * Doesn't return on success.
+ */
+int
+sys_execv(userptr_t prog, userptr_t args)
+{
+	char *path, *argbuf;
+	userptr_t *argv;
+	struct vnode *v;
+	struct addrspace *as;
+	vaddr_t entrypoint, stackptr, argvbase;
+	size_t len, padded;
+	int argc, i, result;
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	argbuf = kmalloc(ARG_MAX);
+	if (argbuf == NULL) {
+		kfree(path);
+		return ENOMEM;
+	}
+	argv = (userptr_t *)argbuf;
+
+	result = copyinstr(prog, path, PATH_MAX, NULL);
+	if (result) {
+		goto fail;
+	}
+	if (path[0] == 0) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	result = exec_copyinargs(args, argbuf, &argc, &len);
+	if (result) {
+		goto fail;
+	}
+
+	/* Open the file. This may destroy PATH. */
+	result = vfs_open(path, O_RDONLY, 0, &v);
+	if (result) {
+		goto fail;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/*
+	 * No going back from here. Get rid of the old address space
+	 * the same way thread_exit does, and switch to the new one.
+	 */
+	if (curthread->t_addrspace != NULL) {
+		struct addrspace *oldas = curthread->t_addrspace;
+		curthread->t_addrspace = NULL;
+		as_activate(NULL);
+		as_destroy(oldas);
+	}
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	result = load_elf(v, &entrypoint);
+	vfs_close(v);
+	if (result) {
+		goto fatal;
+	}
+
+	result = as_define_stack(as, &stackptr);
+	if (result) {
+		goto fatal;
+	}
+
+	/*
+	 * Put the arguments at the top of the stack, keeping the stack
+	 * pointer 8-byte aligned, and point argv at the strings.
+	 */
+	padded = ROUNDUP(len, 8);
+	bzero(argbuf + len, padded - len);
+	argvbase = stackptr - padded;
+	for (i=0; i<argc; i++) {
+		argv[i] = (userptr_t)(argvbase + (vaddr_t)argv[i]);
+	}
+	result = copyout(argbuf, (userptr_t)argvbase, padded);
+	if (result) {
+		goto fatal;
+	}
+
+	kfree(path);
+	kfree(argbuf);
+
+	/* Warp to user mode. */
+	enter_new_process(argc, (userptr_t)argvbase, argvbase, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+
+ fatal:
+	kprintf("execv: %s: %s\n", curthread->t_name, strerror(result));
+	kfree(path);
+	kfree(argbuf);
+	thread_exit(_MKWAIT_SIG(SIGKILL));
+	panic("Returning from exit\n");
+
+ fail:
+	kfree(path);
+	kfree(argbuf);
+	return result;
+}
+
 /*
  * sys_getpid
  * Placeholder to remind you to implement this.
@@ -64,5 +300,49 @@ sys_fork(struct trapframe *tf, pid_t *retval)
  * Placeholder comment to remind you to implement this.
  */
 
+/*
+ * Convert nanoseconds to a timeval.
+ */
+static
+void
+ns_to_timeval(uint64_t ns, struct timeval *tv)
+{
+	tv->tv_sec = ns / 1000000000;
+	tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
+/*
+ * sys_getrusage
+ *
+ * Copy out the cpu time, context switches and page faults of the
+ * current process (RUSAGE_SELF) or of its children that have exited
+ * (RUSAGE_CHILDREN). The other fields of struct rusage aren't kept
+ * and come back as zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct threadusage tu;
+	struct rusage ru;
 
+	switch (who) {
+	    case RUSAGE_SELF:
+		thread_getusage(&tu);
+		break;
+	    case RUSAGE_CHILDREN:
+		pid_childusage(&tu);
+		break;
+	    default:
+		return EINVAL;
+	}
 
+	bzero(&ru, sizeof(ru));
+	ns_to_timeval(tu.tu_utime, &ru.ru_utime);
+	ns_to_timeval(tu.tu_stime, &ru.ru_stime);
+	ru.ru_minflt = tu.tu_minflt;
+	ru.ru_majflt = tu.tu_majflt;
+	ru.ru_nvcsw = tu.tu_nvcsw;
+	ru.ru_nivcsw = tu.tu_nivcsw;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
@@ -720,6 +720,152 @@ doinlinetest(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Name cache test: check that opens see names that were just
+ * created, renamed, linked, and removed, and that looking up the
+ * same name again is answered from the name cache.
+ */
+
+static
+int
+nctest_open(const char *fs, const char *namesuffix, int flags,
+	    struct vnode **vn)
+{
+	char name[32];
+
+	MAKENAME();
+	return vfs_open(name, flags, 0664, vn);
+}
+
+/*
+ * Check that opening the file for reading gives WANT (0 or an error).
+ */
+static
+int
+nctest_check(const char *fs, const char *namesuffix, int want)
+{
+	struct vnode *vn;
+	int err;
+
+	err = nctest_open(fs, namesuffix, O_RDONLY, &vn);
+	if (err == 0) {
+		vfs_close(vn);
+	}
+	if (err != want) {
+		kprintf("Opening %s%s: got %s, expected %s\n", FILENAME,
+			namesuffix, err ? strerror(err) : "success",
+			want ? strerror(want) : "success");
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+nctest_twonames(int (*op)(char *, char *), const char *fs,
+		const char *suffix1, const char *suffix2)
+{
+	char name1[32], name2[32];
+	int err;
+
+	fstest_makename(name1, sizeof(name1), fs, suffix1);
+	fstest_makename(name2, sizeof(name2), fs, suffix2);
+
+	err = op(name1, name2);
+	if (err) {
+		kprintf("%s -> %s: %s\n", name1, name2, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+donamecachetest(const char *filesys)
+{
+	const char *fs = filesys;
+	struct vnode *vn1, *vn2;
+	unsigned hits, neghits, misses, hits0, neghits0, misses0;
+	char name[32];
+	int err;
+
+	kprintf("*** Starting name cache test on %s:\n", filesys);
+
+	/* Clean up after any earlier run */
+	fstest_makename(name, sizeof(name), fs, "");
+	vfs_remove(name);
+	fstest_makename(name, sizeof(name), fs, "-2");
+	vfs_remove(name);
+
+	vfs_namecache_stats(&hits0, &neghits0, &misses0);
+
+	/* Missing names: the second lookup should be a negative hit */
+	if (nctest_check(fs, "", ENOENT) || nctest_check(fs, "", ENOENT)) {
+		goto fail;
+	}
+	vfs_namecache_stats(&hits, &neghits, &misses);
+	if (neghits == neghits0) {
+		kprintf("Missing name was not cached\n");
+		goto fail;
+	}
+
+	/* Creating it must override the negative entry */
+	err = nctest_open(fs, "", O_WRONLY|O_CREAT|O_EXCL, &vn1);
+	if (err) {
+		kprintf("Could not create %s: %s\n", FILENAME, strerror(err));
+		goto fail;
+	}
+	vfs_close(vn1);
+
+	/* Repeated opens should get the same vnode from the cache */
+	hits0 = hits;
+	err = nctest_open(fs, "", O_RDONLY, &vn1);
+	if (err) {
+		kprintf("Could not open %s: %s\n", FILENAME, strerror(err));
+		goto fail;
+	}
+	err = nctest_open(fs, "", O_RDONLY, &vn2);
+	if (err) {
+		kprintf("Could not reopen %s: %s\n", FILENAME, strerror(err));
+		vfs_close(vn1);
+		goto fail;
+	}
+	vfs_namecache_stats(&hits, &neghits, &misses);
+	if (vn1 != vn2 || hits < hits0 + 2) {
+		kprintf("Repeated opens were not answered from the cache\n");
+		vfs_close(vn1);
+		vfs_close(vn2);
+		goto fail;
+	}
+	vfs_close(vn1);
+	vfs_close(vn2);
+
+	/* Rename, link, and remove must all be seen */
+	if (nctest_twonames(vfs_rename, fs, "", "-2") ||
+	    nctest_check(fs, "", ENOENT) || nctest_check(fs, "-2", 0)) {
+		goto fail;
+	}
+	if (nctest_twonames(vfs_link, fs, "-2", "") ||
+	    nctest_check(fs, "", 0)) {
+		goto fail;
+	}
+	if (fstest_remove(fs, "") || nctest_check(fs, "", ENOENT) ||
+	    fstest_remove(fs, "-2") || nctest_check(fs, "-2", ENOENT)) {
+		goto fail;
+	}
+
+	vfs_namecache_stats(&hits, &neghits, &misses);
+	kprintf("Name cache: %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+	kprintf("*** Name cache test done\n");
+	return;
+
+ fail:
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -760,6 +906,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(inlinetest);
+DEFTEST(namecachetest);
 
 ////////////////////////////////////////////////////////////
 
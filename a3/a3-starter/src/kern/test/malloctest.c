@@ -31,9 +31,12 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <vm.h>
+#include <kmem.h>
 #include <test.h>
 
 /*
@@ -138,3 +141,105 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test the object caches under kmalloc: from NTHREADS threads at
+ * once, allocate KCNOBJS objects from a cache, fill each with a
+ * pattern, check the patterns, and free them again, half with
+ * kmem_cache_free and half with kfree. Enough objects that the
+ * per-cpu magazines have to refill and flush through the cache.
+ */
+
+#define KCNOBJS   200
+#define KCOBJSIZE  44
+
+static struct kmem_cache *kctest_cache;
+
+static
+void
+kmemcachethread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned char *objs[KCNOBJS];
+	unsigned char pat;
+	int i, j, n;
+
+	for (n=0; n<KCNOBJS; n++) {
+		objs[n] = kmem_cache_alloc(kctest_cache);
+		if (objs[n] == NULL) {
+			kprintf("thread %lu: kmem_cache_alloc returned NULL\n",
+				num);
+			break;
+		}
+		/* objects are at least pointer-aligned, never whole pages */
+		KASSERT(((vaddr_t)objs[n] & (sizeof(void *) - 1)) == 0);
+		KASSERT(((vaddr_t)objs[n] & ~PAGE_FRAME) != 0);
+		for (j=0; j<KCOBJSIZE; j++) {
+			objs[n][j] = (unsigned char)(num*KCNOBJS + n);
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		pat = (unsigned char)(num*KCNOBJS + i);
+		for (j=0; j<KCOBJSIZE; j++) {
+			if (objs[i][j] != pat) {
+				panic("kmemcachetest: thread %lu: object %d "
+				      "byte %d is 0x%x, not 0x%x\n",
+				      num, i, j, objs[i][j], pat);
+			}
+		}
+		if (i % 2) {
+			kmem_cache_free(kctest_cache, objs[i]);
+		}
+		else {
+			kfree(objs[i]);
+		}
+	}
+
+	V(sem);
+}
+
+int
+kmemcachetest(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	/* caches are never destroyed; make it once and reuse it */
+	if (kctest_cache == NULL) {
+		kctest_cache = kmem_cache_create("kmemcachetest", KCOBJSIZE);
+		if (kctest_cache == NULL) {
+			kprintf("kmemcachetest: kmem_cache_create failed\n");
+			return ENOMEM;
+		}
+	}
+
+	sem = sem_create("kmemcachetest", 0);
+	if (sem == NULL) {
+		panic("kmemcachetest: sem_create failed\n");
+	}
+
+	kprintf("Starting kmem cache test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("kmemcachetest",
+				     kmemcachethread, sem, i,
+				     NULL);
+		if (result) {
+			panic("kmemcachetest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmem cache test done\n");
+
+	return 0;
+}
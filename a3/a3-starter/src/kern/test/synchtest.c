@@ -34,7 +34,9 @@
 #include <types.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 #include <kern/sysexits.h>
@@ -43,6 +45,7 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      60
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -51,6 +54,7 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
 static struct semaphore *donesem;
 
 static
@@ -75,6 +79,12 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
@@ -304,3 +314,324 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Every fourth thread is a writer, which
+ * updates the test values (yielding halfway through to give readers a
+ * chance to see a half-done update); the rest are readers, which check
+ * the values are consistent. The readers also count how many of them
+ * are inside at once, which should get above 1.
+ */
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static unsigned rwcount_readers;
+static unsigned rwcount_maxreaders;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	kprintf("Test failed\n");
+
+	V(donesem);
+	thread_exit(_MKWAIT_EXIT(EX_SOFTWARE));
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long v1, v2, v3;
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			testval1 = num + i;
+			thread_yield();
+			testval2 = testval1*testval1;
+			testval3 = testval1%3;
+			rwlock_release_write(testrwlock);
+			continue;
+		}
+
+		rwlock_acquire_read(testrwlock);
+
+		spinlock_acquire(&rwcount_lock);
+		rwcount_readers++;
+		if (rwcount_readers > rwcount_maxreaders) {
+			rwcount_maxreaders = rwcount_readers;
+		}
+		spinlock_release(&rwcount_lock);
+
+		v1 = testval1;
+		thread_yield();
+		v2 = testval2;
+		v3 = testval3;
+
+		spinlock_acquire(&rwcount_lock);
+		rwcount_readers--;
+		spinlock_release(&rwcount_lock);
+
+		if (rwlock_do_i_hold_write(testrwlock)) {
+			rwlock_release_read(testrwlock);
+			rwfail(num, "reader holds the write lock");
+		}
+		rwlock_release_read(testrwlock);
+
+		if (v2 != v1*v1 || v3 != v1%3) {
+			rwfail(num, "saw a half-finished write");
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	/* First the non-blocking operations, single-threaded. */
+	if (!rwlock_tryacquire_write(testrwlock)) {
+		panic("rwtest: tryacquire_write on a free lock failed\n");
+	}
+	if (rwlock_tryacquire_read(testrwlock)) {
+		panic("rwtest: tryacquire_read succeeded under a writer\n");
+	}
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+	rwlock_downgrade(testrwlock);
+	if (rwlock_do_i_hold_write(testrwlock)) {
+		panic("rwtest: still a writer after downgrade\n");
+	}
+	if (!rwlock_tryacquire_read(testrwlock)) {
+		panic("rwtest: tryacquire_read failed under a reader\n");
+	}
+	if (rwlock_tryacquire_write(testrwlock)) {
+		panic("rwtest: tryacquire_write succeeded under readers\n");
+	}
+	rwlock_release_read(testrwlock);
+	rwlock_release_read(testrwlock);
+
+	rwcount_readers = 0;
+	rwcount_maxreaders = 0;
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", rwtestthread, NULL, i,
+				     NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Most readers at once: %u\n", rwcount_maxreaders);
+	kprintf("RW lock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Priority inheritance test.
+ *
+ * A low-priority thread holds lock A; a middle thread holds lock B
+ * and is asleep waiting for A; the test thread, at the top level,
+ * then waits for B. Meanwhile a crowd of cpu hogs keeps every cpu
+ * busy. Through the chain, the low thread should run at the test
+ * thread's level until it lets go of A, and then drop back; the
+ * middle thread likewise until it lets go of B. The test thread's
+ * wait should then be bounded by the low and middle threads' own
+ * work, not by the hogs: check it's within PI_SLACKNSECS of twice
+ * the time the work takes on an otherwise idle machine.
+ */
+#define PI_WORK		200000
+#define PI_HOGSPERCPU	4
+#define PI_SLACKNSECS	100000000ULL	/* 100 ms */
+#define PI_TIMEOUTNSECS	2000000000ULL	/* 2 s */
+
+static struct lock *pilock_a;
+static struct lock *pilock_b;
+static struct semaphore *pisem;
+static volatile bool pi_done;
+static unsigned pi_lowlevel, pi_midlevel;
+static bool pi_lowrestored;
+
+/*
+ * Burn some cpu.
+ */
+static
+void
+pi_work(void)
+{
+	volatile unsigned i;
+
+	for (i=0; i<PI_WORK; i++) {
+		/* nothing */
+	}
+}
+
+static
+void
+pihog(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!pi_done) {
+		/* spin; the scheduler demotes us */
+	}
+	V(donesem);
+}
+
+static
+void
+pilow(void *junk, unsigned long num)
+{
+	uint64_t start;
+
+	(void)junk;
+	(void)num;
+
+	/* Use up quanta until we're at the bottom level. */
+	start = clock_nanotime();
+	while (curthread->t_priority < SCHED_NLEVELS - 1 &&
+	       clock_nanotime() - start < PI_TIMEOUTNSECS) {
+		/* spin */
+	}
+
+	lock_acquire(pilock_a);
+	V(pisem);
+
+	/* Hold A until the test thread is asleep on B. */
+	start = clock_nanotime();
+	while (pilock_b->lk_nwaiters == 0 &&
+	       clock_nanotime() - start < PI_TIMEOUTNSECS) {
+		/* spin */
+	}
+	pi_work();
+	pi_lowlevel = thread_getlevel(curthread);
+	lock_release(pilock_a);
+	pi_lowrestored = curthread->t_inherited == SCHED_NLEVELS;
+
+	V(donesem);
+}
+
+static
+void
+pimid(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(pilock_b);
+	V(pisem);
+
+	lock_acquire(pilock_a);
+	pi_work();
+	pi_midlevel = thread_getlevel(curthread);
+	lock_release(pilock_a);
+	lock_release(pilock_b);
+
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	uint64_t start, worknsecs, waitnsecs;
+	unsigned i, nhogs, level;
+	int result;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (pilock_a == NULL) {
+		pilock_a = lock_create("pilock_a");
+		pilock_b = lock_create("pilock_b");
+		pisem = sem_create("pisem", 0);
+		if (pilock_a == NULL || pilock_b == NULL || pisem == NULL) {
+			panic("pitest: out of memory\n");
+		}
+	}
+	kprintf("Starting priority inheritance test...\n");
+
+	start = clock_nanotime();
+	pi_work();
+	worknsecs = clock_nanotime() - start;
+
+	pi_done = false;
+	nhogs = PI_HOGSPERCPU * cpu_count();
+	for (i=0; i<nhogs; i++) {
+		result = thread_fork("pihog", pihog, NULL, i, NULL);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("pilow", pilow, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+	result = thread_fork("pimid", pimid, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+
+	/* Wait for the middle thread to be asleep on A. */
+	while (pilock_a->lk_nwaiters == 0) {
+		thread_yield();
+	}
+
+	/* Short sleeps raise us a level each; get to the top. */
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		clock_nanosleep(1000000);
+	}
+	level = thread_getlevel(curthread);
+
+	start = clock_nanotime();
+	lock_acquire(pilock_b);
+	waitnsecs = clock_nanotime() - start;
+	lock_release(pilock_b);
+
+	pi_done = true;
+	for (i=0; i<nhogs + 2; i++) {
+		P(donesem);
+	}
+
+	kprintf("Waiter level %u; low thread ran at %u, middle at %u\n",
+		level, pi_lowlevel, pi_midlevel);
+	kprintf("Waited %llu ms for the chain (work alone takes %llu ms)\n",
+		(unsigned long long)(waitnsecs / 1000000),
+		(unsigned long long)(worknsecs / 1000000));
+
+	ok = true;
+	if (pi_lowlevel > level || pi_midlevel > level) {
+		kprintf("Priority was not inherited down the chain\n");
+		ok = false;
+	}
+	if (!pi_lowrestored) {
+		kprintf("Low thread kept its inherited priority\n");
+		ok = false;
+	}
+	if (waitnsecs > 2*worknsecs + PI_SLACKNSECS) {
+		kprintf("Priority inversion was not bounded\n");
+		ok = false;
+	}
+	kprintf(ok ? "Priority inheritance test done.\n" : "Test failed\n");
+
+	return 0;
+}
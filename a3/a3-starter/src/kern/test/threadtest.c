@@ -34,6 +34,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 #define NTHREADS  8
@@ -145,3 +146,118 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Timer test: each thread sleeps for a different number of
+ * nanoseconds, none of them a whole number of hardclocks, and checks
+ * it didn't wake up early. The lateness is printed; it should be
+ * well under a hardclock.
+ */
+#define SLEEPNSECS  1500000	/* 1.5 ms per thread number */
+
+static
+void
+sleepthread(void *junk, unsigned long num)
+{
+	uint64_t want, start, late;
+
+	(void)junk;
+
+	want = (num + 1) * SLEEPNSECS;
+	start = clock_nanotime();
+	clock_nanosleep(want);
+	late = clock_nanotime() - start;
+	if (late < want) {
+		panic("sleeptest: thread %lu woke %lu ns early\n",
+		      num, (unsigned long)(want - late));
+	}
+	late -= want;
+	kprintf("thread %lu: slept %lu us, %lu us late\n", num,
+		(unsigned long)(want / 1000), (unsigned long)(late / 1000));
+	V(tsem);
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting thread test 4 (sleep)...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("sleeptest", sleepthread, NULL, i, NULL);
+		if (result) {
+			panic("sleeptest: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(tsem);
+	}
+
+	kprintf("Thread test 4 done.\n");
+	return 0;
+}
+
+/*
+ * Fork latency: fork a thread that exits at once and wait for it,
+ * FORKROUNDS times, first with the thread cache turned off and then
+ * with it on, and print the average round trip for each.
+ */
+#define FORKROUNDS  500
+
+static
+void
+exitthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+static
+uint64_t
+forkrounds(void)
+{
+	uint64_t start;
+	int i, result;
+
+	start = clock_nanotime();
+	for (i=0; i<FORKROUNDS; i++) {
+		result = thread_fork("forkbench", exitthread, NULL, i, NULL);
+		if (result) {
+			panic("forkbench: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+	}
+	return (clock_nanotime() - start) / FORKROUNDS;
+}
+
+int
+threadtest5(int nargs, char **args)
+{
+	uint64_t uncached, cached;
+	unsigned oldmax;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting thread test 5 (fork latency)...\n");
+
+	oldmax = thread_setcachemax(0);
+	uncached = forkrounds();
+	thread_setcachemax(oldmax);
+	cached = forkrounds();
+
+	kprintf("fork/exit round trip: %lu ns uncached, %lu ns cached\n",
+		(unsigned long)uncached, (unsigned long)cached);
+	kprintf("Thread test 5 done.\n");
+	return 0;
+}
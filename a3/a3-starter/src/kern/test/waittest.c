@@ -31,7 +31,9 @@
  * Wait test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <kern/wait.h>
+#include <limits.h>
 #include <lib.h>
 #include <stdarg.h>
 #include <spl.h>
@@ -240,3 +242,108 @@ waittest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test the pid allocator: first fill the process table until
+ * pid_alloc fails and give everything back, then from NTHREADS
+ * threads at once allocate and free PIDBATCH pids at a time,
+ * checking that no two live pids share a process table slot.
+ */
+
+#define PIDBATCH   8
+#define PIDROUNDS  200
+
+static struct spinlock pidtest_lock = SPINLOCK_INITIALIZER;
+static pid_t pidtest_owner[PROCS_MAX];
+
+static
+void
+pidtest_claim(pid_t pid, bool claim)
+{
+	pid_t *slot = &pidtest_owner[pid % PROCS_MAX];
+
+	spinlock_acquire(&pidtest_lock);
+	if (claim ? *slot != INVALID_PID : *slot != pid) {
+		panic("pidtest: slot for pid %d holds pid %d\n", pid, *slot);
+	}
+	*slot = claim ? pid : INVALID_PID;
+	spinlock_release(&pidtest_lock);
+}
+
+static
+void
+pidtestthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	pid_t pids[PIDBATCH];
+	int i, j, n, err;
+
+	for (i=0; i<PIDROUNDS; i++) {
+		for (n=0; n<PIDBATCH; n++) {
+			err = pid_alloc(&pids[n]);
+			if (err == EAGAIN) {
+				/* other threads have the rest */
+				break;
+			}
+			if (err) {
+				panic("pidtest: thread %lu: pid_alloc: %s\n",
+				      num, strerror(err));
+			}
+			KASSERT(pids[n] >= PID_MIN && pids[n] <= PID_MAX);
+			pidtest_claim(pids[n], true);
+		}
+		for (j=0; j<n; j++) {
+			pidtest_claim(pids[j], false);
+			pid_unalloc(pids[j]);
+		}
+	}
+
+	V(sem);
+}
+
+int
+pidalloctest(int nargs, char **args)
+{
+	static pid_t pids[PROCS_MAX];
+	struct semaphore *sem;
+	int i, n, err;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting pid allocation test...\n");
+
+	for (n=0; n<PROCS_MAX; n++) {
+		err = pid_alloc(&pids[n]);
+		if (err) {
+			KASSERT(err == EAGAIN);
+			break;
+		}
+		pidtest_claim(pids[n], true);
+	}
+	kprintf("Process table filled after %d pids\n", n);
+	for (i=0; i<n; i++) {
+		pidtest_claim(pids[i], false);
+		pid_unalloc(pids[i]);
+	}
+
+	sem = sem_create("pidalloctest", 0);
+	if (sem == NULL) {
+		panic("pidalloctest: sem_create failed\n");
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		err = thread_fork("pidalloctest", pidtestthread, sem, i, NULL);
+		if (err) {
+			panic("pidalloctest: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	sem_destroy(sem);
+
+	kprintf("Pid allocation test done.\n");
+	return 0;
+}
@@ -34,16 +34,21 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Each cpu has a list of one-shot timers, sorted by deadline, and
+ * sets its on-chip timer for whichever comes first of the earliest
+ * timer and the next hardclock. The list is sorted rather than a
+ * heap or wheel because there are only ever a handful of timers (one
+ * per sleeping thread, at most), so a linear insert is cheaper than
+ * the bookkeeping.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
- * skimp on that because we have a known-good hardware clock.
+ * skimp on that because we have a known-good hardware clock, which
+ * is also what clock_nanotime() reads.
  */
 
 /*
@@ -53,6 +58,9 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+#define TICK_NSECS	(1000000000 / HZ)	/* Time between hardclocks. */
+#define IDLE_MAXNSECS	1000000000	/* Longest idle without a wakeup. */
+
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
@@ -99,18 +107,281 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_tick();
 }
 
 /*
- * Suspend execution for n seconds.
+ * Current time in nanoseconds.
+ */
+uint64_t
+clock_nanotime(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Timers.
  */
 void
-clocksleep(int num_secs)
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_deadline = 0;
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_cpu = NULL;
+	tm->tm_next = NULL;
+}
+
+void
+timer_arm(struct timer *tm, uint64_t when)
+{
+	struct cpu *c;
+	struct timer **pp;
+	uint64_t now;
+
+	spinlock_acquire(&curcpu->c_timer_lock);
+	c = curcpu->c_self;
+
+	KASSERT(tm->tm_cpu == NULL);
+	tm->tm_deadline = when;
+	tm->tm_cpu = c;
+
+	for (pp = &c->c_timers; *pp != NULL; pp = &(*pp)->tm_next) {
+		if ((*pp)->tm_deadline > when) {
+			break;
+		}
+	}
+	tm->tm_next = *pp;
+	*pp = tm;
+
+	/* If it's due before the next interrupt, move the interrupt up. */
+	if (when < c->c_timerprog) {
+		now = clock_nanotime();
+		c->c_timerprog = when;
+		mainbus_settimer(when > now ? when - now : 0);
+	}
+	spinlock_release(&c->c_timer_lock);
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	struct cpu *c;
+	struct timer **pp;
+
+	c = tm->tm_cpu;
+	if (c == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&c->c_timer_lock);
+	if (tm->tm_cpu != c) {
+		/* Went off while we were getting the lock. */
+		spinlock_release(&c->c_timer_lock);
+		return false;
+	}
+	for (pp = &c->c_timers; *pp != tm; pp = &(*pp)->tm_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = tm->tm_next;
+	tm->tm_next = NULL;
+	tm->tm_cpu = NULL;
+	spinlock_release(&c->c_timer_lock);
+
+	/*
+	 * We don't bother moving the interrupt back; if it was set for
+	 * this timer it'll just find nothing to do.
+	 */
+	return true;
+}
+
+/*
+ * Pick and set the next timer interrupt. While idle, don't tick.
+ * Call with the timer lock held.
+ */
+static
+void
+timer_reprogram(struct cpu *c, uint64_t now)
+{
+	uint64_t next;
+
+	KASSERT(spinlock_do_i_hold(&c->c_timer_lock));
+
+	next = c->c_isidle ? now + IDLE_MAXNSECS : c->c_nexttick;
+	if (c->c_timers != NULL && c->c_timers->tm_deadline < next) {
+		next = c->c_timers->tm_deadline;
+	}
+	c->c_timerprog = next;
+	mainbus_settimer(next > now ? next - now : 0);
+}
+
+/*
+ * On-chip timer interrupt.
+ *
+ * Note that c_isidle is only ever true here if we interrupted the
+ * idle loop in thread_switch, because it runs with interrupts off
+ * everywhere else.
+ */
+void
+timer_interrupt(void)
+{
+	struct cpu *c;
+	struct timer *tm;
+	void (*func)(void *);
+	void *data;
+	uint64_t now;
+	unsigned ticks;
+
+	c = curcpu->c_self;
+
+	if (!gettime_ready()) {
+		/* Early in boot, before the clock is attached; just tick. */
+		mainbus_settimer(TICK_NSECS);
+		hardclock();
+		return;
+	}
+
+	now = clock_nanotime();
+
+	ticks = 0;
+	if (c->c_nexttick == 0) {
+		/* First interrupt since the clock came up. */
+		ticks = 1;
+		c->c_nexttick = now + TICK_NSECS;
+	}
+	else if (now >= c->c_nexttick) {
+		ticks = (now - c->c_nexttick) / TICK_NSECS + 1;
+		c->c_nexttick += (uint64_t)ticks * TICK_NSECS;
+	}
+
+	spinlock_acquire(&c->c_timer_lock);
+	timer_reprogram(c, now);
+
+	/*
+	 * Run expired timers one at a time, dropping the lock for each
+	 * callback (it might well arm another timer). Once tm_cpu is
+	 * NULL the timer may be freed at any time, so don't look at it
+	 * after that.
+	 */
+	while ((tm = c->c_timers) != NULL && tm->tm_deadline <= now) {
+		c->c_timers = tm->tm_next;
+		func = tm->tm_func;
+		data = tm->tm_data;
+		tm->tm_next = NULL;
+		tm->tm_cpu = NULL;
+		spinlock_release(&c->c_timer_lock);
+
+		func(data);
+
+		spinlock_acquire(&c->c_timer_lock);
+	}
+	spinlock_release(&c->c_timer_lock);
+
+	if (ticks > 0) {
+		/* Account for the ticks we skipped while idle. */
+		c->c_hardclocks += ticks - 1;
+		c->c_idleticks += ticks - 1;
+		hardclock();
+	}
+}
+
+/*
+ * Called when the current cpu leaves the idle loop: start ticking
+ * again. If a tick is overdue this makes the interrupt come right
+ * away, and timer_interrupt catches up c_hardclocks.
+ */
+void
+hardclock_resume(void)
 {
-	while (num_secs > 0) {
+	struct cpu *c;
+	uint64_t now;
+
+	c = curcpu->c_self;
+	if (!gettime_ready() || c->c_nexttick == 0) {
+		/* Still in early-boot tick mode. */
+		return;
+	}
+
+	spinlock_acquire(&c->c_timer_lock);
+	KASSERT(!c->c_isidle);
+	if (c->c_timerprog > c->c_nexttick) {
+		now = clock_nanotime();
+		timer_reprogram(c, now);
+	}
+	spinlock_release(&c->c_timer_lock);
+}
+
+/*
+ * Sleeping for a time.
+ *
+ * The timer callback wakes the thread off a private wait channel.
+ * The channel is locked before arming the timer, so the callback's
+ * wakeup can't get in between arming it and going to sleep; and
+ * wchan_wakeall is done with the channel before it makes the thread
+ * runnable, so once we're awake we can destroy it.
+ */
+static
+void
+clock_wakeup(void *vwc)
+{
+	struct wchan *wc = vwc;
+
+	wchan_wakeall(wc);
+}
+
+/*
+ * Fallback if we can't get a wait channel: wake up on lbolt, which
+ * may be up to a second late.
+ */
+static
+void
+clock_sleep_lbolt(uint64_t nsecs)
+{
+	uint64_t num_secs;
+
+	for (num_secs = DIVROUNDUP(nsecs, 1000000000); num_secs > 0;
+	     num_secs--) {
 		wchan_lock(lbolt);
 		wchan_sleep(lbolt);
-		num_secs--;
+	}
+}
+
+void
+clock_nanosleep(uint64_t nsecs)
+{
+	struct wchan *wc;
+	struct timer tm;
+
+	if (nsecs == 0) {
+		return;
+	}
+
+	wc = wchan_create("nanosleep");
+	if (wc == NULL) {
+		clock_sleep_lbolt(nsecs);
+		return;
+	}
+
+	timer_init(&tm, clock_wakeup, wc);
+	wchan_lock(wc);
+	timer_arm(&tm, clock_nanotime() + nsecs);
+	wchan_sleep(wc);
+
+	KASSERT(tm.tm_cpu == NULL);
+	wchan_destroy(wc);
+}
+
+/*
+ * Suspend execution for n seconds.
+ */
+void
+clocksleep(int num_secs)
+{
+	if (num_secs > 0) {
+		clock_nanosleep((uint64_t)num_secs * 1000000000);
 	}
 }
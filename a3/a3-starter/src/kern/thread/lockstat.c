@@ -0,0 +1,366 @@
+/*
+ * Lock statistics. See <lockstat.h>.
+ *
+ * Each cpu records into its own open-addressed table, with interrupts
+ * off, so nothing here takes a lock (which would be recorded in turn).
+ * Resetting bumps lockstat_gen; a cpu clears its table the next time
+ * it records anything, and tables from an older generation are
+ * ignored when printing.
+ *
+ * Printing reads the other cpus' tables while they may be updating
+ * them, so the numbers can be a little off. That's fine for finding
+ * which locks are hot.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <lockstat.h>
+
+static volatile unsigned lockstat_gen;
+
+/*
+ * Allocate a cpu's table. If there's no memory, the cpu just doesn't
+ * record anything.
+ */
+void
+lockstat_cpu_init(struct cpu *c)
+{
+	c->c_lockstat = kmalloc(sizeof(*c->c_lockstat));
+	if (c->c_lockstat == NULL) {
+		kprintf("lockstat: no memory for a cpu table\n");
+		return;
+	}
+	bzero(c->c_lockstat, sizeof(*c->c_lockstat));
+	c->c_lockstat->lt_gen = lockstat_gen;
+}
+
+uint32_t
+lockstat_cycles(uint32_t start, uint32_t end)
+{
+	return end >= start ? end - start : 0;
+}
+
+/*
+ * Get the current cpu's table, clearing it first if there's been a
+ * reset since it was last used. Interrupts must be off.
+ */
+static
+struct lockstat_table *
+lockstat_mytable(void)
+{
+	struct lockstat_table *lt;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	lt = curcpu->c_lockstat;
+	if (lt == NULL) {
+		return NULL;
+	}
+	if (lt->lt_gen != lockstat_gen) {
+		bzero(lt, sizeof(*lt));
+		lt->lt_gen = lockstat_gen;
+	}
+	return lt;
+}
+
+/*
+ * Compare NAME to a (possibly truncated) stored name.
+ */
+static
+bool
+lockstat_namematch(const char *stored, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (stored[i] != name[i]) {
+			return false;
+		}
+		if (stored[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+static
+bool
+lockstat_match(const struct lockstat *ls, bool sleep,
+	       const char *name, vaddr_t site)
+{
+	if (ls->ls_sleep != sleep) {
+		return false;
+	}
+	if (name == NULL) {
+		return ls->ls_name[0] == 0 && ls->ls_site == site;
+	}
+	return lockstat_namematch(ls->ls_name, name);
+}
+
+static
+unsigned
+lockstat_hash(bool sleep, const char *name, vaddr_t site)
+{
+	unsigned h, i;
+
+	if (name == NULL) {
+		h = site >> 2;
+	}
+	else {
+		h = 0;
+		for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+			h = h*31 + (unsigned char)name[i];
+		}
+	}
+	return sleep ? h*7 + 1 : h;
+}
+
+/*
+ * Find the slot for a lock, claiming a free one if it isn't there
+ * yet. Unnamed locks are kept by SITE. Returns NULL if the table is
+ * too full around where the lock hashes to.
+ */
+static
+struct lockstat *
+lockstat_lookup(struct lockstat_table *lt, bool sleep,
+		const char *name, vaddr_t site)
+{
+	struct lockstat *ls;
+	unsigned h, i;
+
+	if (name != NULL && name[0] == 0) {
+		name = NULL;
+	}
+
+	h = lockstat_hash(sleep, name, site);
+	for (i=0; i<LOCKSTAT_PROBES; i++) {
+		ls = &lt->lt_slots[(h + i) % LOCKSTAT_NSLOTS];
+		if (ls->ls_acquires == 0) {
+			ls->ls_sleep = sleep;
+			if (name == NULL) {
+				ls->ls_name[0] = 0;
+				ls->ls_site = site;
+			}
+			else {
+				snprintf(ls->ls_name, sizeof(ls->ls_name),
+					 "%s", name);
+				ls->ls_site = 0;
+			}
+			return ls;
+		}
+		if (lockstat_match(ls, sleep, name, site)) {
+			return ls;
+		}
+	}
+	lt->lt_dropped++;
+	return NULL;
+}
+
+/*
+ * Record the release of a spinlock, which is still held. Called from
+ * spinlock_release.
+ */
+void
+lockstat_spinlock(struct spinlock *splk, uint32_t now)
+{
+	struct lockstat_table *lt;
+	struct lockstat *ls;
+	uint32_t hold;
+
+	lt = lockstat_mytable();
+	if (lt == NULL) {
+		return;
+	}
+	ls = lockstat_lookup(lt, false, splk->splk_name, splk->splk_site);
+	if (ls == NULL) {
+		return;
+	}
+
+	hold = lockstat_cycles(splk->splk_acquired, now);
+	ls->ls_acquires++;
+	if (splk->splk_spun != 0) {
+		ls->ls_contended++;
+		ls->ls_wait += splk->splk_spun - 1;
+	}
+	ls->ls_hold += hold;
+	if (hold > ls->ls_maxhold) {
+		ls->ls_maxhold = hold;
+		ls->ls_maxsite = splk->splk_site;
+	}
+}
+
+/*
+ * Record the release of a sleep lock by curthread. Called from
+ * lock_release with the lock's spinlock held.
+ */
+void
+lockstat_sleeplock(const char *name, bool contended,
+		   uint64_t waitnsecs, uint64_t holdnsecs)
+{
+	struct lockstat_table *lt;
+	struct lockstat *ls;
+
+	lt = lockstat_mytable();
+	if (lt == NULL) {
+		return;
+	}
+	ls = lockstat_lookup(lt, true, name, 0);
+	if (ls == NULL) {
+		return;
+	}
+
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_wait += waitnsecs;
+	}
+	ls->ls_hold += holdnsecs;
+	if (holdnsecs > ls->ls_maxhold) {
+		ls->ls_maxhold = holdnsecs;
+		snprintf(ls->ls_maxholder, sizeof(ls->ls_maxholder), "%s",
+			 curthread->t_name);
+	}
+}
+
+/*
+ * Add one cpu's entry into the merged array of N entries. Returns the
+ * new N.
+ */
+static
+unsigned
+lockstat_merge(struct lockstat *all, unsigned n, const struct lockstat *ls)
+{
+	struct lockstat *m;
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		m = &all[i];
+		if (lockstat_match(m, ls->ls_sleep,
+				   ls->ls_name[0] ? ls->ls_name : NULL,
+				   ls->ls_site)) {
+			m->ls_acquires += ls->ls_acquires;
+			m->ls_contended += ls->ls_contended;
+			m->ls_wait += ls->ls_wait;
+			m->ls_hold += ls->ls_hold;
+			if (ls->ls_maxhold > m->ls_maxhold) {
+				m->ls_maxhold = ls->ls_maxhold;
+				m->ls_maxsite = ls->ls_maxsite;
+				strcpy(m->ls_maxholder, ls->ls_maxholder);
+			}
+			return n;
+		}
+	}
+	all[n] = *ls;
+	/* it may have been mid-update when copied */
+	all[n].ls_name[LOCKSTAT_NAMELEN-1] = 0;
+	all[n].ls_maxholder[LOCKSTAT_NAMELEN-1] = 0;
+	return n+1;
+}
+
+/*
+ * Sort by wait time, most first. Insertion sort; there aren't many.
+ */
+static
+void
+lockstat_sort(struct lockstat *all, unsigned n)
+{
+	struct lockstat tmp;
+	unsigned i, j;
+
+	for (i=1; i<n; i++) {
+		tmp = all[i];
+		for (j=i; j>0; j--) {
+			if (all[j-1].ls_wait >= tmp.ls_wait) {
+				break;
+			}
+			all[j] = all[j-1];
+		}
+		all[j] = tmp;
+	}
+}
+
+/*
+ * Print the NUM locks with the most wait time, across all cpus.
+ */
+void
+lockstat_print(unsigned num)
+{
+	struct lockstat *all, *ls;
+	struct lockstat_table *lt;
+	struct cpu *c;
+	unsigned ncpus, gen, dropped, n, i, j;
+
+	ncpus = cpu_count();
+	all = kmalloc(ncpus * LOCKSTAT_NSLOTS * sizeof(*all));
+	if (all == NULL) {
+		kprintf("lockstat: out of memory\n");
+		return;
+	}
+
+	gen = lockstat_gen;
+	dropped = 0;
+	n = 0;
+	for (i=0; i<ncpus; i++) {
+		c = cpu_bynumber(i);
+		lt = c->c_lockstat;
+		if (lt == NULL || lt->lt_gen != gen) {
+			continue;
+		}
+		dropped += lt->lt_dropped;
+		for (j=0; j<LOCKSTAT_NSLOTS; j++) {
+			if (lt->lt_slots[j].ls_acquires > 0) {
+				n = lockstat_merge(all, n, &lt->lt_slots[j]);
+			}
+		}
+	}
+	lockstat_sort(all, n);
+
+	kprintf("Lock statistics (spinlock times in cycles, "
+		"sleep lock times in ns):\n");
+	kprintf("  kind  lock                 acquires contended"
+		"         wait         hold      maxhold  maxholder\n");
+	for (i=0; i<n && i<num; i++) {
+		ls = &all[i];
+		kprintf("  %-5s", ls->ls_sleep ? "sleep" : "spin");
+		if (ls->ls_name[0] != 0) {
+			kprintf(" %-20s", ls->ls_name);
+		}
+		else {
+			kprintf(" 0x%08lx          ",
+				(unsigned long)ls->ls_site);
+		}
+		kprintf(" %8u %9u %12llu %12llu %12llu",
+			ls->ls_acquires, ls->ls_contended,
+			(unsigned long long)ls->ls_wait,
+			(unsigned long long)ls->ls_hold,
+			(unsigned long long)ls->ls_maxhold);
+		if (ls->ls_sleep) {
+			kprintf("  %s\n", ls->ls_maxholder);
+		}
+		else {
+			kprintf("  0x%08lx\n", (unsigned long)ls->ls_maxsite);
+		}
+	}
+	if (n > num) {
+		kprintf("  (%u more)\n", n - num);
+	}
+	if (dropped > 0) {
+		kprintf("  %u releases not recorded (table full)\n", dropped);
+	}
+
+	kfree(all);
+}
+
+/*
+ * Start over.
+ */
+void
+lockstat_reset(void)
+{
+	lockstat_gen++;
+}
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <clock.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -46,75 +47,121 @@
 /*
  * Structure for holding PID and return data for a thread.
  *
+ * There is one of these per process table slot, and it is reused by
+ * each process that gets the slot. If pi_pid is INVALID_PID the slot
+ * is free.
+ *
  * If pi_ppid is INVALID_PID, the parent has gone away and will not be
  * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
  * structure can be freed.
+ *
+ * pi_lock protects everything but pi_nextfree, which belongs to the
+ * free list.
  */
 struct pidinfo {
+	struct lock *pi_lock;		// lock for this slot
 	pid_t pi_pid;			// process id of this thread
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
 	struct cv *pi_cv;		// use to wait for thread exit
+	struct thread *pi_thread;	// the thread, until it exits
+	struct threadusage pi_usage;	// final usage (only valid if exited)
+	struct threadusage pi_childusage; // total of exited children's
+	pid_t pi_nextpid;		// pid to hand out next from this slot
+	int pi_nextfree;		// next free slot, or -1
 };
 
 
 /*
  * Global pid and exit data.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * The process table is indexed by (pid % PROCS_MAX). Rather than
+ * searching for a pid whose slot is empty, pid_alloc takes a free
+ * slot off a list and gives out the slot's next pid, which is the
+ * pid it had last time plus PROCS_MAX; so pids aren't reused until a
+ * slot has been through all of its pids. Each slot has its own lock,
+ * and the free list has a spinlock, so processes coming and going
+ * only contend when they touch the same slot.
+ *
+ * The free list is LIFO, so a recently freed slot (whose pidinfo is
+ * likely still in the cache) is used first.
  */
-static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
-static pid_t nextpid;			// next candidate pid
-static int nprocs;			// number of allocated pids
+static struct pidinfo pidinfo[PROCS_MAX]; // actual pid info
+static struct spinlock pidfree_lock =	// lock for the free list
+	SPINLOCK_INITIALIZER_NAMED("pidfree");
+static int pidfree_head;		// first free slot, or -1
 
 
 
 /*
- * Create a pidinfo structure for the specified pid.
+ * Set up a process table slot.
  */
 static
-struct pidinfo *
-pidinfo_create(pid_t pid, pid_t ppid)
+void
+pidinfo_init(struct pidinfo *pi, int slot)
 {
-	struct pidinfo *pi;
-
-	KASSERT(pid != INVALID_PID);
-
-	pi = kmalloc(sizeof(struct pidinfo));
-	if (pi==NULL) {
-		return NULL;
-	}
-
+	pi->pi_lock = lock_create_adaptive("pidinfo");
 	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
+	if (pi->pi_lock == NULL || pi->pi_cv == NULL) {
+		panic("Out of memory creating the process table\n");
 	}
+	pi->pi_pid = INVALID_PID;
+	pi->pi_nextpid = slot >= PID_MIN ? slot : slot + PROCS_MAX;
+	pi->pi_nextfree = -1;
+}
+
+/*
+ * Fill in a free slot's pidinfo for the specified pid. The slot must
+ * be locked.
+ */
+static
+void
+pidinfo_setup(struct pidinfo *pi, pid_t pid, pid_t ppid)
+{
+	KASSERT(pid != INVALID_PID);
+	KASSERT(lock_do_i_hold(pi->pi_lock));
+	KASSERT(pi->pi_pid == INVALID_PID);
 
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbaad;  /* Recognizably invalid value */
-
-	return pi;
+	pi->pi_thread = NULL;
+	bzero(&pi->pi_usage, sizeof(pi->pi_usage));
+	bzero(&pi->pi_childusage, sizeof(pi->pi_childusage));
 }
 
+////////////////////////////////////////////////////////////
+
 /*
- * Clean up a pidinfo structure.
+ * Free list. Slots are linked by index through pi_nextfree.
  */
+
 static
 void
-pidinfo_destroy(struct pidinfo *pi)
+pidfree_push(int slot)
 {
-	KASSERT(pi->pi_exited == true);
-	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	spinlock_acquire(&pidfree_lock);
+	pidinfo[slot].pi_nextfree = pidfree_head;
+	pidfree_head = slot;
+	spinlock_release(&pidfree_lock);
+}
+
+static
+int
+pidfree_pop(void)
+{
+	int slot;
+
+	spinlock_acquire(&pidfree_lock);
+	slot = pidfree_head;
+	if (slot >= 0) {
+		pidfree_head = pidinfo[slot].pi_nextfree;
+		pidinfo[slot].pi_nextfree = -1;
+	}
+	spinlock_release(&pidfree_lock);
+	return slot;
 }
 
 ////////////////////////////////////////////////////////////
@@ -125,29 +172,37 @@ pidinfo_destroy(struct pidinfo *pi)
 void
 pid_bootstrap(void)
 {
+	struct pidinfo *pi;
 	int i;
 
-	pidlock = lock_create("pidlock");
-	if (pidlock == NULL) {
-		panic("Out of memory creating pid lock\n");
-	}
-
-	/* not really necessary - should start zeroed */
 	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
+		pidinfo_init(&pidinfo[i], i);
 	}
 
-	pidinfo[BOOTUP_PID] = pidinfo_create(BOOTUP_PID, INVALID_PID);
-	if (pidinfo[BOOTUP_PID]==NULL) {
-		panic("Out of memory creating bootup pid data\n");
+	/*
+	 * Push in reverse, so the first pids handed out are PID_MIN,
+	 * PID_MIN+1, and so on, and slot 0 (whose first pid is
+	 * PROCS_MAX) comes last.
+	 */
+	pidfree_head = -1;
+	pidfree_push(0);
+	for (i=PROCS_MAX-1; i>=PID_MIN; i--) {
+		if (i != BOOTUP_PID) {
+			pidfree_push(i);
+		}
 	}
 
-	nextpid = PID_MIN;
-	nprocs = 1;
+	pi = &pidinfo[BOOTUP_PID];
+	lock_acquire(pi->pi_lock);
+	pidinfo_setup(pi, BOOTUP_PID, INVALID_PID);
+	pi->pi_nextpid = BOOTUP_PID + PROCS_MAX;
+	pi->pi_thread = curthread;
+	lock_release(pi->pi_lock);
 }
 
 /*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table and lock it. Returns
+ * NULL (with nothing locked) if there's no such process.
  */
 static
 struct pidinfo *
@@ -157,74 +212,47 @@ pi_get(pid_t pid)
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
-		return NULL;
-	}
+	pi = &pidinfo[pid % PROCS_MAX];
+	lock_acquire(pi->pi_lock);
 	if (pi->pi_pid != pid) {
+		lock_release(pi->pi_lock);
 		return NULL;
 	}
 	return pi;
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_put: unlock a pidinfo from pi_get.
  */
 static
 void
-pi_put(pid_t pid, struct pidinfo *pi)
+pi_put(struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
-
-	KASSERT(pid != INVALID_PID);
-
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
-	nprocs++;
+	lock_release(pi->pi_lock);
 }
 
 /*
- * pi_drop: remove a pidinfo structure from the process table and free
- * it. It should reflect a process that has already exited and been
- * waited for.
+ * pi_drop: empty a locked process table slot and put it back on the
+ * free list. It should reflect a process that has already exited and
+ * been waited for. Unlocks the slot.
  */
 static
 void
-pi_drop(pid_t pid)
+pi_drop(struct pidinfo *pi)
 {
-	struct pidinfo *pi;
-
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(lock_do_i_hold(pi->pi_lock));
+	KASSERT(pi->pi_exited == true);
+	KASSERT(pi->pi_ppid == INVALID_PID);
 
-	pi = pidinfo[pid % PROCS_MAX];
-	KASSERT(pi != NULL);
-	KASSERT(pi->pi_pid == pid);
+	pi->pi_pid = INVALID_PID;
+	lock_release(pi->pi_lock);
 
-	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
-	nprocs--;
+	pidfree_push(pi - pidinfo);
 }
 
 ////////////////////////////////////////////////////////////
 
-/*
- * Helper function for pid_alloc.
- */
-static
-void
-inc_nextpid(void)
-{
-	KASSERT(lock_do_i_hold(pidlock));
-
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
-	}
-}
-
 /*
  * pid_alloc: allocate a process id.
  */
@@ -233,46 +261,28 @@ pid_alloc(pid_t *retval)
 {
 	struct pidinfo *pi;
 	pid_t pid;
-	int count;
+	int slot;
 
 	KASSERT(curthread->t_pid != INVALID_PID);
 
-	/* lock the table */
-	lock_acquire(pidlock);
-
-	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
+	slot = pidfree_pop();
+	if (slot < 0) {
 		return EAGAIN;
 	}
+	pi = &pidinfo[slot];
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
-
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
-
-		inc_nextpid();
-	}
-
-	pid = nextpid;
+	lock_acquire(pi->pi_lock);
 
-	pi = pidinfo_create(pid, curthread->t_pid);
-	if (pi==NULL) {
-		lock_release(pidlock);
-		return ENOMEM;
+	pid = pi->pi_nextpid;
+	KASSERT(pid % PROCS_MAX == slot);
+	pi->pi_nextpid += PROCS_MAX;
+	if (pi->pi_nextpid > PID_MAX) {
+		pi->pi_nextpid = slot >= PID_MIN ? slot : slot + PROCS_MAX;
 	}
 
-	pi_put(pid, pi);
+	pidinfo_setup(pi, pid, curthread->t_pid);
 
-	inc_nextpid();
-
-	lock_release(pidlock);
+	lock_release(pi->pi_lock);
 
 	*retval = pid;
 	return 0;
@@ -289,21 +299,17 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
-
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curthread->t_pid);
 
-	/* keep pidinfo_destroy from complaining */
+	/* keep pi_drop from complaining */
 	them->pi_exitstatus = 0xdead;
 	them->pi_exited = true;
 	them->pi_ppid = INVALID_PID;
 
-	pi_drop(theirpid);
-
-	lock_release(pidlock);
+	pi_drop(them);
 }
 
 /*
@@ -338,13 +344,10 @@ pid_exit(int status, bool dodetach)
 	(void)dodetach; /* for compiler - delete when dodetach has real use */
 
 	// Implement me. Existing code simply sets the exit status.
-	lock_acquire(pidlock);
-
 	my_pi = pi_get(curthread->t_pid);
 	KASSERT(my_pi != NULL);
 	my_pi->pi_exitstatus = status;
-
-	lock_release(pidlock);
+	pi_put(my_pi);
 }
 
 /*
@@ -364,3 +367,106 @@ pid_join(pid_t targetpid, int *status, int flags)
 	KASSERT(false);
 	return EUNIMP;
 }
+
+/*
+ * pid_setthread - record the thread that runs as PID.
+ */
+void
+pid_setthread(pid_t pid, struct thread *t)
+{
+	struct pidinfo *pi;
+
+	pi = pi_get(pid);
+	KASSERT(pi != NULL);
+	pi->pi_thread = t;
+	pi_put(pi);
+}
+
+/*
+ * pid_exitusage - called by the current thread as it exits with its
+ * final resource usage. Exited children count toward the parent even
+ * though nobody waits for them, since pid_join doesn't reap yet.
+ *
+ * Only one slot is locked at a time, so there's no lock order to
+ * keep between parents and children.
+ */
+void
+pid_exitusage(const struct threadusage *usage)
+{
+	struct pidinfo *my_pi, *parent_pi;
+	struct threadusage total;
+	pid_t ppid;
+
+	my_pi = pi_get(curthread->t_pid);
+	if (my_pi == NULL) {
+		return;
+	}
+	my_pi->pi_thread = NULL;
+	my_pi->pi_usage = *usage;
+	ppid = my_pi->pi_ppid;
+	total = my_pi->pi_childusage;
+	pi_put(my_pi);
+
+	if (ppid == INVALID_PID) {
+		return;
+	}
+	threadusage_add(&total, usage);
+
+	parent_pi = pi_get(ppid);
+	if (parent_pi != NULL) {
+		threadusage_add(&parent_pi->pi_childusage, &total);
+		pi_put(parent_pi);
+	}
+}
+
+/*
+ * pid_childusage - get the total usage of the current thread's exited
+ * children (and theirs).
+ */
+void
+pid_childusage(struct threadusage *usage)
+{
+	struct pidinfo *my_pi;
+
+	my_pi = pi_get(curthread->t_pid);
+	KASSERT(my_pi != NULL);
+	*usage = my_pi->pi_childusage;
+	pi_put(my_pi);
+}
+
+/*
+ * pid_printusage - print every process's cpu time, context switches
+ * and page faults. A running thread's numbers are read without
+ * stopping it, so they're only approximately current, and its time
+ * since it last entered or left the kernel isn't counted yet.
+ */
+void
+pid_printusage(void)
+{
+	struct pidinfo *pi;
+	const struct threadusage *tu;
+	int i;
+
+	kprintf("  pid  ppid    user ms     sys ms     vcsw    ivcsw"
+		"   minflt   majflt  name\n");
+
+	for (i=0; i<PROCS_MAX; i++) {
+		pi = &pidinfo[i];
+		lock_acquire(pi->pi_lock);
+		if (pi->pi_pid == INVALID_PID) {
+			lock_release(pi->pi_lock);
+			continue;
+		}
+		tu = pi->pi_thread != NULL ? &pi->pi_thread->t_usage
+			: &pi->pi_usage;
+		kprintf("%5d %5d %10llu %10llu %8u %8u %8u %8u  %s\n",
+			pi->pi_pid, pi->pi_ppid,
+			(unsigned long long)(tu->tu_utime / 1000000),
+			(unsigned long long)(tu->tu_stime / 1000000),
+			tu->tu_nvcsw, tu->tu_nivcsw,
+			tu->tu_minflt, tu->tu_majflt,
+			pi->pi_thread != NULL ? pi->pi_thread->t_name
+			: "(exited)");
+		lock_release(pi->pi_lock);
+	}
+}
@@ -30,12 +30,17 @@
 /* Make sure to build out-of-line versions of spinlock inline functions */
 #define SPINLOCK_INLINE   /* empty */
 
+/* Likewise for the atomic counters, which use the same LL/SC */
+#define ATOMIC_INLINE   /* empty */
+
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
@@ -50,6 +55,26 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+#if OPT_LOCKSTAT
+	splk->splk_name = NULL;
+	splk->splk_site = 0;
+	splk->splk_acquired = 0;
+	splk->splk_spun = 0;
+#endif
+}
+
+/*
+ * Name the lock for the lock statistics.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+#if OPT_LOCKSTAT
+	splk->splk_name = name;
+#else
+	(void)splk;
+	(void)name;
+#endif
 }
 
 /*
@@ -73,6 +98,10 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKSTAT
+	uint32_t spinstart = 0;
+	bool spun = false;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -99,6 +128,12 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+#if OPT_LOCKSTAT
+			if (!spun) {
+				spinstart = cpu_cycles();
+				spun = true;
+			}
+#endif
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
@@ -108,6 +143,13 @@ spinlock_acquire(struct spinlock *splk)
 	}
 
 	splk->splk_holder = mycpu;
+#if OPT_LOCKSTAT
+	splk->splk_site = (vaddr_t)__builtin_return_address(0);
+	splk->splk_acquired = cpu_cycles();
+	/* 0 means uncontended, so a contended acquire counts at least 1 */
+	splk->splk_spun = spun ? lockstat_cycles(spinstart,
+						 splk->splk_acquired) + 1 : 0;
+#endif
 }
 
 /*
@@ -121,6 +163,9 @@ spinlock_release(struct spinlock *splk)
 		KASSERT(splk->splk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	lockstat_spinlock(splk, cpu_cycles());
+#endif
 	splk->splk_holder = NULL;
 	spinlock_data_set(&splk->splk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
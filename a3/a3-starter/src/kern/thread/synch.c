@@ -37,8 +37,11 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
+#include <clock.h>
 #include <current.h>
 #include <synch.h>
+#include <lockstat.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,10 +150,21 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times an adaptive lock's waiter checks lk_holder before
+ * going back to see if it should keep spinning or sleep. A waiter
+ * spins for at most LOCK_SPINROUNDS of these before sleeping anyway,
+ * in case the holder is running but in a long critical section.
+ */
+#define LOCK_SPINS	200
+#define LOCK_SPINROUNDS	10
+
+static
 struct lock *
-lock_create(const char *name)
+lock_create_internal(const char *name, bool adaptive)
 {
         struct lock *lock;
+	unsigned i;
 
         lock = kmalloc(sizeof(struct lock));
         if (lock == NULL) {
@@ -171,16 +185,73 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_adaptive = adaptive;
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_waitnsecs = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		lock->lk_waitlevels[i] = 0;
+	}
+	lock->lk_nwaiters = 0;
+	lock->lk_heldnext = NULL;
+#if OPT_LOCKSTAT
+	lock->lk_acqtime = 0;
+	lock->lk_lastwait = 0;
+	lock->lk_lastcontended = false;
+#endif
         
         return lock;
 }
 
+struct lock *
+lock_create(const char *name)
+{
+	return lock_create_internal(name, false);
+}
+
+struct lock *
+lock_create_adaptive(const char *name)
+{
+	return lock_create_internal(name, true);
+}
+
+/*
+ * Time for the wait statistics. Locks get used before the clock
+ * device is attached; those waits just count as zero.
+ */
+static
+uint64_t
+lock_waitclock(void)
+{
+	return gettime_ready() ? clock_nanotime() : 0;
+}
+
+/*
+ * Should we spin waiting for an adaptive lock? Only if its holder is
+ * actually running, and on some other cpu; otherwise it can't let go
+ * until we've slept anyway. Call with lk_lock held, which keeps the
+ * holder from releasing the lock and so from going away.
+ */
+static
+bool
+lock_should_spin(struct lock *lock)
+{
+	struct thread *holder;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	holder = lock->lk_holder;
+	return lock->lk_adaptive && holder != NULL &&
+		holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self;
+}
+
 void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nwaiters == 0);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
         
@@ -188,15 +259,254 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Priority inheritance.
+ *
+ * A thread that goes to sleep waiting for a lock counts itself in the
+ * lock's lk_waitlevels at its effective scheduling level, and the
+ * holder inherits that level if it's better than its own. If the
+ * holder is itself asleep on another lock, the level is passed on to
+ * that lock's holder, and so on down the chain (for at most
+ * PI_MAXDEPTH locks, in case of a deadlock cycle). A thread that
+ * takes a lock with waiters still on it inherits from them; a thread
+ * that releases a lock goes back to the best level donated through
+ * the locks it still holds.
+ *
+ * All of this is under the one pi_lock, which is taken after lk_lock
+ * and before any wchan or runqueue lock. It's only needed when a lock
+ * has waiters or its holder has inherited something, so uncontended
+ * acquires and releases don't touch it.
+ */
+#define PI_MAXDEPTH	8
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER_NAMED("pi_lock");
+
+/*
+ * Best level of any thread asleep on LOCK, or SCHED_NLEVELS if none.
+ */
+static
+unsigned
+lock_pi_best(struct lock *lock)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (lock->lk_waitlevels[i] > 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * A waiter at LEVEL is asleep on LOCK: raise the holder to LEVEL, and
+ * the holder of whatever it's asleep on, and so on.
+ *
+ * The locks further down the chain aren't locked, but each has a
+ * waiter (the previous holder), so its lk_holder only changes with
+ * pi_lock held.
+ */
+static
+void
+lock_pi_propagate(struct lock *lock, unsigned level)
+{
+	struct thread *holder;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (depth=0; depth<PI_MAXDEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL || thread_getlevel(holder) <= level) {
+			return;
+		}
+		thread_inherit(holder, level);
+
+		lock = holder->t_blockedon;
+		if (lock == NULL) {
+			return;
+		}
+		KASSERT(lock->lk_waitlevels[holder->t_blocklevel] > 0);
+		lock->lk_waitlevels[holder->t_blocklevel]--;
+		lock->lk_waitlevels[level]++;
+		holder->t_blocklevel = level;
+	}
+}
+
+/*
+ * Count curthread as asleep on LOCK and donate its level.
+ */
+static
+void
+lock_pi_block(struct lock *lock)
+{
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	spinlock_acquire(&pi_lock);
+	level = thread_getlevel(curthread);
+	lock->lk_waitlevels[level]++;
+	lock->lk_nwaiters++;
+	curthread->t_blockedon = lock;
+	curthread->t_blocklevel = level;
+	lock_pi_propagate(lock, level);
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * T has become LOCK's holder: stop counting it as a waiter, if it
+ * was one, and have it inherit from whoever's still waiting.
+ */
+static
+void
+lock_pi_take(struct lock *lock, struct thread *t)
+{
+	unsigned best;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	if (t->t_blockedon == lock) {
+		KASSERT(lock->lk_waitlevels[t->t_blocklevel] > 0);
+		lock->lk_waitlevels[t->t_blocklevel]--;
+		lock->lk_nwaiters--;
+		t->t_blockedon = NULL;
+	}
+	best = lock_pi_best(lock);
+	if (best < t->t_inherited) {
+		thread_inherit(t, best);
+	}
+}
+
+/*
+ * Work out again what curthread inherits, from the locks it still
+ * holds. Called after releasing one.
+ */
+static
+void
+lock_pi_recompute(void)
+{
+	struct lock *held;
+	unsigned best, level;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	best = SCHED_NLEVELS;
+	for (held = curthread->t_heldlocks; held != NULL;
+	     held = held->lk_heldnext) {
+		level = lock_pi_best(held);
+		if (level < best) {
+			best = level;
+		}
+	}
+	if (best != curthread->t_inherited) {
+		thread_inherit(curthread, best);
+	}
+}
+
+/*
+ * Make curthread the holder of LOCK, which is free or was handed to
+ * it by lock_release, and put it on curthread's list of held locks.
+ */
+static
+void
+lock_sethold(struct lock *lock)
+{
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	if (lock->lk_nwaiters > 0) {
+		spinlock_acquire(&pi_lock);
+		lock->lk_holder = curthread;
+		lock_pi_take(lock, curthread);
+		spinlock_release(&pi_lock);
+	}
+	else {
+		lock->lk_holder = curthread;
+	}
+	lock->lk_heldnext = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+}
+
+/*
+ * Take LOCK off curthread's list of held locks. Usually it's the most
+ * recently acquired one, at the head.
+ */
+static
+void
+lock_unhold(struct lock *lock)
+{
+	struct lock **pp;
+
+	for (pp = &curthread->t_heldlocks; *pp != lock;
+	     pp = &(*pp)->lk_heldnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = lock->lk_heldnext;
+	lock->lk_heldnext = NULL;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	uint64_t start, now;
+	unsigned i, rounds;
+
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&lock->lk_lock);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
+	lock->lk_acquires++;
+	if (lock->lk_holder == NULL) {
+		/* Fast path: uncontended. */
+		lock_sethold(lock);
+#if OPT_LOCKSTAT
+		lock->lk_acqtime = lock_waitclock();
+		lock->lk_lastwait = 0;
+		lock->lk_lastcontended = false;
+#endif
+		spinlock_release(&lock->lk_lock);
+		return;
+	}
+
+	lock->lk_contended++;
+	start = lock_waitclock();
+	rounds = 0;
+
+	/*
+	 * If lock_release handed the lock to us while we slept, we're
+	 * already lk_holder when we wake up.
+	 */
+	while (lock->lk_holder != NULL && lock->lk_holder != curthread) {
+		if (rounds < LOCK_SPINROUNDS && lock_should_spin(lock)) {
+			/*
+			 * Watch lk_holder without the spinlock until
+			 * it changes or we've spun long enough, then
+			 * go around again and look at the new state.
+			 */
+			holder = lock->lk_holder;
+			spinlock_release(&lock->lk_lock);
+			for (i=0; i<LOCK_SPINS; i++) {
+				if (lock->lk_holder != holder) {
+					break;
+				}
+			}
+			rounds++;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+
+		/*
+		 * As in the semaphore, but first donate our level to
+		 * the holder. A waiter stays counted across wakeups
+		 * until it gets the lock.
+		 */
+		if (curthread->t_blockedon != lock) {
+			lock_pi_block(lock);
+		}
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
@@ -204,19 +514,67 @@ lock_acquire(struct lock *lock)
 		spinlock_acquire(&lock->lk_lock);
 	}
 
-	lock->lk_holder = curthread;
+	lock_sethold(lock);
+	now = lock_waitclock();
+	if (start != 0) {
+		lock->lk_waitnsecs += now - start;
+	}
+#if OPT_LOCKSTAT
+	lock->lk_acqtime = now;
+	lock->lk_lastwait = start != 0 ? now - start : 0;
+	lock->lk_lastcontended = true;
+#endif
 	spinlock_release(&lock->lk_lock);
 }
 
 void
 lock_release(struct lock *lock)
 {
+	bool pi;
+
 	DEBUGASSERT(lock != NULL);
 
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan);
+#if OPT_LOCKSTAT
+	if (lock->lk_acqtime != 0) {
+		lockstat_sleeplock(lock->lk_name, lock->lk_lastcontended,
+				   lock->lk_lastwait,
+				   lock_waitclock() - lock->lk_acqtime);
+	}
+#endif
+	lock_unhold(lock);
+
+	/*
+	 * Any sleeper is counted in lk_nwaiters, so if that's zero
+	 * and we haven't inherited anything, there's no priority to
+	 * pass on or give back.
+	 */
+	pi = lock->lk_nwaiters > 0 ||
+		curthread->t_inherited != SCHED_NLEVELS;
+	if (pi) {
+		spinlock_acquire(&pi_lock);
+	}
+	if (lock->lk_adaptive) {
+		/*
+		 * Hand off to the first sleeper, if any. It can't get
+		 * anywhere until we drop lk_lock, so the pointer is
+		 * safe to store.
+		 */
+		lock->lk_holder = wchan_wakeone(lock->lk_wchan);
+		if (lock->lk_holder != NULL) {
+			KASSERT(pi);
+			lock_pi_take(lock, lock->lk_holder);
+		}
+	}
+	else {
+		lock->lk_holder = NULL;
+		wchan_wakeone(lock->lk_wchan);
+	}
+	if (pi) {
+		lock_pi_recompute();
+		spinlock_release(&pi_lock);
+	}
 	spinlock_release(&lock->lk_lock);
 }
 
@@ -298,3 +656,201 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	(void)lock;
 	wchan_wakeall(cv->cv_wchan);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rwl;
+
+        rwl = kmalloc(sizeof(struct rwlock));
+        if (rwl == NULL) {
+                return NULL;
+        }
+
+        rwl->rwl_name = kstrdup(name);
+        if (rwl->rwl_name == NULL) {
+                kfree(rwl);
+                return NULL;
+        }
+
+	rwl->rwl_rwchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_rwchan == NULL) {
+		kfree(rwl->rwl_name);
+		kfree(rwl);
+		return NULL;
+	}
+	rwl->rwl_wwchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_wwchan == NULL) {
+		wchan_destroy(rwl->rwl_rwchan);
+		kfree(rwl->rwl_name);
+		kfree(rwl);
+		return NULL;
+	}
+	spinlock_init(&rwl->rwl_lock);
+	rwl->rwl_readers = 0;
+	rwl->rwl_wwaiting = 0;
+	rwl->rwl_writer = NULL;
+
+        return rwl;
+}
+
+void
+rwlock_destroy(struct rwlock *rwl)
+{
+        KASSERT(rwl != NULL);
+
+	KASSERT(rwl->rwl_readers == 0);
+	KASSERT(rwl->rwl_wwaiting == 0);
+	KASSERT(rwl->rwl_writer == NULL);
+	spinlock_cleanup(&rwl->rwl_lock);
+	wchan_destroy(rwl->rwl_wwchan);
+	wchan_destroy(rwl->rwl_rwchan);
+
+        kfree(rwl->rwl_name);
+        kfree(rwl);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	/* Wait behind waiting writers too, so they don't starve. */
+	while (rwl->rwl_writer != NULL || rwl->rwl_wwaiting > 0) {
+		/* As in the semaphore. */
+		wchan_lock(rwl->rwl_rwchan);
+		spinlock_release(&rwl->rwl_lock);
+		wchan_sleep(rwl->rwl_rwchan);
+
+		spinlock_acquire(&rwl->rwl_lock);
+	}
+	rwl->rwl_readers++;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_readers > 0);
+	KASSERT(rwl->rwl_writer == NULL);
+	rwl->rwl_readers--;
+	if (rwl->rwl_readers == 0 && rwl->rwl_wwaiting > 0) {
+		wchan_wakeone(rwl->rwl_wwchan);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	rwl->rwl_wwaiting++;
+	while (rwl->rwl_writer != NULL || rwl->rwl_readers > 0) {
+		wchan_lock(rwl->rwl_wwchan);
+		spinlock_release(&rwl->rwl_lock);
+		wchan_sleep(rwl->rwl_wwchan);
+
+		spinlock_acquire(&rwl->rwl_lock);
+	}
+	rwl->rwl_wwaiting--;
+	rwl->rwl_writer = curthread;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer == curthread);
+	KASSERT(rwl->rwl_readers == 0);
+	rwl->rwl_writer = NULL;
+	if (rwl->rwl_wwaiting > 0) {
+		wchan_wakeone(rwl->rwl_wwchan);
+	}
+	else {
+		wchan_wakeall(rwl->rwl_rwchan);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+bool
+rwlock_tryacquire_read(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = (rwl->rwl_writer == NULL && rwl->rwl_wwaiting == 0);
+	if (ret) {
+		rwl->rwl_readers++;
+	}
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
+
+bool
+rwlock_tryacquire_write(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = (rwl->rwl_writer == NULL && rwl->rwl_readers == 0);
+	if (ret) {
+		rwl->rwl_writer = curthread;
+	}
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
+
+void
+rwlock_downgrade(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer == curthread);
+	KASSERT(rwl->rwl_readers == 0);
+	rwl->rwl_writer = NULL;
+	rwl->rwl_readers = 1;
+	/* Other readers can come in too, unless a writer is waiting. */
+	if (rwl->rwl_wwaiting == 0) {
+		wchan_wakeall(rwl->rwl_rwchan);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = (rwl->rwl_writer == curthread);
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
@@ -35,6 +35,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <kmem.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -44,6 +45,7 @@
 #include <threadprivate.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -53,6 +55,7 @@
 
 /* BEGIN A3 SETUP */
 #include <file.h>
+#include <lockstat.h>
 #include "opt-dumbvm.h" /* to switch between dumb and real vm */
 
 /* External variables for hack to make menu thread wait for progthread */
@@ -67,6 +70,29 @@ extern int progthread_pid;
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduler parameters.
+ *
+ * Each cpu's run queue is a multilevel feedback queue with
+ * SCHED_NLEVELS levels. A thread at level L runs for
+ * sched_quantum[L] hardclocks and then drops a level, so cpu-bound
+ * threads sink and threads that mostly sleep stay near the top.
+ * Waking up from a wchan raises a thread one level, and every
+ * SCHED_BOOST_HARDCLOCKS schedule() moves everything back to level 0
+ * so nothing at the bottom starves.
+ *
+ * The quantum is only refilled when the level changes; a thread that
+ * yields keeps whatever it had left.
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+#define SCHED_BOOST_HARDCLOCKS	HZ	/* Age everything once a second. */
+
+/*
+ * Work stealing parameters; see thread_steal().
+ */
+#define STEAL_THRESHOLD		2	/* Min. ready threads on a victim. */
+#define STEAL_AFFINITY_HARDCLOCKS 2	/* Ran this recently = cache-hot. */
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -79,6 +105,20 @@ DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/* Object cache for thread structures. */
+static struct kmem_cache *thread_cache;
+
+/*
+ * Per-cpu cache of exited threads, with their stacks, for thread_fork
+ * to reuse. Each cpu keeps up to thread_cachemax. Once nothing has
+ * been taken from a cpu's cache for THREADCACHE_IDLE hardclocks, it is
+ * trimmed back to THREADCACHE_LOW.
+ */
+#define THREADCACHE_MAX		8
+#define THREADCACHE_LOW		2
+#define THREADCACHE_IDLE	100
+static unsigned thread_cachemax = THREADCACHE_MAX;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -122,36 +162,32 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Initialize a thread's fields, other than its stack, for a new
+ * thread called NAME (which the thread takes ownership of).
  */
 static
-struct thread *
-thread_create(const char *name)
+void
+thread_init(struct thread *thread, char *name)
 {
-	struct thread *thread;
-
-	DEBUGASSERT(name != NULL);
-
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
-	}
+	thread->t_name = name;
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_quantum = sched_quantum[0];
+	thread->t_lastran = 0;
+	thread->t_runlevel = SCHED_NLEVELS;
+	thread->t_inherited = SCHED_NLEVELS;
+	thread->t_blockedon = NULL;
+	thread->t_blocklevel = 0;
+	thread->t_heldlocks = NULL;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+	thread->t_acctstamp = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -172,6 +208,34 @@ thread_create(const char *name)
 	/* BEGIN A3 SETUP */
 	thread->t_filetable = NULL;
 	/* END A3 SETUP */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads. The new
+ * thread has no stack.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+	char *namecopy;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmem_cache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	namecopy = kstrdup(name);
+	if (namecopy == NULL) {
+		kmem_cache_free(thread_cache, thread);
+		return NULL;
+	}
+	thread_init(thread, namecopy);
+	thread->t_stack = NULL;
 
 	return thread;
 }
@@ -189,6 +253,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -201,7 +266,15 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_used = 0;
+	c->c_threadcache_hits = 0;
+	c->c_threadcache_misses = 0;
 	c->c_hardclocks = 0;
+	kmem_cpu_init(c);
+#if OPT_LOCKSTAT
+	lockstat_cpu_init(c);
+#endif
 
         /* BEGIN A3 SETUP */
 #if !OPT_DUMBVM
@@ -210,8 +283,23 @@ cpu_create(unsigned hardware_number)
         /* END A3 SETUP */
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_count = 0;
+	c->c_sched_lastboost = 0;
+	c->c_sched_demotions = 0;
+	c->c_sched_preemptions = 0;
+	c->c_sched_wakeboosts = 0;
+	c->c_sched_boosts = 0;
+	c->c_sched_steals = 0;
+	c->c_nexttick = 0;
+	c->c_idleticks = 0;
+	c->c_timers = NULL;
+	c->c_timerprog = 0;
+	spinlock_init(&c->c_timer_lock);
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -252,6 +340,7 @@ cpu_create(unsigned hardware_number)
 		if (result) {
 			panic("cpu_create: pid_alloc failed\n");
 		}
+		pid_setthread(c->c_curthread->t_pid, c->c_curthread);
 
 	}
 	c->c_curthread->t_cpu = c;
@@ -262,7 +351,26 @@ cpu_create(unsigned hardware_number)
 }
 
 /*
- * Destroy a thread.
+ * Look up a cpu by its (software) number.
+ */
+struct cpu *
+cpu_bynumber(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Free a thread and its stack.
  *
  * This function cannot be called in the victim thread's own context.
  * Nor can it be called on a running thread.
@@ -271,7 +379,7 @@ cpu_create(unsigned hardware_number)
  */
 static
 void
-thread_destroy(struct thread *thread)
+thread_free(struct thread *thread)
 {
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
@@ -298,7 +406,139 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Get rid of a thread that's done with: keep it in this cpu's cache
+ * if it has a stack and there's room, or else free it. The stack
+ * guard is checked first, so an overflow isn't carried over to the
+ * thread's next life.
+ *
+ * Same rules as thread_free about which threads this can be called on.
+ */
+static
+void
+thread_destroy(struct thread *thread)
+{
+	int spl;
+
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state != S_RUN);
+
+	if (thread->t_stack == NULL) {
+		thread_free(thread);
+		return;
+	}
+	thread_checkstack(thread);
+
+	spl = splhigh();
+	if (curcpu->c_threadcache.tl_count >= thread_cachemax) {
+		splx(spl);
+		thread_free(thread);
+		return;
+	}
+
+	/* Same cleanup as thread_free, less the stack and struct */
+	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_addrspace == NULL);
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+	splx(spl);
+}
+
+/*
+ * Trim this cpu's thread cache back to THREADCACHE_LOW if it hasn't
+ * been used for a while, or to the maximum if that has come down.
+ */
+static
+void
+thread_cache_reap(void)
+{
+	struct threadlist *tc = &curcpu->c_threadcache;
+	struct thread *t;
+	unsigned keep;
+
+	keep = thread_cachemax;
+	if (curcpu->c_hardclocks - curcpu->c_threadcache_used
+	    >= THREADCACHE_IDLE && keep > THREADCACHE_LOW) {
+		keep = THREADCACHE_LOW;
+	}
+	while (tc->tl_count > keep) {
+		t = threadlist_remtail(tc);
+		thread_free(t);
+	}
+}
+
+/*
+ * Set the per-cpu thread cache size.
+ */
+unsigned
+thread_setcachemax(unsigned max)
+{
+	unsigned old;
+
+	old = thread_cachemax;
+	thread_cachemax = max;
+	return old;
+}
+
+/*
+ * Get a thread with a stack for thread_fork: a cached one from this
+ * cpu if there is one, or else a new one.
+ */
+static
+struct thread *
+thread_alloc(const char *name)
+{
+	struct thread *thread;
+	char *namecopy;
+	int spl;
+
+	DEBUGASSERT(name != NULL);
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	if (thread != NULL) {
+		curcpu->c_threadcache_hits++;
+		curcpu->c_threadcache_used = curcpu->c_hardclocks;
+	}
+	else {
+		curcpu->c_threadcache_misses++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		thread = thread_create(name);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			thread_free(thread);
+			return NULL;
+		}
+		thread_checkstack_init(thread);
+		return thread;
+	}
+
+	namecopy = kstrdup(name);
+	if (namecopy == NULL) {
+		spl = splhigh();
+		threadlist_addhead(&curcpu->c_threadcache, thread);
+		splx(spl);
+		return NULL;
+	}
+	KASSERT(thread->t_stack != NULL);
+	thread_init(thread, namecopy);
+	thread_checkstack_init(thread);
+	return thread;
 }
 
 /*
@@ -318,6 +558,7 @@ exorcise(void)
 		KASSERT(z->t_state == S_ZOMBIE);
 		thread_destroy(z);
 	}
+	thread_cache_reap();
 }
 
 /*
@@ -328,6 +569,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -342,9 +585,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -390,6 +636,11 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread));
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -462,6 +713,283 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Effective scheduling level: the thread's own MLFQ level, or the
+ * level it inherited from a waiter on a lock it holds if that's
+ * higher. Run queues are ordered by this.
+ */
+static
+unsigned
+thread_level(struct thread *t)
+{
+	return t->t_inherited < t->t_priority ? t->t_inherited : t->t_priority;
+}
+
+/*
+ * Run queue operations. The caller must hold the cpu's runqueue lock.
+ *
+ * runqueue_add puts a thread on the tail of its level.
+ * runqueue_remhead takes the next thread to run: the head of the
+ * highest nonempty level.
+ * runqueue_remtail takes the thread least likely to run soon, the
+ * tail of the lowest nonempty level, for migrating elsewhere.
+ * runqueue_remove takes a particular thread off.
+ *
+ * t_runlevel records which level a queued thread is on, since its
+ * effective level can change while it's there.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	level = thread_level(t);
+	KASSERT(level < SCHED_NLEVELS);
+
+	threadlist_addtail(&c->c_runqueue[level], t);
+	t->t_runlevel = level;
+	c->c_runqueue_count++;
+}
+
+static
+void
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_runlevel < SCHED_NLEVELS);
+	KASSERT(c->c_runqueue_count > 0);
+
+	threadlist_remove(&c->c_runqueue[t->t_runlevel], t);
+	t->t_runlevel = SCHED_NLEVELS;
+	c->c_runqueue_count--;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			KASSERT(c->c_runqueue_count > 0);
+			c->c_runqueue_count--;
+			t->t_runlevel = SCHED_NLEVELS;
+			return t;
+		}
+	}
+	KASSERT(c->c_runqueue_count == 0);
+	return NULL;
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			KASSERT(c->c_runqueue_count > 0);
+			c->c_runqueue_count--;
+			t->t_runlevel = SCHED_NLEVELS;
+			return t;
+		}
+	}
+	KASSERT(c->c_runqueue_count == 0);
+	return NULL;
+}
+
+/*
+ * Return the highest (numerically lowest) level with a thread on it,
+ * or SCHED_NLEVELS if the run queue is empty.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Move a thread to scheduling level LEVEL with a fresh quantum. The
+ * thread must not be on a run queue.
+ */
+static
+void
+thread_setlevel(struct thread *t, unsigned level)
+{
+	KASSERT(level < SCHED_NLEVELS);
+	t->t_priority = level;
+	t->t_quantum = sched_quantum[level];
+}
+
+/*
+ * Priority inheritance hooks; see synch.c.
+ */
+unsigned
+thread_getlevel(struct thread *t)
+{
+	return thread_level(t);
+}
+
+/*
+ * Set the level T inherits. If T is on a run queue, move it to the
+ * right level there. T can be migrated or stolen while we're getting
+ * its cpu's lock, so check t_cpu again once it's held, and again
+ * after setting t_inherited: if the thread moved in the meantime its
+ * new cpu may have queued it by the old level, so go fix that too.
+ */
+void
+thread_inherit(struct thread *t, unsigned level)
+{
+	struct cpu *c;
+
+	KASSERT(level <= SCHED_NLEVELS);
+
+	do {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu != c) {
+			spinlock_release(&c->c_runqueue_lock);
+			continue;
+		}
+		t->t_inherited = level;
+		if (t->t_runlevel < SCHED_NLEVELS &&
+		    t->t_runlevel != thread_level(t)) {
+			runqueue_remove(c, t);
+			runqueue_add(c, t);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	} while (t->t_cpu != c);
+}
+
+/*
+ * Work stealing.
+ *
+ * Called by an idle cpu, with no runqueue locks held, from the idle
+ * loop in thread_switch. Find the cpu with the most ready threads
+ * and, if it has at least STEAL_THRESHOLD, take one from it: the
+ * lowest-level one that hasn't run in the last
+ * STEAL_AFFINITY_HARDCLOCKS (so is unlikely to still have anything
+ * in that cpu's cache), or if there are none of those and the victim
+ * is twice over the threshold, the lowest-level one regardless.
+ *
+ * Returns the stolen thread, already moved to the current cpu but not
+ * on any run queue, or NULL.
+ *
+ * The scan for the busiest cpu is done without locks, so it's only a
+ * hint; the victim's count is checked again once its lock is held.
+ * Only one runqueue lock is ever held at a time, so this can't
+ * deadlock against thread_consider_migration or another thief.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *found;
+	unsigned i, j, numcpus, best;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_runqueue_count > best) {
+			victim = c;
+			best = c->c_runqueue_count;
+		}
+	}
+	if (best < STEAL_THRESHOLD) {
+		return NULL;
+	}
+
+	found = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	if (victim->c_runqueue_count < STEAL_THRESHOLD) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+
+	/*
+	 * Look from the tail of the lowest level up. Never take the
+	 * victim's curthread; see thread_consider_migration for how it
+	 * can be on its own run queue.
+	 */
+	for (j=SCHED_NLEVELS; j-- > 0 && found == NULL; ) {
+		THREADLIST_FORALL_REV(t, victim->c_runqueue[j]) {
+			if (t == victim->c_curthread) {
+				continue;
+			}
+			if (victim->c_hardclocks - t->t_lastran
+			    >= STEAL_AFFINITY_HARDCLOCKS) {
+				found = t;
+				break;
+			}
+			if (found == NULL &&
+			    victim->c_runqueue_count >= 2*STEAL_THRESHOLD) {
+				/* Remember it, but keep looking for a cold one. */
+				found = t;
+			}
+		}
+	}
+	if (found != NULL) {
+		runqueue_remove(victim, found);
+		found->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      found->t_name, victim->c_number, curcpu->c_number);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (found != NULL) {
+		curcpu->c_sched_steals++;
+	}
+	return found;
+}
+
+/*
+ * Wake up one idle cpu other than BUSY, if there is one, so it can
+ * try thread_steal. c_isidle is read without the other cpus' locks;
+ * at worst we send a useless IPI or miss a cpu that just went idle,
+ * which will then find the work on its own.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -485,8 +1013,14 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	if (target->t_state == S_SLEEP && target->t_priority > 0) {
+		/* Waking up from a wchan: raise it a level. */
+		thread_setlevel(target, target->t_priority - 1);
+		targetcpu->c_sched_wakeboosts++;
+	}
+
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -494,6 +1028,14 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_runqueue_count >= STEAL_THRESHOLD) {
+		/*
+		 * Enough is queued that an idle cpu would steal some
+		 * of it, but idle cpus don't take timer ticks, so
+		 * poke one.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -525,19 +1067,12 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Get a thread and stack, from this cpu's cache if possible */
+	newthread = thread_alloc(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/* Get a process ID - new for ASST2 */
 	result = pid_alloc(&newthread->t_pid);
 	if (result) {
@@ -578,6 +1113,9 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
+	/* Let the process table find it, for resource usage. */
+	pid_setthread(newthread->t_pid, newthread);
+
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
@@ -606,6 +1144,76 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * CPU time accounting.
+ *
+ * The time since t_acctstamp goes to user time on trap entry from
+ * user mode, and to system time on return to user mode or when the
+ * thread is switched out; when it's switched back in the stamp is
+ * reset, so time spent waiting or idle isn't charged. Before the
+ * clock device is attached nothing is charged.
+ */
+static
+uint64_t
+thread_acctclock(void)
+{
+	return gettime_ready() ? clock_nanotime() : 0;
+}
+
+static
+void
+thread_acct_charge(uint64_t *bucket)
+{
+	uint64_t now;
+
+	now = thread_acctclock();
+	if (now != 0 && curthread->t_acctstamp != 0) {
+		*bucket += now - curthread->t_acctstamp;
+	}
+	curthread->t_acctstamp = now;
+}
+
+void
+thread_acct_fromuser(void)
+{
+	thread_acct_charge(&curthread->t_usage.tu_utime);
+}
+
+void
+thread_acct_touser(void)
+{
+	thread_acct_charge(&curthread->t_usage.tu_stime);
+}
+
+void
+thread_acct_fault(bool major)
+{
+	if (major) {
+		curthread->t_usage.tu_majflt++;
+	}
+	else {
+		curthread->t_usage.tu_minflt++;
+	}
+}
+
+void
+thread_getusage(struct threadusage *tu)
+{
+	thread_acct_charge(&curthread->t_usage.tu_stime);
+	*tu = curthread->t_usage;
+}
+
+void
+threadusage_add(struct threadusage *to, const struct threadusage *from)
+{
+	to->tu_utime += from->tu_utime;
+	to->tu_stime += from->tu_stime;
+	to->tu_nvcsw += from->tu_nvcsw;
+	to->tu_nivcsw += from->tu_nivcsw;
+	to->tu_minflt += from->tu_minflt;
+	to->tu_majflt += from->tu_majflt;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -620,6 +1228,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -642,11 +1251,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Charge the time up to now; stop the clock until we're back. */
+	thread_acct_charge(&cur->t_usage.tu_stime);
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -683,6 +1295,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastran = curcpu->c_hardclocks;
+
+	/* Being preempted from the timer interrupt is involuntary. */
+	if (newstate == S_READY && cur->t_in_interrupt) {
+		cur->t_usage.tu_nivcsw++;
+	}
+	else if (newstate != S_ZOMBIE) {
+		cur->t_usage.tu_nvcsw++;
+	}
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -699,19 +1320,35 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal a thread from a busier
+	 * cpu. This happens again each time cpu_idle returns. Idle cpus
+	 * don't get timer ticks, so thread_make_runnable sends one an
+	 * IPI when a busy cpu's queue gets long enough to steal from;
+	 * that way it picks up work right away instead of waiting for
+	 * the busy cpu to get around to thread_consider_migration.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	idled = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+				idled = true;
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (idled) {
+		/* Ticks were suppressed while idle; restart them. */
+		hardclock_resume();
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -776,6 +1413,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Clear the wait channel and set the thread state. */
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
+	cur->t_acctstamp = thread_acctclock();
 
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -811,6 +1449,7 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clear the wait channel and set the thread state. */
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
+	cur->t_acctstamp = thread_acctclock();
 
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -857,10 +1496,17 @@ void
 thread_exit(int exitcode)
 {
 	struct thread *cur;
+	struct threadusage usage;
         (void)exitcode;  // suppress warning until code gets written
 
 	cur = curthread;
 
+	/* Leave the final resource usage with the process table. */
+	if (cur->t_pid != INVALID_PID) {
+		thread_getusage(&usage);
+		pid_exitusage(&usage);
+	}
+
 	/* BEGIN A3 SETUP */
 	/* Check if this thread was forked to handle a menu command,
 	 * and if so, signal the menu thread that it is done.
@@ -915,17 +1561,146 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). Demotion and
+ * preemption happen per-hardclock in thread_tick; this does the
+ * anti-starvation aging. Once every SCHED_BOOST_HARDCLOCKS, every
+ * thread on the current CPU's run queue, and the current thread, goes
+ * back to level 0 with a fresh quantum.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks - curcpu->c_sched_lastboost
+	    < SCHED_BOOST_HARDCLOCKS) {
+		return;
+	}
+	curcpu->c_sched_lastboost = curcpu->c_hardclocks;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			thread_setlevel(t, 0);
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+			t->t_runlevel = 0;
+		}
+	}
+	if (!curcpu->c_isidle) {
+		thread_setlevel(curthread, 0);
+	}
+	curcpu->c_sched_boosts++;
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Quantum accounting.
+ *
+ * This is called from hardclock() on every tick. The current thread
+ * uses up one hardclock of its quantum; if that was the last one it
+ * drops a level (getting the longer quantum of the new level) and
+ * yields. Otherwise it keeps running unless something at a higher
+ * level has become runnable, in which case it yields to that but
+ * stays at its level with what's left of its quantum.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur;
+	unsigned level;
+	bool yield;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nothing running; the idle loop isn't charged. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	KASSERT(cur->t_quantum > 0);
+	cur->t_quantum--;
+	if (cur->t_quantum == 0) {
+		level = cur->t_priority;
+		if (level + 1 < SCHED_NLEVELS) {
+			level++;
+		}
+		thread_setlevel(cur, level);
+		curcpu->c_sched_demotions++;
+		yield = true;
+	}
+	else if (runqueue_toplevel(curcpu) < thread_level(cur)) {
+		curcpu->c_sched_preemptions++;
+		yield = true;
+	}
+	else {
+		yield = false;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (yield) {
+		thread_yield();
+	}
+}
+
+/*
+ * Print the run queue length at each level on each CPU, along with
+ * the scheduler counters, for tuning the quanta and aging interval.
+ */
+void
+thread_printsched(void)
+{
+	unsigned counts[SCHED_NLEVELS];
+	unsigned demotions, preemptions, wakeboosts, boosts, steals;
+	unsigned idleticks, cached, hits, misses;
+	unsigned i, j, numcpus;
+	struct cpu *c;
+
+	kprintf("Quanta (hardclocks):");
+	for (j=0; j<SCHED_NLEVELS; j++) {
+		kprintf(" %u", sched_quantum[j]);
+	}
+	kprintf("; aging every %u hardclocks\n", SCHED_BOOST_HARDCLOCKS);
+
+	kprintf("cpu ");
+	for (j=0; j<SCHED_NLEVELS; j++) {
+		kprintf("   L%u", j);
+	}
+	kprintf("   demote  preempt   wakeup    aging   stolen idleskip"
+		" tcache  forkhit forkmiss\n");
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			counts[j] = c->c_runqueue[j].tl_count;
+		}
+		demotions = c->c_sched_demotions;
+		preemptions = c->c_sched_preemptions;
+		wakeboosts = c->c_sched_wakeboosts;
+		boosts = c->c_sched_boosts;
+		steals = c->c_sched_steals;
+		idleticks = c->c_idleticks;
+		spinlock_release(&c->c_runqueue_lock);
+
+		/* only approximate; these belong to the other cpu */
+		cached = c->c_threadcache.tl_count;
+		hits = c->c_threadcache_hits;
+		misses = c->c_threadcache_misses;
+
+		kprintf("%3u ", c->c_number);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf(" %4u", counts[j]);
+		}
+		kprintf(" %8u %8u %8u %8u %8u %8u %6u %8u %8u\n",
+			demotions, preemptions, wakeboosts, boosts, steals,
+			idleticks, cached, hits, misses);
+	}
 }
 
 /*
@@ -959,9 +1734,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runqueue_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runqueue_count;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -975,7 +1750,8 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		/* Send the lowest-priority threads; they'd wait longest. */
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -986,7 +1762,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (c->c_runqueue_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -1017,7 +1793,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1041,7 +1817,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1122,9 +1898,10 @@ wchan_sleep(struct wchan *wc)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * Wake up one thread sleeping on a wait channel. Return it, or NULL
+ * if nobody was sleeping.
  */
-void
+struct thread *
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
@@ -1140,10 +1917,11 @@ wchan_wakeone(struct wchan *wc)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1233,29 +2011,40 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Add a TLB shootdown to a cpu's list without interrupting it. It
+ * will be done at the cpu's next IPI, so follow a batch of these with
+ * ipi_send(target, IPI_TLBSHOOTDOWN).
+ */
 void
-ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
+ipi_tlbshootdown_queue(unsigned targetcpu, const struct tlbshootdown *mapping)
 {
-        int n;
-        struct cpu *target;
+	int n;
+	struct cpu *target;
+
+	target = cpuarray_get(&allcpus, targetcpu);
 
-        target = cpuarray_get(&allcpus, targetcpu);
+	spinlock_acquire(&target->c_ipi_lock);
 
-        spinlock_acquire(&target->c_ipi_lock);
+	n = target->c_numshootdown;
+	if (n == TLBSHOOTDOWN_MAX || n == TLBSHOOTDOWN_ALL) {
+		target->c_numshootdown = TLBSHOOTDOWN_ALL;
+	}
+	else {
+		target->c_shootdown[n] = *mapping;
+		target->c_numshootdown = n+1;
+	}
 
-        n = target->c_numshootdown;
-        if (n == TLBSHOOTDOWN_MAX) {
-                target->c_numshootdown = TLBSHOOTDOWN_ALL;
-        }
-        else {
-                target->c_shootdown[n] = *mapping;
-                target->c_numshootdown = n+1;
-        }
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 
-        target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-        mainbus_send_ipi(target);
+	spinlock_release(&target->c_ipi_lock);
+}
 
-        spinlock_release(&target->c_ipi_lock);
+void
+ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
+{
+	ipi_tlbshootdown_queue(targetcpu, mapping);
+	ipi_send(cpuarray_get(&allcpus, targetcpu), IPI_TLBSHOOTDOWN);
 }
 
 void
@@ -0,0 +1,289 @@
+/*
+ * Name lookup cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or to
+ * nothing for names known not to exist ("negative" entries), so that
+ * looking up the same names over and over doesn't have to search the
+ * directory on disk each time. Filesystems use it from their lookup
+ * routine and must remove entries whenever they add, remove, or
+ * rename a name.
+ *
+ * An entry holds a reference to both its directory and its vnode, so
+ * neither can be reclaimed (and have its address reused) while the
+ * entry exists. The cache is a fixed pool of NAMECACHE_SIZE entries
+ * recycled in LRU order; long names aren't cached at all.
+ *
+ * Everything here runs under the vfs big lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define NAMECACHE_SIZE		128	/* entries */
+#define NAMECACHE_HASHSIZE	64	/* buckets; must be a power of 2 */
+#define NAMECACHE_NAMELEN	32	/* longest name cached, plus 1 */
+
+struct ncentry {
+	struct ncentry *nc_hashnext;	/* next in hash bucket */
+	struct ncentry *nc_lruprev;	/* LRU list, most recent at head */
+	struct ncentry *nc_lrunext;
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* what NAME is, or NULL if nothing */
+	char nc_name[NAMECACHE_NAMELEN];
+};
+
+static struct ncentry nc_pool[NAMECACHE_SIZE];
+static struct ncentry *nc_hash[NAMECACHE_HASHSIZE];
+static struct ncentry nc_lru;		/* list head; not a real entry */
+
+static unsigned nc_hits, nc_neghits, nc_misses;
+
+/*
+ * LRU list operations.
+ */
+
+static
+void
+nc_lru_remove(struct ncentry *e)
+{
+	e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+}
+
+static
+void
+nc_lru_addhead(struct ncentry *e)
+{
+	e->nc_lruprev = &nc_lru;
+	e->nc_lrunext = nc_lru.nc_lrunext;
+	nc_lru.nc_lrunext->nc_lruprev = e;
+	nc_lru.nc_lrunext = e;
+}
+
+static
+void
+nc_lru_addtail(struct ncentry *e)
+{
+	e->nc_lrunext = &nc_lru;
+	e->nc_lruprev = nc_lru.nc_lruprev;
+	nc_lru.nc_lruprev->nc_lrunext = e;
+	nc_lru.nc_lruprev = e;
+}
+
+/*
+ * Hash table operations.
+ */
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h & (NAMECACHE_HASHSIZE - 1);
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+
+	for (e = nc_hash[nc_hashfunc(dir, name)]; e != NULL;
+	     e = e->nc_hashnext) {
+		if (e->nc_dir == dir && !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+nc_unhash(struct ncentry *e)
+{
+	struct ncentry **pp;
+
+	pp = &nc_hash[nc_hashfunc(e->nc_dir, e->nc_name)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = e->nc_hashnext;
+	e->nc_hashnext = NULL;
+}
+
+/*
+ * Empty an entry, dropping its references, and put it at the LRU
+ * tail to be used next.
+ */
+static
+void
+nc_free(struct ncentry *e)
+{
+	struct vnode *dir, *vn;
+
+	KASSERT(e->nc_dir != NULL);
+
+	nc_unhash(e);
+	dir = e->nc_dir;
+	vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+	nc_lru_remove(e);
+	nc_lru_addtail(e);
+
+	/* last, since these may reclaim the vnodes */
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	VOP_DECREF(dir);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Setup function. Called from vfs_bootstrap.
+ */
+void
+vfs_namecache_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lru.nc_lruprev = nc_lru.nc_lrunext = &nc_lru;
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		nc_pool[i].nc_hashnext = NULL;
+		nc_pool[i].nc_dir = NULL;
+		nc_pool[i].nc_vn = NULL;
+		nc_lru_addtail(&nc_pool[i]);
+	}
+	for (i=0; i<NAMECACHE_HASHSIZE; i++) {
+		nc_hash[i] = NULL;
+	}
+}
+
+/*
+ * Look up NAME in DIR. Returns false if the cache doesn't know.
+ * Otherwise returns true, with *RET set to the vnode (with a new
+ * reference) or to NULL if the name doesn't exist.
+ */
+bool
+vfs_namecache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *e;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= NAMECACHE_NAMELEN) {
+		return false;
+	}
+
+	e = nc_find(dir, name);
+	if (e == NULL) {
+		nc_misses++;
+		return false;
+	}
+
+	nc_lru_remove(e);
+	nc_lru_addhead(e);
+
+	if (e->nc_vn != NULL) {
+		VOP_INCREF(e->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = e->nc_vn;
+	return true;
+}
+
+/*
+ * Record that NAME in DIR is VN, or that it doesn't exist if VN is
+ * NULL. Replaces whatever was there before.
+ */
+void
+vfs_namecache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *e;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= NAMECACHE_NAMELEN) {
+		return;
+	}
+
+	e = nc_find(dir, name);
+	if (e == NULL) {
+		e = nc_lru.nc_lruprev;
+		KASSERT(e != &nc_lru);
+	}
+	if (e->nc_dir != NULL) {
+		nc_free(e);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_dir = dir;
+	e->nc_vn = vn;
+	strcpy(e->nc_name, name);
+
+	e->nc_hashnext = nc_hash[nc_hashfunc(dir, name)];
+	nc_hash[nc_hashfunc(dir, name)] = e;
+	nc_lru_remove(e);
+	nc_lru_addhead(e);
+}
+
+/*
+ * Forget about NAME in DIR.
+ */
+void
+vfs_namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	e = nc_find(dir, name);
+	if (e != NULL) {
+		nc_free(e);
+	}
+}
+
+/*
+ * Forget everything about filesystem FS, so its vnodes can be let go
+ * before it's unmounted.
+ */
+void
+vfs_namecache_purgefs(struct fs *fs)
+{
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		if (nc_pool[i].nc_dir != NULL &&
+		    nc_pool[i].nc_dir->vn_fs == fs) {
+			nc_free(&nc_pool[i]);
+		}
+	}
+}
+
+/*
+ * Get the hit and miss counts since boot.
+ */
+void
+vfs_namecache_stats(unsigned *hits, unsigned *neghits, unsigned *misses)
+{
+	*hits = nc_hits;
+	*neghits = nc_neghits;
+	*misses = nc_misses;
+}
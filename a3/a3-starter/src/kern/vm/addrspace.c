@@ -34,8 +34,12 @@
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <pid.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -55,9 +59,54 @@
 
 DEFARRAY_BYTYPE(vm_object_array, struct vm_object, /*noinline*/);
 
+/*
+ * Resident-set and working-set accounting.
+ *
+ * The coremap tells us (as_rss_adjust) whenever one of our pages
+ * becomes resident or stops being, so as_rss is the resident-set
+ * size.
+ *
+ * The MIPS has no reference bits, but with a software-refilled TLB
+ * every TLB miss comes through as_fault, and the TLB is flushed when
+ * we're switched out, so faults are a fair sample of the pages a
+ * process is using. Time is cut into intervals of WS_INTERVAL
+ * hardclocks; the pages faulted on during an interval are counted
+ * (each lpage remembers the last interval it was faulted in, so it's
+ * counted once) and when the interval ends the count is averaged
+ * into the working-set estimate as_ws. A page not faulted on in this
+ * interval or the last is outside the working set.
+ *
+ * Each address space may have a soft limit on its RSS. Nothing stops
+ * it growing past the limit, but page replacement prefers pages of
+ * address spaces that are over their limits, then pages outside
+ * their working sets, so one hog (e.g. "hog" or "guzzle") pages
+ * against itself rather than pushing everyone else out.
+ */
+
+#define WS_INTERVAL	(HZ/4)
+
+/* All address spaces, for as_printrss and as_setrsslimit. */
+static struct addrspace *as_list;
+static struct spinlock as_listlock = SPINLOCK_INITIALIZER;
+
+/* RSS soft limit given to new address spaces; under as_listlock. */
+static unsigned as_rsslimit_default = 0;
+
+/*
+ * Current time for the working-set intervals. Each cpu counts its own
+ * hardclocks, but they all tick at the same rate, so this is good
+ * enough.
+ */
+static
+unsigned
+as_now(void)
+{
+	return CURCPU_EXISTS() ? curcpu->c_hardclocks : 0;
+}
+
 /*
  * as_create - create an address space structure.
- * Synchronization: none.
+ * Synchronization: takes as_listlock to add it to the list.
  */
 struct addrspace *
 as_create(void)
@@ -75,6 +124,28 @@ as_create(void)
 		return NULL;
 	}
 
+	spinlock_init(&as->as_vmlock);
+	as->as_pid = INVALID_PID;
+	as->as_rss = 0;
+	as->as_nfaults = 0;
+	as->as_nmajfaults = 0;
+	as->as_wsepoch = 0;
+	as->as_wsstart = as_now();
+	as->as_wsrefs = 0;
+	as->as_wsfaults = 0;
+	as->as_ws = 0;
+	as->as_lastfaults = 0;
+
+	spinlock_acquire(&as_listlock);
+	as->as_rsslimit = as_rsslimit_default;
+	as->as_prev = NULL;
+	as->as_next = as_list;
+	if (as_list != NULL) {
+		as_list->as_prev = as;
+	}
+	as_list = as;
+	spinlock_release(&as_listlock);
+
 	return as;
 }
 
@@ -109,6 +180,8 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 
 	KASSERT(as == curthread->t_addrspace);
 
+	/* The child inherits our RSS limit. */
+	newas->as_rsslimit = as->as_rsslimit;
 
 	/* copy the vmos */
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
@@ -148,6 +221,7 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 	struct lpage *lp;
 	vaddr_t bot=0, top;
 	unsigned i, index;
+	bool major;
 	int result;
 
 	/* Find the vm_object concerned */
@@ -174,13 +248,18 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 
 	if (lp == NULL) {
 		/* zerofill page */
-		result = lpage_zerofill(&lp);
+		result = lpage_zerofill(as, &lp);
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
 		lpage_array_set(faultobj->vmo_lpages, index, lp);
 	}
+
+	/* Unlocked peek; it's only for the statistics. */
+	major = (lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR;
+	as_reference(as, lp, major);
+	thread_acct_fault(major);
 	
 	return lpage_fault(lp, as, faulttype, va);
 }
@@ -202,6 +281,24 @@ as_destroy(struct addrspace *as)
 
 	vm_object_array_setsize(as->as_objects, 0);
 	vm_object_array_destroy(as->as_objects);
+
+	/* Destroying the lpages released all our pages. */
+	KASSERT(as->as_rss == 0);
+
+	spinlock_acquire(&as_listlock);
+	if (as->as_prev != NULL) {
+		as->as_prev->as_next = as->as_next;
+	}
+	else {
+		KASSERT(as_list == as);
+		as_list = as->as_next;
+	}
+	if (as->as_next != NULL) {
+		as->as_next->as_prev = as->as_prev;
+	}
+	spinlock_release(&as_listlock);
+
+	spinlock_cleanup(&as->as_vmlock);
 	kfree(as);
 }
 
@@ -216,6 +313,10 @@ void
 as_activate(struct addrspace *as)
 {
 	KASSERT(as==NULL || as==curthread->t_addrspace);
+	if (as != NULL) {
+		/* Remember who we belong to, for as_printrss. */
+		as->as_pid = curthread->t_pid;
+	}
 	mmu_setas(as);
 }
 
@@ -354,3 +455,157 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	
 	return 0;
 }
+
+/*
+ * as_rss_adjust: count DELTA pages becoming resident (or not) in AS.
+ *
+ * Synchronization: takes as_vmlock. Does not block. Called from the
+ * coremap, possibly with coremap locks held; as_vmlock is a leaf.
+ */
+void
+as_rss_adjust(struct addrspace *as, int delta)
+{
+	KASSERT(as != NULL);
+
+	spinlock_acquire(&as->as_vmlock);
+	KASSERT(delta >= 0 || as->as_rss >= (unsigned)-delta);
+	as->as_rss += delta;
+	spinlock_release(&as->as_vmlock);
+}
+
+/*
+ * as_reference: record a fault on LP in AS. Ends the working-set
+ * interval if it has run its course; the estimate is a running
+ * average of the pages referenced per interval, weighted half to the
+ * latest.
+ *
+ * Synchronization: takes as_vmlock. Does not block.
+ */
+void
+as_reference(struct addrspace *as, struct lpage *lp, bool major)
+{
+	unsigned now;
+
+	KASSERT(lp->lp_as == as);
+
+	now = as_now();
+
+	spinlock_acquire(&as->as_vmlock);
+
+	as->as_nfaults++;
+	if (major) {
+		as->as_nmajfaults++;
+	}
+
+	if (now - as->as_wsstart >= WS_INTERVAL) {
+		as->as_ws = (as->as_ws + as->as_wsrefs + 1) / 2;
+		as->as_lastfaults = as->as_wsfaults;
+		as->as_wsrefs = 0;
+		as->as_wsfaults = 0;
+		as->as_wsepoch++;
+		as->as_wsstart = now;
+	}
+
+	as->as_wsfaults++;
+	if (lp->lp_wsepoch != as->as_wsepoch) {
+		lp->lp_wsepoch = as->as_wsepoch;
+		as->as_wsrefs++;
+	}
+
+	spinlock_release(&as->as_vmlock);
+}
+
+/*
+ * as_evict_class: rate LP as a victim for page replacement.
+ *
+ * Synchronization: takes as_vmlock. Does not block. LP's physical
+ * page must be pinned, so LP and its address space stay put.
+ */
+int
+as_evict_class(struct lpage *lp)
+{
+	struct addrspace *as = lp->lp_as;
+	int ret;
+
+	KASSERT(as != NULL);
+
+	spinlock_acquire(&as->as_vmlock);
+	if (as->as_rsslimit > 0 && as->as_rss > as->as_rsslimit) {
+		ret = AS_EVICT_OVERLIMIT;
+	}
+	else if (lp->lp_wsepoch + 1 < as->as_wsepoch) {
+		ret = AS_EVICT_COLD;
+	}
+	else {
+		ret = AS_EVICT_WARM;
+	}
+	spinlock_release(&as->as_vmlock);
+
+	return ret;
+}
+
+/*
+ * as_printrss: print the accounting for every address space. The
+ * fault rate is for the last whole working-set interval.
+ *
+ * Synchronization: takes as_listlock, so prints in polling mode.
+ */
+void
+as_printrss(void)
+{
+	struct addrspace *as;
+	char limbuf[16];
+
+	kprintf("   pid      rss    limit       ws   faults    major   "
+		"faults/s\n");
+
+	spinlock_acquire(&as_listlock);
+	for (as = as_list; as != NULL; as = as->as_next) {
+		if (as->as_rsslimit > 0) {
+			snprintf(limbuf, sizeof(limbuf), "%u",
+				 as->as_rsslimit);
+		}
+		else {
+			strcpy(limbuf, "-");
+		}
+		kprintf("%6d %8u %8s %8u %8lu %8lu %10u\n",
+			(int)as->as_pid, as->as_rss, limbuf, as->as_ws,
+			(unsigned long)as->as_nfaults,
+			(unsigned long)as->as_nmajfaults,
+			as->as_lastfaults * HZ / WS_INTERVAL);
+	}
+	kprintf("default limit: %u pages\n", as_rsslimit_default);
+	spinlock_release(&as_listlock);
+}
+
+/*
+ * as_setrsslimit: set an RSS soft limit.
+ *
+ * Synchronization: takes as_listlock. Does not block.
+ */
+int
+as_setrsslimit(pid_t pid, unsigned npages)
+{
+	struct addrspace *as;
+	int result;
+
+	spinlock_acquire(&as_listlock);
+	if (pid == INVALID_PID) {
+		as_rsslimit_default = npages;
+		result = 0;
+	}
+	else {
+		result = ESRCH;
+		for (as = as_list; as != NULL; as = as->as_next) {
+			if (as->as_pid == pid) {
+				spinlock_acquire(&as->as_vmlock);
+				as->as_rsslimit = npages;
+				spinlock_release(&as->as_vmlock);
+				result = 0;
+			}
+		}
+	}
+	spinlock_release(&as_listlock);
+
+	return result;
+}
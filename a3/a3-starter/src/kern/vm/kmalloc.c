@@ -30,8 +30,14 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <kmem.h>
 #include <vm.h>
 
+#include "opt-kheapprof.h"
+
 /*
  * Kernel malloc.
  */
@@ -51,29 +57,39 @@ fill_deadbeef(void *vptr, size_t len)
 
 ////////////////////////////////////////////////////////////
 //
-// Pool-based subpage allocator.
+// Slab allocator.
 //
 // It works like this:
 //
-//    We allocate one page at a time and fill it with objects of size k,
-//    for various k. Each page has its own freelist, maintained by a
-//    linked list in the first word of each object. Each page also has a
-//    freecount, so we know when the page is completely free and can 
-//    release it.
+//    Each object cache (struct kmem_cache) hands out objects of one
+//    size. We allocate one page ("slab") at a time for a cache and
+//    fill it with objects. Each slab starts with a small header
+//    (struct slab) that points back to the cache and holds the slab's
+//    freelist, maintained by a linked list in the first word of each
+//    free object, and a free count, so we know when the slab is
+//    completely free and can release it.
+//
+//    Because the header is at the start of the page, the slab an
+//    object belongs to is just the object's address rounded down to a
+//    page, so freeing is O(1). It also means subpage objects are never
+//    page-aligned, which is how kfree tells them from whole-page
+//    allocations.
 //
-//    No assumptions are made about the sizes k; they need not be
-//    powers of two. Note, however, that malloc must always return
-//    pointers aligned to the maximum alignment requirements of the
-//    platform; thus block sizes must at least be multiples of 4,
-//    preferably 8. They must also be at least sizeof(struct
-//    freelist). It is only worth defining an additional block size if
-//    more blocks would fit on a page than with the existing block
-//    sizes, and large numbers of items of the new size are allocated.
+//    A cache keeps its slabs with free objects on kc_partial and the
+//    rest on kc_full, under the cache's own lock. In front of that,
+//    each cpu keeps a magazine of a few free objects per cache (see
+//    kmem.h), which is refilled and flushed half a magazine at a time,
+//    so most allocations and frees don't take the cache lock at all.
 //
-//    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    kmalloc uses a fixed set of caches, one per size class. The
+//    sizes need not be powers of two. Note, however, that malloc must
+//    always return pointers aligned to the maximum alignment
+//    requirements of the platform; thus object sizes must be multiples
+//    of 8. They must also be at least sizeof(struct freelist). It is
+//    only worth defining an additional size class if more objects
+//    would fit on a page than with the existing sizes, and large
+//    numbers of items of the new size are allocated. For things
+//    allocated often, a cache of their own is better.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -81,121 +97,85 @@ fill_deadbeef(void *vptr, size_t len)
 
 ////////////////////////////////////////
 
-#if PAGE_SIZE == 4096
-
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
-
-#define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
-
-#elif PAGE_SIZE == 8192
-#error "No support for 8k pages (yet?)"
-#else
-#error "Odd page size"
-#endif
-
-////////////////////////////////////////
-
 struct freelist {
 	struct freelist *next;
 };
 
-struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
-	vaddr_t pageaddr_and_blocktype;
-	uint16_t freelist_offset;
-	uint16_t nfree;
+struct slab {
+	uint32_t sl_magic;		/* SLAB_MAGIC */
+	struct kmem_cache *sl_cache;	/* cache we belong to */
+	struct slab *sl_next;		/* next slab on cache's list */
+	struct slab *sl_prev;		/* previous slab on cache's list */
+	struct freelist *sl_freelist;	/* free objects */
+	unsigned sl_nfree;		/* number of free objects */
 };
 
-#define INVALID_OFFSET   (0xffff)
+#define SLAB_MAGIC		0x51ab51ab
+#define SLAB_HEADER_SIZE	32
+
+#define SLAB_OBJBASE(sl)	((vaddr_t)(sl) + SLAB_HEADER_SIZE)
+#define PTR_TO_SLAB(ptr)	((struct slab *)((vaddr_t)(ptr) & PAGE_FRAME))
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	unsigned kc_perslab;		/* objects per slab */
+	int kc_magix;			/* index into c_kmem[], or -1 */
+	struct spinlock kc_lock;	/* protects the rest */
+	struct slab *kc_partial;	/* slabs with free objects */
+	struct slab *kc_full;		/* slabs without */
+	unsigned kc_nslabs;		/* number of slabs */
+	unsigned kc_nfree;		/* free objects in slabs */
+	struct kmem_cache *kc_next;	/* next on kmem_caches */
+};
 
-#define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
-#define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
-#define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
+#define SLAB_PERSLAB(sz)	((PAGE_SIZE - SLAB_HEADER_SIZE) / (sz))
 
 ////////////////////////////////////////
 
+#if PAGE_SIZE == 4096
+
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * These sizes fill a page (less the slab header) as well as the
+ * powers of two used to fill a headerless page.
  */
+#define NSIZES 8
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
-
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
-
-static
-struct pageref *
-allocpageref(void)
-{
-	unsigned i,j;
-	uint32_t k;
-
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
-	}
-
-	/* ran out */
-	return NULL;
-}
-
-static
-void
-freepageref(struct pageref *p)
-{
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
-}
+#define KMALLOC_CACHE(sz, ix) \
+	{ "kmalloc-" #sz, sz, SLAB_PERSLAB(sz), ix,			\
+	  SPINLOCK_INITIALIZER_NAMED("kmalloc-" #sz),			\
+	  NULL, NULL, 0, 0, NULL }
+
+static struct kmem_cache kmalloc_caches[NSIZES] = {
+	KMALLOC_CACHE(16, 0),
+	KMALLOC_CACHE(32, 1),
+	KMALLOC_CACHE(64, 2),
+	KMALLOC_CACHE(128, 3),
+	KMALLOC_CACHE(256, 4),
+	KMALLOC_CACHE(504, 5),
+	KMALLOC_CACHE(1008, 6),
+	KMALLOC_CACHE(2032, 7),
+};
 
-////////////////////////////////////////
+#define SMALLEST_SUBPAGE_SIZE 16
+#define LARGEST_SUBPAGE_SIZE 2032
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+#elif PAGE_SIZE == 8192
+#error "No support for 8k pages (yet?)"
+#else
+#error "Odd page size"
+#endif
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Caches made with kmem_cache_create, and the number of magazine
+ * slots handed out (the kmalloc caches have the first NSIZES).
  */
-
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+static unsigned kmem_nmags = NSIZES;
+static struct spinlock kmem_caches_lock =
+	SPINLOCK_INITIALIZER_NAMED("kmem_caches_lock");
 
 ////////////////////////////////////////
 
@@ -209,116 +189,93 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 #ifdef SLOW
 static
 void
-checksubpage(struct pageref *pr)
+checkslab(struct kmem_cache *kc, struct slab *sl)
 {
-	vaddr_t prpage, fla;
+	vaddr_t fla;
 	struct freelist *fl;
-	int blktype;
-	int nfree=0;
-
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
-
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		KASSERT(pr->nfree==0);
-		return;
-	}
-
-	prpage = PR_PAGEADDR(pr);
-	blktype = PR_BLOCKTYPE(pr);
-
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
-	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
+	unsigned nfree=0;
 
-	fla = prpage + pr->freelist_offset;
-	fl = (struct freelist *)fla;
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+	KASSERT(sl->sl_magic == SLAB_MAGIC);
+	KASSERT(sl->sl_cache == kc);
+	KASSERT(sl->sl_nfree <= kc->kc_perslab);
 
-	for (; fl != NULL; fl = fl->next) {
+	for (fl = sl->sl_freelist; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
-		KASSERT((fla-prpage) % sizes[blktype] == 0);
+		KASSERT(fla >= SLAB_OBJBASE(sl));
+		KASSERT(fla < SLAB_OBJBASE(sl) + kc->kc_perslab*kc->kc_size);
+		KASSERT((fla - SLAB_OBJBASE(sl)) % kc->kc_size == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
 		nfree++;
 	}
-	KASSERT(nfree==pr->nfree);
+	KASSERT(nfree==sl->sl_nfree);
 }
 #else
-#define checksubpage(pr) ((void)(pr))
+#define checkslab(kc, sl) ((void)(kc), (void)(sl))
 #endif
 
 #ifdef SLOWER
 static
 void
-checksubpages(void)
+checkslabs(struct kmem_cache *kc)
 {
-	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	struct slab *sl;
+	unsigned n=0, nfree=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
 
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
-			sc++;
-		}
+	for (sl = kc->kc_partial; sl != NULL; sl = sl->sl_next) {
+		checkslab(kc, sl);
+		KASSERT(sl->sl_nfree > 0);
+		nfree += sl->sl_nfree;
+		n++;
 	}
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	for (sl = kc->kc_full; sl != NULL; sl = sl->sl_next) {
+		checkslab(kc, sl);
+		KASSERT(sl->sl_nfree == 0);
+		n++;
 	}
-
-	KASSERT(sc==ac);
+	KASSERT(n == kc->kc_nslabs);
+	KASSERT(nfree == kc->kc_nfree);
 }
 #else
-#define checksubpages() 
+#define checkslabs(kc) ((void)(kc))
 #endif
 
 ////////////////////////////////////////
 
 static
 void
-dumpsubpage(struct pageref *pr)
+dumpslab(struct kmem_cache *kc, struct slab *sl)
 {
-	vaddr_t prpage, fla;
+	vaddr_t fla;
 	struct freelist *fl;
-	int blktype;
 	unsigned i, n, index;
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
-	checksubpage(pr);
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	checkslab(kc, sl);
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
 
 	/* clear freemap[] */
 	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
 		freemap[i] = 0;
 	}
 
-	prpage = PR_PAGEADDR(pr);
-	blktype = PR_BLOCKTYPE(pr);
-
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = kc->kc_perslab;
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
-	if (pr->freelist_offset != INVALID_OFFSET) {
-		fla = prpage + pr->freelist_offset;
-		fl = (struct freelist *)fla;
-
-		for (; fl != NULL; fl = fl->next) {
-			fla = (vaddr_t)fl;
-			index = (fla-prpage) / sizes[blktype];
-			KASSERT(index<n);
-			freemap[index/32] |= (1<<(index%32));
-		}
+	for (fl = sl->sl_freelist; fl != NULL; fl = fl->next) {
+		fla = (vaddr_t)fl;
+		index = (fla - SLAB_OBJBASE(sl)) / kc->kc_size;
+		KASSERT(index<n);
+		freemap[index/32] |= (1<<(index%32));
 	}
 
 	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n", 
-		(unsigned long)prpage, (unsigned long) sizes[blktype],
-		(unsigned) pr->nfree, n);
+		(unsigned long)sl, (unsigned long) kc->kc_size,
+		sl->sl_nfree, n);
 	kprintf("   ");
 	for (i=0; i<n; i++) {
 		int val = (freemap[i/32] & (1<<(i%32)))!=0;
@@ -330,278 +287,451 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static
 void
-kheap_printstats(void)
+dumpcache(struct kmem_cache *kc)
 {
-	struct pageref *pr;
+	struct slab *sl;
+
+	spinlock_acquire(&kc->kc_lock);
+	checkslabs(kc);
+	if (kc->kc_nslabs > 0) {
+		kprintf("%s: %u slabs, %u/%u objects free in slabs\n",
+			kc->kc_name, kc->kc_nslabs, kc->kc_nfree,
+			kc->kc_nslabs * kc->kc_perslab);
+	}
+	for (sl = kc->kc_partial; sl != NULL; sl = sl->sl_next) {
+		dumpslab(kc, sl);
+	}
+	for (sl = kc->kc_full; sl != NULL; sl = sl->sl_next) {
+		dumpslab(kc, sl);
+	}
+	spinlock_release(&kc->kc_lock);
+}
 
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
+void
+kheap_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned i;
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (i=0; i<NSIZES; i++) {
+		dumpcache(&kmalloc_caches[i]);
 	}
 
-	spinlock_release(&kmalloc_spinlock);
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		dumpcache(kc);
+	}
+	spinlock_release(&kmem_caches_lock);
 }
 
 ////////////////////////////////////////
 
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+slab_link(struct slab **list, struct slab *sl)
 {
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
-
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
 	}
+	*list = sl;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+static
+void
+slab_unlink(struct slab **list, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*list == sl);
+		*list = sl->sl_next;
 	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
 }
 
+/*
+ * slab_checkptr: make sure PTR is the start of an object in slab SL.
+ */
 static
-inline
-int blocktype(size_t sz)
+void
+slab_checkptr(struct kmem_cache *kc, struct slab *sl, void *ptr)
 {
-	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (sz <= sizes[i]) {
-			return i;
-		}
-	}
+	vaddr_t offset;
 
-	panic("Subpage allocator cannot handle allocation of size %lu\n", 
-	      (unsigned long)sz);
+	if (sl->sl_magic != SLAB_MAGIC || sl->sl_cache != kc) {
+		panic("kfree: free of invalid addr %p\n", ptr);
+	}
 
-	// keep compiler happy
-	return 0;
+	/* Check for proper positioning and alignment */
+	offset = (vaddr_t)ptr - SLAB_OBJBASE(sl);
+	if ((vaddr_t)ptr < SLAB_OBJBASE(sl) ||
+	    offset >= kc->kc_perslab * kc->kc_size ||
+	    offset % kc->kc_size != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
 }
 
+/*
+ * slab_grow: get a fresh page and add it to the cache as a slab.
+ *
+ * Called without the cache lock held. This avoids deadlock if
+ * alloc_kpages needs to come back here, and lets alloc_kpages sleep.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+int
+slab_grow(struct kmem_cache *kc)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	vaddr_t page;
+	struct slab *sl;
+	struct freelist *volatile fl;
+	volatile unsigned i;
 
-	volatile int i;
+	COMPILE_ASSERT(sizeof(struct slab) <= SLAB_HEADER_SIZE);
+	KASSERT(!spinlock_do_i_hold(&kc->kc_lock));
 
+	page = alloc_kpages(1);
+	if (page==0) {
+		/* Out of memory. */
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
+		return -1;
+	}
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	sl = (struct slab *)page;
+	sl->sl_magic = SLAB_MAGIC;
+	sl->sl_cache = kc;
+	sl->sl_nfree = kc->kc_perslab;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	/*
+	 * Note: fl is volatile because the MIPS toolchain we were
+	 * using in spring 2001 attempted to optimize this loop and
+	 * blew it. Making fl volatile inhibits the optimization.
+	 *
+	 * Build the list backwards so objects get handed out in
+	 * address order.
+	 */
+	sl->sl_freelist = NULL;
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		fl = (struct freelist *)(SLAB_OBJBASE(sl) + i*kc->kc_size);
+		fl->next = sl->sl_freelist;
+		sl->sl_freelist = fl;
+	}
+	KASSERT((vaddr_t)sl->sl_freelist == SLAB_OBJBASE(sl));
 
-	checksubpages();
+	spinlock_acquire(&kc->kc_lock);
+	slab_link(&kc->kc_partial, sl);
+	kc->kc_nslabs++;
+	kc->kc_nfree += kc->kc_perslab;
+	checkslabs(kc);
+	spinlock_release(&kc->kc_lock);
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	return 0;
+}
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+/*
+ * slab_getobj: take a free object from one of the cache's slabs.
+ * Returns NULL if there aren't any.
+ */
+static
+void *
+slab_getobj(struct kmem_cache *kc)
+{
+	struct slab *sl;
+	struct freelist *fl;
 
-		if (pr->nfree > 0) {
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
 
-		doalloc: /* comes here after getting a whole fresh page */
+	sl = kc->kc_partial;
+	if (sl == NULL) {
+		return NULL;
+	}
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	/* check for corruption */
+	checkslab(kc, sl);
+	KASSERT(sl->sl_nfree > 0);
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	fl = sl->sl_freelist;
+	sl->sl_freelist = fl->next;
+	sl->sl_nfree--;
+	kc->kc_nfree--;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	if (sl->sl_nfree == 0) {
+		KASSERT(sl->sl_freelist == NULL);
+		slab_unlink(&kc->kc_partial, sl);
+		slab_link(&kc->kc_full, sl);
+	}
 
-			checksubpages();
+	return fl;
+}
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
-	}
+/*
+ * slab_putobj: give an object back to its slab. If that leaves the
+ * slab completely free, take it off the cache and return it, so the
+ * caller can free the page once it's dropped the lock.
+ */
+static
+struct slab *
+slab_putobj(struct kmem_cache *kc, void *ptr)
+{
+	struct slab *sl;
+	struct freelist *fl;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	sl = PTR_TO_SLAB(ptr);
+	checkslab(kc, sl);
 
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
-	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
-	}
-	spinlock_acquire(&kmalloc_spinlock);
+	fl = ptr;
+	fl->next = sl->sl_freelist;
+	sl->sl_freelist = fl;
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+	if (sl->sl_nfree == 0) {
+		slab_unlink(&kc->kc_full, sl);
+		slab_link(&kc->kc_partial, sl);
+	}
+	sl->sl_nfree++;
+	kc->kc_nfree++;
+
+	KASSERT(sl->sl_nfree <= kc->kc_perslab);
+	if (sl->sl_nfree == kc->kc_perslab) {
+		/* Whole slab is free. */
+		slab_unlink(&kc->kc_partial, sl);
+		kc->kc_nslabs--;
+		kc->kc_nfree -= kc->kc_perslab;
+		sl->sl_magic = 0;
+		return sl;
 	}
+	return NULL;
+}
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+/*
+ * slab_alloc: allocate an object straight from the slabs, growing the
+ * cache if necessary.
+ */
+static
+void *
+slab_alloc(struct kmem_cache *kc)
+{
+	void *ptr;
 
-	/*
-	 * Note: fl is volatile because the MIPS toolchain we were
-	 * using in spring 2001 attempted to optimize this loop and
-	 * blew it. Making fl volatile inhibits the optimization.
-	 */
+	while (1) {
+		spinlock_acquire(&kc->kc_lock);
+		checkslabs(kc);
+		ptr = slab_getobj(kc);
+		spinlock_release(&kc->kc_lock);
+
+		if (ptr != NULL) {
+			return ptr;
+		}
 
-	fla = prpage;
-	fl = (struct freelist *)fla;
-	fl->next = NULL;
-	for (i=1; i<pr->nfree; i++) {
-		fl = (struct freelist *)(fla + i*sizes[blktype]);
-		fl->next = (struct freelist *)(fla + (i-1)*sizes[blktype]);
-		KASSERT(fl != fl->next);
+		/*
+		 * No slab with free objects. Make a new one. Things
+		 * can change behind our back while we do, so go
+		 * around again rather than assuming we get the new
+		 * slab's objects.
+		 */
+		if (slab_grow(kc)) {
+			return NULL;
+		}
 	}
-	fla = (vaddr_t) fl;
-	pr->freelist_offset = fla - prpage;
-	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
+}
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+////////////////////////////////////////
 
-	pr->next_all = allbase;
-	allbase = pr;
+/*
+ * kmem_cpu_init: set up a new cpu's (empty) magazines.
+ */
+void
+kmem_cpu_init(struct cpu *c)
+{
+	unsigned i;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	for (i=0; i<KMEM_NMAGS; i++) {
+		c->c_kmem[i].km_num = 0;
+	}
 }
 
-static
-int
-subpage_kfree(void *ptr)
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
+	struct kmem_cache *kc;
 
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
+	if (size < sizeof(struct freelist)) {
+		size = sizeof(struct freelist);
+	}
+	size = ROUNDUP(size, 8);
+	if (size > LARGEST_SUBPAGE_SIZE) {
+		panic("kmem_cache_create: %s: cannot handle objects of "
+		      "size %lu\n", name, (unsigned long)size);
+	}
 
-	checksubpages();
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_perslab = SLAB_PERSLAB(size);
+	spinlock_init(&kc->kc_lock);
+	spinlock_setname(&kc->kc_lock, name);
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nfree = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_magix = kmem_nmags < KMEM_NMAGS ? (int)kmem_nmags++ : -1;
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	void *ptr;
+	int spl;
+
+	if (kc->kc_magix >= 0 && CURCPU_EXISTS()) {
+		/* With interrupts off, curcpu can't change under us. */
+		spl = splhigh();
+		mag = &curcpu->c_kmem[kc->kc_magix];
+
+		if (mag->km_num == 0) {
+			/* Refill half the magazine in one go. */
+			spinlock_acquire(&kc->kc_lock);
+			checkslabs(kc);
+			while (mag->km_num < KMEM_MAGSIZE/2) {
+				ptr = slab_getobj(kc);
+				if (ptr == NULL) {
+					break;
+				}
+				mag->km_objs[mag->km_num++] = ptr;
+			}
+			spinlock_release(&kc->kc_lock);
+		}
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		if (mag->km_num > 0) {
+			ptr = mag->km_objs[--mag->km_num];
+			splx(spl);
+			return ptr;
 		}
+		splx(spl);
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+	return slab_alloc(kc);
+}
 
-	offset = ptraddr - prpage;
+void
+kmem_cache_free(struct kmem_cache *kc, void *ptr)
+{
+	struct kmem_magazine *mag;
+	struct slab *sl;
+	struct slab *empty[KMEM_MAGSIZE/2];
+	unsigned i, nempty;
+	int spl;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
+	slab_checkptr(kc, PTR_TO_SLAB(ptr), ptr);
 
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	fill_deadbeef(ptr, kc->kc_size);
+
+	nempty = 0;
+	if (kc->kc_magix >= 0 && CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &curcpu->c_kmem[kc->kc_magix];
+
+		if (mag->km_num == KMEM_MAGSIZE) {
+			/* Flush the older half of the magazine in one go. */
+			spinlock_acquire(&kc->kc_lock);
+			for (i=0; i<KMEM_MAGSIZE/2; i++) {
+				sl = slab_putobj(kc, mag->km_objs[i]);
+				if (sl != NULL) {
+					empty[nempty++] = sl;
+				}
+			}
+			checkslabs(kc);
+			spinlock_release(&kc->kc_lock);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+			for (i=KMEM_MAGSIZE/2; i<KMEM_MAGSIZE; i++) {
+				mag->km_objs[i - KMEM_MAGSIZE/2] =
+					mag->km_objs[i];
+			}
+			mag->km_num -= KMEM_MAGSIZE/2;
+		}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+		mag->km_objs[mag->km_num++] = ptr;
+		splx(spl);
+	}
+	else {
+		spinlock_acquire(&kc->kc_lock);
+		sl = slab_putobj(kc, ptr);
+		if (sl != NULL) {
+			empty[nempty++] = sl;
+		}
+		checkslabs(kc);
+		spinlock_release(&kc->kc_lock);
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	/* Call free_kpages without any spinlocks held. */
+	for (i=0; i<nempty; i++) {
+		free_kpages((vaddr_t)empty[i]);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+}
+
+////////////////////////////////////////
+
+static
+inline
+int blocktype(size_t sz)
+{
+	unsigned i;
+	for (i=0; i<NSIZES; i++) {
+		if (sz <= kmalloc_caches[i].kc_size) {
+			return i;
+		}
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	panic("Subpage allocator cannot handle allocation of size %lu\n", 
+	      (unsigned long)sz);
 
+	// keep compiler happy
 	return 0;
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * The allocator proper, without profiling.
+ */
+
+static
 void *
-kmalloc(size_t sz)
+kmalloc_raw(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
+	if (sz>LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -615,20 +745,395 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return kmem_cache_alloc(&kmalloc_caches[blocktype(sz)]);
 }
 
+static
 void
-kfree(void *ptr)
+kfree_raw(void *ptr)
 {
+	struct slab *sl;
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Subpage objects are never page-aligned (the slab header is
+	 * at the start of the page); anything else is a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+	if ((vaddr_t)ptr%PAGE_SIZE==0) {
 		free_kpages((vaddr_t)ptr);
+	} else {
+		sl = PTR_TO_SLAB(ptr);
+		if (sl->sl_magic != SLAB_MAGIC) {
+			panic("kfree: free of invalid addr %p\n", ptr);
+		}
+		kmem_cache_free(sl->sl_cache, ptr);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation-site profiling (options kheapprof).
+//
+// Each kmalloc'd block gets a small tag in front of it naming the
+// site that allocated it and the size asked for. A site is the return
+// address in kmalloc's caller plus the size class the block landed in
+// (-1 for whole pages), so a caller that asks for varying sizes shows
+// up once per class. Allocations made through wrappers such as
+// kstrdup are charged to the wrapper.
+//
+// For each site we count allocations and frees, the bytes asked for
+// that are still live and the most that ever were, and the bytes the
+// live blocks really use (size class and tag included); the
+// difference is the slack lost to rounding up.
+//
+// Sites live in a fixed open-addressed table and are never removed,
+// so a site's index is stable; that lets a snapshot be compared with
+// the current table slot by slot to find what a test run leaked. If
+// the table fills, further sites are lumped into slot 0.
+//
+// The tag's first word never matches SLAB_MAGIC, so a tagged
+// whole-page block (which starts with its tag) can't be mistaken for
+// a slab; and objects from kmem_cache_create caches, which are not
+// tagged, are told apart by their slab not belonging to kmalloc.
+//
+
+#if OPT_KHEAPPROF
+
+struct kheaptag {
+	uint32_t kt_site;		/* KHEAPTAG_MAGIC | site index */
+	uint32_t kt_size;		/* size asked for */
+};
+
+#define KHEAPTAG_MAGIC		0x4b480000
+#define KHEAPTAG_MAGICMASK	0xffff0000
+
+struct kheapsite {
+	vaddr_t ks_caller;		/* 0 if slot unused */
+	int ks_class;			/* index into kmalloc_caches, or -1 */
+	unsigned ks_nalloc;		/* total allocations */
+	unsigned ks_nfree;		/* total frees */
+	size_t ks_live;			/* bytes asked for and not freed */
+	size_t ks_peak;			/* high-water mark of ks_live */
+	size_t ks_used;			/* bytes the live blocks occupy */
+};
+
+#define KHEAPPROF_NSITES	256	/* must be a power of 2 */
+
+static struct kheapsite kheapprof_sites[KHEAPPROF_NSITES];
+static struct spinlock kheapprof_lock = SPINLOCK_INITIALIZER;
+
+/* Only touched from the menu thread, so no locking. */
+static struct kheapsite kheapprof_snap[KHEAPPROF_NSITES];
+static bool kheapprof_snapvalid;
+static struct kheapsite kheapprof_copy[KHEAPPROF_NSITES];
+static unsigned kheapprof_order[KHEAPPROF_NSITES];
+static long kheapprof_key[KHEAPPROF_NSITES];
+
+/*
+ * Find (or make) the slot for a site. Slot 0 is the overflow slot and
+ * is never handed out by hashing.
+ */
+static
+unsigned
+kheapprof_site(vaddr_t caller, int class)
+{
+	unsigned ix, start;
+	struct kheapsite *ks;
+
+	KASSERT(spinlock_do_i_hold(&kheapprof_lock));
+
+	start = ((caller >> 2) * 31 + class + 1) & (KHEAPPROF_NSITES - 1);
+	ix = start;
+	do {
+		ks = &kheapprof_sites[ix];
+		if (ix != 0) {
+			if (ks->ks_caller == caller && ks->ks_class == class) {
+				return ix;
+			}
+			if (ks->ks_caller == 0) {
+				ks->ks_caller = caller;
+				ks->ks_class = class;
+				return ix;
+			}
+		}
+		ix = (ix + 1) & (KHEAPPROF_NSITES - 1);
+	} while (ix != start);
+
+	return 0;
+}
+
+static
+void *
+kheapprof_alloc(size_t sz, vaddr_t caller)
+{
+	struct kheaptag *kt;
+	struct kheapsite *ks;
+	size_t realsz, used;
+	unsigned ix;
+	int class;
+
+	realsz = sz + sizeof(struct kheaptag);
+	kt = kmalloc_raw(realsz);
+	if (kt == NULL) {
+		return NULL;
+	}
+
+	if (realsz > LARGEST_SUBPAGE_SIZE) {
+		class = -1;
+		used = ROUNDUP(realsz, PAGE_SIZE);
+	}
+	else {
+		class = blocktype(realsz);
+		used = kmalloc_caches[class].kc_size;
+	}
+
+	spinlock_acquire(&kheapprof_lock);
+	ix = kheapprof_site(caller, class);
+	ks = &kheapprof_sites[ix];
+	ks->ks_nalloc++;
+	ks->ks_live += sz;
+	ks->ks_used += used;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+	spinlock_release(&kheapprof_lock);
+
+	kt->kt_site = KHEAPTAG_MAGIC | ix;
+	kt->kt_size = sz;
+	return kt + 1;
+}
+
+/*
+ * Uncharge a block from its site. Returns the pointer the allocator
+ * proper handed out.
+ */
+static
+void *
+kheapprof_free(void *ptr)
+{
+	struct kheaptag *kt;
+	struct kheapsite *ks;
+	struct slab *sl;
+	size_t realsz, used;
+	unsigned ix;
+
+	if ((vaddr_t)ptr%PAGE_SIZE != 0) {
+		sl = PTR_TO_SLAB(ptr);
+		if (sl->sl_magic == SLAB_MAGIC &&
+		    (sl->sl_cache < &kmalloc_caches[0] ||
+		     sl->sl_cache >= &kmalloc_caches[NSIZES])) {
+			/* Object from kmem_cache_create; not tagged. */
+			return ptr;
+		}
+	}
+
+	kt = (struct kheaptag *)ptr - 1;
+	if ((kt->kt_site & KHEAPTAG_MAGICMASK) != KHEAPTAG_MAGIC) {
+		panic("kfree: free of invalid addr %p\n", ptr);
+	}
+	ix = kt->kt_site & ~KHEAPTAG_MAGICMASK;
+	KASSERT(ix < KHEAPPROF_NSITES);
+
+	realsz = kt->kt_size + sizeof(struct kheaptag);
+	if (realsz > LARGEST_SUBPAGE_SIZE) {
+		used = ROUNDUP(realsz, PAGE_SIZE);
+	}
+	else {
+		used = kmalloc_caches[blocktype(realsz)].kc_size;
+	}
+
+	spinlock_acquire(&kheapprof_lock);
+	ks = &kheapprof_sites[ix];
+	KASSERT(ks->ks_live >= kt->kt_size);
+	ks->ks_nfree++;
+	ks->ks_live -= kt->kt_size;
+	ks->ks_used -= used;
+	spinlock_release(&kheapprof_lock);
+
+	/* Catch double frees of whole-page blocks. */
+	kt->kt_site = 0;
+	return kt;
+}
+
+/*
+ * Sort the first N entries of kheapprof_order by kheapprof_key,
+ * largest first. The table is small, so insertion sort does.
+ */
+static
+void
+kheapprof_sort(unsigned n)
+{
+	unsigned i, j, ix;
+
+	for (i=1; i<n; i++) {
+		ix = kheapprof_order[i];
+		for (j=i; j>0; j--) {
+			if (kheapprof_key[kheapprof_order[j-1]] >=
+			    kheapprof_key[ix]) {
+				break;
+			}
+			kheapprof_order[j] = kheapprof_order[j-1];
+		}
+		kheapprof_order[j] = ix;
 	}
 }
 
+static
+void
+kheapprof_getsites(struct kheapsite *dest)
+{
+	unsigned i;
+
+	spinlock_acquire(&kheapprof_lock);
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		dest[i] = kheapprof_sites[i];
+	}
+	spinlock_release(&kheapprof_lock);
+}
+
+static
+void
+kheapprof_printsite(unsigned ix, const struct kheapsite *ks)
+{
+	if (ix == 0) {
+		kprintf("  (other)   ");
+	}
+	else {
+		kprintf("  0x%08lx", (unsigned long)ks->ks_caller);
+	}
+	if (ks->ks_class < 0) {
+		kprintf("  page");
+	}
+	else {
+		kprintf(" %5lu",
+			(unsigned long)kmalloc_caches[ks->ks_class].kc_size);
+	}
+}
+
+/*
+ * Print the NUM sites with the most live bytes.
+ */
+void
+kheap_printsites(unsigned num)
+{
+	struct kheapsite *ks;
+	unsigned i, n;
+	size_t live, used;
+
+	kheapprof_getsites(kheapprof_copy);
+
+	n = 0;
+	live = used = 0;
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		ks = &kheapprof_copy[i];
+		if (ks->ks_nalloc == 0) {
+			continue;
+		}
+		kheapprof_order[n++] = i;
+		kheapprof_key[i] = ks->ks_live;
+		live += ks->ks_live;
+		used += ks->ks_used;
+	}
+	kheapprof_sort(n);
+
+	kprintf("Kernel heap: %u sites, %lu bytes live, %lu bytes used\n",
+		n, (unsigned long)live, (unsigned long)used);
+	kprintf("  caller      size   allocs    frees     live     peak"
+		"    slack\n");
+	for (i=0; i<n && i<num; i++) {
+		ks = &kheapprof_copy[kheapprof_order[i]];
+		kheapprof_printsite(kheapprof_order[i], ks);
+		kprintf(" %8u %8u %8lu %8lu %8lu\n",
+			ks->ks_nalloc, ks->ks_nfree,
+			(unsigned long)ks->ks_live,
+			(unsigned long)ks->ks_peak,
+			(unsigned long)(ks->ks_used - ks->ks_live));
+	}
+}
+
+/*
+ * Remember the current state of every site, for kheap_printdiff.
+ */
+void
+kheap_snapshot(void)
+{
+	kheapprof_getsites(kheapprof_snap);
+	kheapprof_snapvalid = true;
+}
+
+/*
+ * Print the NUM sites whose live bytes grew the most since the last
+ * kheap_snapshot; after a test that should clean up after itself,
+ * these are the leaks. Sites that shrank are listed too (after the
+ * ones that grew), as they may be freeing something leaked earlier.
+ */
+void
+kheap_printdiff(unsigned num)
+{
+	struct kheapsite *ks, *old;
+	unsigned i, n;
+	long dlive, dcount, totlive, totcount;
+
+	if (!kheapprof_snapvalid) {
+		kprintf("kheap_printdiff: no snapshot taken\n");
+		return;
+	}
+
+	kheapprof_getsites(kheapprof_copy);
+
+	n = 0;
+	totlive = totcount = 0;
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		ks = &kheapprof_copy[i];
+		old = &kheapprof_snap[i];
+		dlive = (long)ks->ks_live - (long)old->ks_live;
+		dcount = (long)(ks->ks_nalloc - ks->ks_nfree) -
+			(long)(old->ks_nalloc - old->ks_nfree);
+		if (dlive == 0 && dcount == 0) {
+			continue;
+		}
+		kheapprof_order[n++] = i;
+		kheapprof_key[i] = dlive;
+		totlive += dlive;
+		totcount += dcount;
+	}
+	kheapprof_sort(n);
+
+	kprintf("Kernel heap since snapshot: %ld bytes in %ld blocks "
+		"at %u sites\n", totlive, totcount, n);
+	kprintf("  caller      size   blocks    bytes\n");
+	for (i=0; i<n && i<num; i++) {
+		ks = &kheapprof_copy[kheapprof_order[i]];
+		old = &kheapprof_snap[kheapprof_order[i]];
+		kheapprof_printsite(kheapprof_order[i], ks);
+		kprintf(" %8ld %8ld\n",
+			(long)(ks->ks_nalloc - ks->ks_nfree) -
+			(long)(old->ks_nalloc - old->ks_nfree),
+			kheapprof_key[kheapprof_order[i]]);
+	}
+}
+
+#endif /* OPT_KHEAPPROF */
+
+////////////////////////////////////////////////////////////
+
+void *
+kmalloc(size_t sz)
+{
+#if OPT_KHEAPPROF
+	return kheapprof_alloc(sz, (vaddr_t)__builtin_return_address(0));
+#else
+	return kmalloc_raw(sz);
+#endif
+}
+
+void
+kfree(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+#if OPT_KHEAPPROF
+	ptr = kheapprof_free(ptr);
+#endif
+	kfree_raw(ptr);
+}
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kmem.h>
 #include <spinlock.h>
 #include <synch.h>
 #include <thread.h>
@@ -50,6 +51,9 @@ static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
+/* Object cache for lpages. */
+static struct kmem_cache *lpage_cache;
+
 void
 vm_printstats(void)
 {
@@ -73,15 +77,28 @@ vm_printstats(void)
 }
 
 /*
- * Create a logical page object.
+ * Set up the lpage object cache.
+ * Synchronization: none; runs early in boot.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_cache = kmem_cache_create("lpage", sizeof(struct lpage));
+	if (lpage_cache == NULL) {
+		panic("lpage_bootstrap: Out of memory\n");
+	}
+}
+
+/*
+ * Create a logical page object belonging to address space AS.
  * Synchronization: none.
  */
 struct lpage *
-lpage_create(void)
+lpage_create(struct addrspace *as)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
@@ -89,6 +106,8 @@ lpage_create(void)
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
 	spinlock_init(&lp->lp_spinlock);
+	lp->lp_as = as;
+	lp->lp_wsepoch = 0;
 
 	return lp;
 }
@@ -132,7 +151,7 @@ lpage_destroy(struct lpage *lp)
 	}
 
 	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(lpage_cache, lp);
 }
 
 
@@ -229,21 +248,21 @@ lpage_lock_and_pin(struct lpage *lp)
 }
 
 /*
- * lpage_materialize: create a new lpage and allocate swap and RAM for it.
- * Do not do anything with the page contents though.
+ * lpage_materialize: create a new lpage in AS and allocate swap and RAM
+ * for it. Do not do anything with the page contents though.
  *
  * Returns the lpage locked and the physical page pinned.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct addrspace *as, struct lpage **lpret, paddr_t *paret)
 {
 	struct lpage *lp;
 	paddr_t pa;
 	off_t swa;
 
-	lp = lpage_create();
+	lp = lpage_create(as);
 	if (lp == NULL) {
 		return ENOMEM;
 	}
@@ -274,7 +293,8 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 }
 
 /*
- * lpage_copy: create a new lpage and copy data from another lpage.
+ * lpage_copy: create a new lpage in NEWAS and copy data from another
+ * lpage.
  *
  * The synchronization for this is kind of unpleasant. We do it like
  * this:
@@ -295,14 +315,14 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  *      
  */
 int
-lpage_copy(struct lpage *oldlp, struct lpage **lpret)
+lpage_copy(struct lpage *oldlp, struct addrspace *newas, struct lpage **lpret)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
 	off_t swa;
 	int result;
 
-	result = lpage_materialize(&newlp, &newpa);
+	result = lpage_materialize(newas, &newlp, &newpa);
 	if (result) {
 		return result;
 	}
@@ -370,13 +390,13 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
  * unpinning, so it's safe to take the coremap spinlock.
  */
 int
-lpage_zerofill(struct lpage **lpret)
+lpage_zerofill(struct addrspace *as, struct lpage **lpret)
 {
 	struct lpage *lp;
 	paddr_t pa;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(as, &lp, &pa);
 	if (result) {
 		return result;
 	}
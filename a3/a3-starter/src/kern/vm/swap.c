@@ -142,7 +142,7 @@ swap_bootstrap(void)
 		panic("swap: No memory for swap bitmap\n");
 	}
 
-	swaplock = lock_create("swaplock");
+	swaplock = lock_create_adaptive("swaplock");
 	if (swaplock == NULL) {
 		panic("swap: No memory for swap lock\n");
 	}
@@ -126,7 +126,7 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
+		result = lpage_copy(lp, newas, &newlp);
 		if (result) {
 			goto fail;
 		}
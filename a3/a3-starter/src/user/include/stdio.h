@@ -41,6 +41,71 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Default buffer size for streams */
+#define BUFSIZ 1024
+
+/* Buffering modes for setvbuf */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
+/*
+ * A stdio stream. The buffer holds either output not yet written
+ * (__F_WRITING set) or input read ahead from the file (f_pos up to
+ * f_end not yet consumed). Unbuffered streams use f_ch as a one-byte
+ * buffer.
+ *
+ * The buffering mode is decided the first time the stream is used:
+ * fopen'd files are fully buffered; stdin and stdout are fully
+ * buffered unless they are the console, in which case they are
+ * unbuffered, so output comes out in the same order as from plain
+ * write() and a fork doesn't copy half a line into the child. Even
+ * unbuffered, each printf call does only one write. stderr is always
+ * unbuffered.
+ */
+typedef struct __file {
+	int f_fd;		/* file handle */
+	unsigned f_flags;	/* __F_* below */
+	int f_bufmode;		/* _IOFBF, _IOLBF, or _IONBF */
+	char *f_buf;		/* buffer */
+	size_t f_bufsize;	/* size of f_buf */
+	size_t f_pos;		/* next byte in f_buf to read or fill */
+	size_t f_end;		/* end of read-ahead in f_buf */
+	char f_ch;		/* buffer for unbuffered streams */
+	struct __file *f_next;	/* all open streams, for fflush(NULL) */
+} FILE;
+
+#define __F_READ	0x01	/* opened for reading */
+#define __F_WRITE	0x02	/* opened for writing */
+#define __F_EOF		0x04	/* hit end of file */
+#define __F_ERR		0x08	/* I/O error */
+#define __F_SETUP	0x10	/* buffering mode decided */
+#define __F_WRITING	0x20	/* buffer holds output */
+#define __F_MYBUF	0x40	/* f_buf was malloc'd by stdio */
+#define __F_STD		0x80	/* stdin/stdout/stderr; not malloc'd */
+
+extern FILE *stdin;
+extern FILE *stdout;
+extern FILE *stderr;
+
+/*
+ * Buffer management
+ * (for libc internal use only)
+ *
+ *    __stdio_setup  - decide the buffering mode, if not done yet.
+ *    __stdio_write  - put LEN bytes out through the buffer.
+ *    __stdio_read   - read input into BUF, bypassing the buffer.
+ *    __stdio_fill   - read more input into the (empty) buffer.
+ *    __stdio_flush  - write out pending output, or give back read-ahead.
+ *    __stdio_files  - list of all open streams.
+ */
+void __stdio_setup(FILE *f);
+int __stdio_write(FILE *f, const char *data, size_t len);
+int __stdio_read(FILE *f, char *buf, size_t len);
+int __stdio_fill(FILE *f);
+int __stdio_flush(FILE *f);
+extern FILE *__stdio_files;
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -53,6 +118,8 @@ int __vprintf(void (*sendfunc)(void *clientdata, const char *, size_t len),
 /* Printf calls for user programs */
 int printf(const char *fmt, ...);
 int vprintf(const char *fmt, __va_list ap);
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
 int snprintf(char *buf, size_t len, const char *fmt, ...);
 int vsnprintf(char *buf, size_t len, const char *fmt, __va_list ap);
 
@@ -69,4 +136,22 @@ int putchar(int);
 /* Reads one character (0-255) or returns EOF on error. */
 int getchar(void);
 
+/* Streams */
+FILE *fopen(const char *path, const char *mode);
+int fclose(FILE *f);
+size_t fread(void *buf, size_t size, size_t nitems, FILE *f);
+size_t fwrite(const void *buf, size_t size, size_t nitems, FILE *f);
+int fflush(FILE *f);	/* NULL means all streams */
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+int fgetc(FILE *f);
+int fputc(int c, FILE *f);
+int fputs(const char *s, FILE *f);
+int feof(FILE *f);
+int ferror(FILE *f);
+void clearerr(FILE *f);
+int fileno(FILE *f);
+
+#define getc(f) fgetc(f)
+#define putc(c, f) fputc(c, f)
+
 #endif /* _STDIO_H_ */
@@ -40,10 +40,9 @@ int
 __puts(const char *str)
 {
 	int count=0;
-	while (*str) {
-		putchar(*str);
-		str++;
+	while (str[count]) {
 		count++;
 	}
+	__stdio_write(stdout, str, count);
 	return count;
 }
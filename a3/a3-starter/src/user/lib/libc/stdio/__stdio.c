@@ -0,0 +1,211 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * stdio buffer management. See the comments in <stdio.h>.
+ */
+
+static char stdin_buf[BUFSIZ];
+static char stdout_buf[BUFSIZ];
+
+static FILE stdin_file = {
+	STDIN_FILENO, __F_READ|__F_STD, _IOFBF,
+	stdin_buf, sizeof(stdin_buf), 0, 0, 0, NULL,
+};
+static FILE stdout_file = {
+	STDOUT_FILENO, __F_WRITE|__F_STD, _IOFBF,
+	stdout_buf, sizeof(stdout_buf), 0, 0, 0, &stdin_file,
+};
+static FILE stderr_file = {
+	STDERR_FILENO, __F_WRITE|__F_STD|__F_SETUP, _IONBF,
+	&stderr_file.f_ch, 1, 0, 0, 0, &stdout_file,
+};
+
+FILE *stdin = &stdin_file;
+FILE *stdout = &stdout_file;
+FILE *stderr = &stderr_file;
+
+FILE *__stdio_files = &stderr_file;
+
+/*
+ * Decide how F is buffered, the first time it's used. Streams that
+ * already have a buffer keep it; stdin and stdout drop theirs if
+ * they turn out to be the console.
+ */
+void
+__stdio_setup(FILE *f)
+{
+	struct stat st;
+
+	if (f->f_flags & __F_SETUP) {
+		return;
+	}
+	f->f_flags |= __F_SETUP;
+
+	if (f->f_flags & __F_STD) {
+		if (fstat(f->f_fd, &st) < 0 || S_ISCHR(st.st_mode)) {
+			f->f_bufmode = _IONBF;
+		}
+	}
+
+	if (f->f_bufmode != _IONBF && f->f_buf == NULL) {
+		f->f_buf = malloc(BUFSIZ);
+		if (f->f_buf != NULL) {
+			f->f_bufsize = BUFSIZ;
+			f->f_flags |= __F_MYBUF;
+		}
+		else {
+			f->f_bufmode = _IONBF;
+		}
+	}
+	if (f->f_bufmode == _IONBF) {
+		f->f_buf = &f->f_ch;
+		f->f_bufsize = 1;
+	}
+	f->f_pos = f->f_end = 0;
+}
+
+/*
+ * Write all of BUF straight to the file.
+ */
+static
+int
+__stdio_writeall(FILE *f, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(f->f_fd, buf, len);
+		if (r <= 0) {
+			f->f_flags |= __F_ERR;
+			return EOF;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Empty the buffer: write out pending output, or throw away read-ahead
+ * and seek the file back to where the reader is. The seek fails on
+ * the console and pipes; then the read-ahead is just lost, same as
+ * anywhere else.
+ */
+int
+__stdio_flush(FILE *f)
+{
+	int result = 0;
+
+	if (f->f_flags & __F_WRITING) {
+		result = __stdio_writeall(f, f->f_buf, f->f_pos);
+		f->f_flags &= ~__F_WRITING;
+	}
+	else if (f->f_end > f->f_pos) {
+		lseek(f->f_fd, -(off_t)(f->f_end - f->f_pos), SEEK_CUR);
+	}
+	f->f_pos = f->f_end = 0;
+	return result;
+}
+
+/*
+ * Output LEN bytes. Anything as big as the buffer goes straight out
+ * once the buffer ahead of it has been written.
+ */
+int
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	size_t i;
+
+	__stdio_setup(f);
+	if ((f->f_flags & __F_WRITE) == 0) {
+		f->f_flags |= __F_ERR;
+		errno = EBADF;
+		return EOF;
+	}
+	if ((f->f_flags & __F_WRITING) == 0) {
+		__stdio_flush(f);
+		f->f_flags |= __F_WRITING;
+	}
+
+	if (f->f_pos + len > f->f_bufsize) {
+		if (__stdio_flush(f)) {
+			return EOF;
+		}
+		f->f_flags |= __F_WRITING;
+	}
+	if (len >= f->f_bufsize) {
+		return __stdio_writeall(f, data, len);
+	}
+	memcpy(f->f_buf + f->f_pos, data, len);
+	f->f_pos += len;
+
+	if (f->f_bufmode == _IOLBF) {
+		for (i=0; i<len; i++) {
+			if (data[i] == '\n') {
+				return __stdio_flush(f);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read up to LEN bytes of input into BUF, which is either the stream's
+ * own (empty) buffer or, for big reads, the caller's. Returns the
+ * count, or EOF at end of file or on error.
+ */
+int
+__stdio_read(FILE *f, char *buf, size_t len)
+{
+	ssize_t r;
+
+	__stdio_setup(f);
+	if ((f->f_flags & __F_READ) == 0) {
+		f->f_flags |= __F_ERR;
+		errno = EBADF;
+		return EOF;
+	}
+	if (f->f_flags & __F_WRITING) {
+		if (__stdio_flush(f)) {
+			return EOF;
+		}
+	}
+	/* like line-buffered input elsewhere, flush stdout before waiting */
+	if (f == stdin && (stdout->f_flags & __F_WRITING)) {
+		__stdio_flush(stdout);
+	}
+
+	r = read(f->f_fd, buf, len);
+	if (r < 0) {
+		f->f_flags |= __F_ERR;
+		return EOF;
+	}
+	if (r == 0) {
+		f->f_flags |= __F_EOF;
+		return EOF;
+	}
+	return r;
+}
+
+/*
+ * Refill the buffer from the file. Returns 0, or EOF at end of file
+ * or on error.
+ */
+int
+__stdio_fill(FILE *f)
+{
+	int r;
+
+	/* set up first; that may change the buffer */
+	__stdio_setup(f);
+	r = __stdio_read(f, f->f_buf, f->f_bufsize);
+	f->f_pos = 0;
+	f->f_end = (r == EOF) ? 0 : r;
+	return (r == EOF) ? EOF : 0;
+}
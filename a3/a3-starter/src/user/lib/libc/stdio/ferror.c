@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+/*
+ * feof, ferror, clearerr, fileno - C standard I/O functions.
+ */
+
+int
+feof(FILE *f)
+{
+	return (f->f_flags & __F_EOF) != 0;
+}
+
+int
+ferror(FILE *f)
+{
+	return (f->f_flags & __F_ERR) != 0;
+}
+
+void
+clearerr(FILE *f)
+{
+	f->f_flags &= ~(__F_EOF|__F_ERR);
+}
+
+int
+fileno(FILE *f)
+{
+	return f->f_fd;
+}
@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+/*
+ * fflush - C standard I/O function. Flushing NULL flushes everything;
+ * exit() does that.
+ */
+
+int
+fflush(FILE *f)
+{
+	int result = 0;
+
+	if (f != NULL) {
+		return __stdio_flush(f);
+	}
+	for (f = __stdio_files; f != NULL; f = f->f_next) {
+		if ((f->f_flags & __F_WRITING) && __stdio_flush(f)) {
+			result = EOF;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * fopen, fclose - C standard I/O functions.
+ */
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+	FILE *f;
+	int flags, rw, fd;
+
+	switch (mode[0]) {
+	    case 'r':
+		flags = O_RDONLY;
+		rw = __F_READ;
+		break;
+	    case 'w':
+		flags = O_WRONLY|O_CREAT|O_TRUNC;
+		rw = __F_WRITE;
+		break;
+	    case 'a':
+		/* the kernel has no O_APPEND; we seek to the end below */
+		flags = O_WRONLY|O_CREAT;
+		rw = __F_WRITE;
+		break;
+	    default:
+		errno = EINVAL;
+		return NULL;
+	}
+	/* 'b' means nothing here */
+	if (mode[1] == '+' || (mode[1] != 0 && mode[2] == '+')) {
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+		rw = __F_READ|__F_WRITE;
+	}
+
+	f = malloc(sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+	fd = open(path, flags, 0664);
+	if (fd < 0) {
+		free(f);
+		return NULL;
+	}
+	if (mode[0] == 'a' && lseek(fd, 0, SEEK_END) < 0) {
+		close(fd);
+		free(f);
+		return NULL;
+	}
+
+	f->f_fd = fd;
+	f->f_flags = rw;
+	f->f_bufmode = _IOFBF;
+	f->f_buf = NULL;
+	f->f_bufsize = 0;
+	f->f_pos = f->f_end = 0;
+	f->f_ch = 0;
+	f->f_next = __stdio_files;
+	__stdio_files = f;
+	return f;
+}
+
+int
+fclose(FILE *f)
+{
+	FILE **fp;
+	int result;
+
+	result = __stdio_flush(f);
+	if (close(f->f_fd) < 0) {
+		result = EOF;
+	}
+
+	for (fp = &__stdio_files; *fp != NULL; fp = &(*fp)->f_next) {
+		if (*fp == f) {
+			*fp = f->f_next;
+			break;
+		}
+	}
+	if (f->f_flags & __F_MYBUF) {
+		free(f->f_buf);
+	}
+	if ((f->f_flags & __F_STD) == 0) {
+		free(f);
+	}
+	return result;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ * fprintf, vfprintf - C standard I/O functions.
+ *
+ * For an unbuffered stream the output is collected in a buffer on the
+ * stack and written at the end (or whenever that fills up), so that a
+ * printf to the console is one write, not one per character.
+ */
+
+struct fprintf_data {
+	FILE *f;
+	int err;
+	size_t len;
+	char buf[BUFSIZ];
+};
+
+/*
+ * Function passed to __vprintf to do the actual output.
+ */
+static
+void
+__fprintf_send(void *mydata, const char *data, size_t len)
+{
+	struct fprintf_data *fd = mydata;
+	size_t n;
+
+	if (fd->f->f_bufmode != _IONBF) {
+		if (__stdio_write(fd->f, data, len)) {
+			fd->err = 1;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		if (fd->len == sizeof(fd->buf)) {
+			if (__stdio_write(fd->f, fd->buf, fd->len)) {
+				fd->err = 1;
+			}
+			fd->len = 0;
+		}
+		n = sizeof(fd->buf) - fd->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(fd->buf + fd->len, data, n);
+		fd->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+int
+fprintf(FILE *f, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+	va_start(ap, fmt);
+	chars = vfprintf(f, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+int
+vfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct fprintf_data fd;
+	int chars;
+
+	__stdio_setup(f);
+	fd.f = f;
+	fd.err = 0;
+	fd.len = 0;
+	chars = __vprintf(__fprintf_send, &fd, fmt, ap);
+	if (fd.len > 0 && __stdio_write(f, fd.buf, fd.len)) {
+		fd.err = 1;
+	}
+	return fd.err ? EOF : chars;
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * fread, fgetc - C standard I/O functions.
+ */
+
+size_t
+fread(void *buf, size_t size, size_t nitems, FILE *f)
+{
+	char *p = buf;
+	size_t want, got, n;
+	int r;
+
+	want = size * nitems;
+	if (want == 0) {
+		return 0;
+	}
+
+	got = 0;
+	while (got < want) {
+		if (f->f_pos >= f->f_end) {
+			__stdio_setup(f);
+			if (want - got >= f->f_bufsize) {
+				/* buffer's empty and wouldn't hold it all */
+				r = __stdio_read(f, p + got, want - got);
+				if (r == EOF) {
+					break;
+				}
+				got += r;
+				continue;
+			}
+			if (__stdio_fill(f)) {
+				break;
+			}
+		}
+		n = f->f_end - f->f_pos;
+		if (n > want - got) {
+			n = want - got;
+		}
+		memcpy(p + got, f->f_buf + f->f_pos, n);
+		f->f_pos += n;
+		got += n;
+	}
+	return got / size;
+}
+
+int
+fgetc(FILE *f)
+{
+	if (f->f_pos >= f->f_end && __stdio_fill(f)) {
+		return EOF;
+	}
+	return (unsigned char)f->f_buf[f->f_pos++];
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+/*
+ * fwrite, fputc, fputs - C standard I/O functions.
+ */
+
+size_t
+fwrite(const void *buf, size_t size, size_t nitems, FILE *f)
+{
+	if (size == 0 || nitems == 0) {
+		return 0;
+	}
+	if (__stdio_write(f, buf, size * nitems)) {
+		return 0;
+	}
+	return nitems;
+}
+
+int
+fputc(int c, FILE *f)
+{
+	char ch = c;
+
+	if (__stdio_write(f, &ch, 1)) {
+		return EOF;
+	}
+	return (unsigned char)ch;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+	size_t len;
+
+	for (len = 0; s[len] != 0; len++) {
+		/* nothing */
+	}
+	return __stdio_write(f, s, len);
+}
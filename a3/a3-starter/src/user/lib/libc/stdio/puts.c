@@ -36,7 +36,9 @@
 int
 puts(const char *s)
 {
-	__puts(s);
-	putchar('\n');
+	/* one write even if stdout is unbuffered */
+	if (fprintf(stdout, "%s\n", s) < 0) {
+		return EOF;
+	}
 	return 0;
 }
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/*
+ * setvbuf - C standard I/O function. Changes how F is buffered. If
+ * BUF is NULL, a buffer of SIZE bytes (BUFSIZ if 0) is allocated.
+ * Pending output is written out first.
+ */
+
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	unsigned mybuf = 0;
+
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return EOF;
+	}
+	if (__stdio_flush(f)) {
+		return EOF;
+	}
+
+	if (size == 0) {
+		size = BUFSIZ;
+	}
+	if (mode != _IONBF && buf == NULL) {
+		buf = malloc(size);
+		if (buf == NULL) {
+			return EOF;
+		}
+		mybuf = __F_MYBUF;
+	}
+
+	if (f->f_flags & __F_MYBUF) {
+		free(f->f_buf);
+	}
+	if (mode == _IONBF) {
+		f->f_buf = &f->f_ch;
+		f->f_bufsize = 1;
+	}
+	else {
+		f->f_buf = buf;
+		f->f_bufsize = size;
+	}
+	f->f_flags = (f->f_flags & ~__F_MYBUF) | mybuf | __F_SETUP;
+	f->f_bufmode = mode;
+	return 0;
+}
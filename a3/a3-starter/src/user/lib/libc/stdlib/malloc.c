@@ -27,18 +27,36 @@
  * SUCH DAMAGE.
  */
 
+
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator with boundary tags, along the
+ * lines of Doug Lea's malloc.
+ *
+ * The heap is a row of chunks from __heapbase up to __heaptop. Each
+ * chunk starts with a two-word header: the size of the chunk below
+ * it (valid only if that chunk is free) and its own size, with the
+ * low bits saying whether it and the chunk below are in use. A free
+ * chunk also holds the links for the free list it's on. Because the
+ * sizes are known at both ends, free can find and merge with free
+ * neighbors in constant time.
+ *
+ * Free chunks are kept in bins: one for each small size, exact fit,
+ * and then one for each power of two, searched best-fit. A bitmap of
+ * non-empty bins lets malloc go straight to the first bin that can
+ * satisfy a request. The highest chunk, the "top", isn't in any bin;
+ * it's carved up when nothing else fits, grown with sbrk when it's
+ * too small, and given back with sbrk when a lot of it is free.
+ *
+ * With MALLOCDEBUG, freed memory is filled with 0xdeadbeef and the
+ * whole heap is checked on every call.
  */
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 
 #undef MALLOCDEBUG
@@ -52,93 +70,100 @@
 #endif
 
 /*
- * malloc block header.
+ * Chunk header.
  *
- * mh_prevblock is the downwards offset to the previous header, 0 if this
- * is the bottom of the heap.
+ * mc_prevsize is the size of the chunk below, if it is free.
+ * mc_size is the size of this chunk, header included, plus M_* bits.
+ * mc_next and mc_prev link free chunks into their bin; in a chunk
+ * that's in use they're the start of the caller's data.
  *
- * mh_nextblock is the upwards offset to the next header.
- *
- * mh_pad is unused.
- * mh_inuse is 1 if the block is in use, 0 if it is free.
- * mh_magic* should always be a fixed value.
- *
- * MBLOCKSIZE should equal sizeof(struct mheader) and be a power of 2.
- * MBLOCKSHIFT is the log base 2 of MBLOCKSIZE.
- * MMAGIC is the value for mh_magic*.
+ * MALIGN is the alignment of chunks and of the pointers returned;
+ * it is the size of the header, two words. MALIGNSHIFT is its log
+ * base 2.
  */
-struct mheader {
+struct mchunk {
+	size_t mc_prevsize;
+	size_t mc_size;
+	struct mchunk *mc_next;
+	struct mchunk *mc_prev;
+};
 
 #if defined(MALLOC32)
-#define MBLOCKSIZE 8
-#define MBLOCKSHIFT 3
-#define MMAGIC 2
-	/*
-	 * 32-bit platform. size_t is 32 bits (4 bytes). 
-	 * Block size is 8 bytes.
-	 */
-	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:2;
-
-	unsigned mh_nextblock:29;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:2;
-
+#define MALIGN		8
+#define MALIGNSHIFT	3
 #elif defined(MALLOC64)
-#define MBLOCKSIZE 16
-#define MBLOCKSHIFT 4
-#define MMAGIC 6
-	/*
-	 * 64-bit platform. size_t is 64 bits (8 bytes)
-	 * Block size is 16 bytes.
-	 */
-	unsigned mh_prevblock:62;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:3;
-
-	unsigned mh_nextblock:62;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:3;
-
+#define MALIGN		16
+#define MALIGNSHIFT	4
 #else
 #error "please fix me"
 #endif
-};
+
+#define MHDRSIZE	(2*sizeof(size_t))	/* header size */
+#define MINCHUNK	sizeof(struct mchunk)	/* smallest chunk */
+#define MAXREQUEST	((size_t)-1 / 2)	/* bigger requests fail */
+
+#define M_INUSE		1	/* chunk is in use */
+#define M_PREVINUSE	2	/* chunk below is in use */
+#define M_FLAGS		(M_INUSE|M_PREVINUSE)
 
 /*
- * Operator macros on struct mheader.
- *
- * M_NEXT/PREVOFF:	return offset to next/previous header
- * M_NEXT/PREV:		return next/previous header
- * 
- * M_DATA:		return data pointer of a header
- * M_SIZE:		return data size of a header
+ * Operator macros on struct mchunk.
  *
- * M_OK:		true if the magic values are correct
- * 
- * M_MKFIELD:		prepare a value for mh_next/prevblock.
- * 			(value should include the header size)
+ * M_SIZE:		chunk size, without the flag bits
+ * M_AT:		the chunk OFF bytes above C
+ * M_NEXT/PREV:		the next/previous chunk (M_PREV only if it's free)
+ * M_DATA:		data pointer of a chunk
+ * M_CHUNK:		chunk of a data pointer
  */
+#define M_SIZE(c)	((c)->mc_size & ~(size_t)M_FLAGS)
+#define M_AT(c, off)	((struct mchunk *)((char *)(c) + (off)))
+#define M_NEXT(c)	M_AT(c, M_SIZE(c))
+#define M_PREV(c)	((struct mchunk *)((char *)(c) - (c)->mc_prevsize))
+#define M_DATA(c)	((void *)((char *)(c) + MHDRSIZE))
+#define M_CHUNK(p)	((struct mchunk *)((char *)(p) - MHDRSIZE))
 
-#define M_NEXTOFF(mh)	((size_t)(((size_t)((mh)->mh_nextblock))<<MBLOCKSHIFT))
-#define M_PREVOFF(mh)	((size_t)(((size_t)((mh)->mh_prevblock))<<MBLOCKSHIFT))
-#define M_NEXT(mh)	((struct mheader *)(((char*)(mh))+M_NEXTOFF(mh)))
-#define M_PREV(mh)	((struct mheader *)(((char*)(mh))-M_PREVOFF(mh)))
-
-#define M_DATA(mh)	((void *)((mh)+1))
-#define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
-
-#define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
+/*
+ * Bins. Chunks smaller than MSMALLMAX go in bin SIZE/MALIGN, where
+ * they are all the same size. Bigger ones go in bin NSMALLBINS + k
+ * where SIZE is between MSMALLMAX * 2^k and twice that; the last bin
+ * takes everything above.
+ */
+#define NSMALLBINS	64
+#define NLARGEBINS	24
+#define NBINS		(NSMALLBINS + NLARGEBINS)
+#define MSMALLMAX	(NSMALLBINS * MALIGN)
+#define NBINWORDS	((NBINS + 31) / 32)
 
-#define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
+/*
+ * The heap grows by at least MGROW at a time, and is trimmed when more
+ * than MTRIM is free at the top, down to MGROW, in multiples of
+ * MTRIMUNIT.
+ */
+#define MGROW		(16*1024)
+#define MTRIM		(128*1024)
+#define MTRIMUNIT	4096
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * top chunk, and the bins. Only the links of the bin heads are used;
+ * each list is circular through its head.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mchunk *__top;
+static struct mchunk __bins[NBINS];
+static uint32_t __binmap[NBINWORDS];
+
+/*
+ * Size of the top chunk. Its header is only there once it's nonzero.
+ */
+static
+size_t
+__malloc_topsize(void)
+{
+	return __heaptop - (uintptr_t)__top;
+}
 
 /*
  * Setup function.
@@ -148,18 +173,16 @@ void
 __malloc_init(void)
 {
 	void *x;
+	unsigned i;
 
 	/*
 	 * Check various assumed properties of the sizes.
 	 */
-	if (sizeof(struct mheader) != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE wrong");
+	if (MHDRSIZE != MALIGN || MINCHUNK != 2*MALIGN) {
+		errx(1, "malloc: Internal error - MALIGN wrong");
 	}
-	if ((MBLOCKSIZE & (MBLOCKSIZE-1))!=0) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE not power of 2");
-	}
-	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
+	if (1<<MALIGNSHIFT != MALIGN) {
+		errx(1, "malloc: Internal error - MALIGNSHIFT wrong");
 	}
 
 	/* init should only be called once. */
@@ -184,8 +207,8 @@ __malloc_init(void)
 	 * begins at _end.)
 	 */
 
-	if (__heapbase % MBLOCKSIZE != 0) {
-		size_t adjust = MBLOCKSIZE - (__heapbase % MBLOCKSIZE);
+	if (__heapbase % MALIGN != 0) {
+		size_t adjust = MALIGN - (__heapbase % MALIGN);
 		x = sbrk(adjust);
 		if (x==(void *)-1) {
 			err(1, "malloc: sbrk failed aligning heap base");
@@ -200,6 +223,104 @@ __malloc_init(void)
 		__heapbase += adjust;
 		__heaptop = __heapbase;
 	}
+
+	/* The heap is all top, of size 0. */
+	__top = (struct mchunk *)__heapbase;
+
+	for (i=0; i<NBINS; i++) {
+		__bins[i].mc_next = __bins[i].mc_prev = &__bins[i];
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Bin operations.
+ */
+
+static
+unsigned
+__malloc_binindex(size_t size)
+{
+	unsigned b;
+
+	if (size < MSMALLMAX) {
+		return size >> MALIGNSHIFT;
+	}
+	b = NSMALLBINS;
+	size /= MSMALLMAX;
+	while (size > 1 && b < NBINS-1) {
+		size >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Put free chunk C in its bin.
+ */
+static
+void
+__malloc_link(struct mchunk *c)
+{
+	struct mchunk *head;
+	unsigned b;
+
+	b = __malloc_binindex(M_SIZE(c));
+	head = &__bins[b];
+	c->mc_next = head->mc_next;
+	c->mc_prev = head;
+	head->mc_next->mc_prev = c;
+	head->mc_next = c;
+	__binmap[b/32] |= 1U << (b%32);
+}
+
+/*
+ * Take free chunk C out of its bin.
+ */
+static
+void
+__malloc_unlink(struct mchunk *c)
+{
+	unsigned b;
+
+	if (c->mc_next->mc_prev != c || c->mc_prev->mc_next != c) {
+		errx(1, "malloc: Heap corrupt; free chunk at %p has bad links",
+		     c);
+	}
+	c->mc_prev->mc_next = c->mc_next;
+	c->mc_next->mc_prev = c->mc_prev;
+
+	b = __malloc_binindex(M_SIZE(c));
+	if (__bins[b].mc_next == &__bins[b]) {
+		__binmap[b/32] &= ~(1U << (b%32));
+	}
+}
+
+/*
+ * Find the first chunk in the lowest non-empty bin at or above B,
+ * or NULL if they're all empty.
+ */
+static
+struct mchunk *
+__malloc_firstfree(unsigned b)
+{
+	uint32_t bits;
+	unsigned w, bit;
+
+	for (w = b/32; w < NBINWORDS; w++) {
+		bits = __binmap[w];
+		if (w == b/32) {
+			bits &= ~0U << (b%32);
+		}
+		if (bits != 0) {
+			for (bit = 0; (bits & (1U << bit)) == 0; bit++) {
+				/* nothing */
+			}
+			return __bins[w*32 + bit].mc_next;
+		}
+	}
+	return NULL;
 }
 
 ////////////////////////////////////////////////////////////
@@ -207,123 +328,200 @@ __malloc_init(void)
 #ifdef MALLOCDEBUG
 
 /*
- * Debugging print function to iterate and dump the entire heap.
+ * Debugging function to iterate over and check the entire heap.
  */
 static
 void
 __malloc_dump(void)
 {
-	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mchunk *c;
+	int previnuse = 1;
 
 	warnx("heap: ************************************************");
 
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
+	for (c = (struct mchunk *)__heapbase; c != __top; c = M_NEXT(c)) {
+		if ((uintptr_t)c > (uintptr_t)__top || M_SIZE(c) < MINCHUNK) {
+			errx(1, "malloc: Heap corrupt; ran off end at %p", c);
+		}
+		if (!(c->mc_size & M_PREVINUSE) != !previnuse) {
+			errx(1, "malloc: Heap corrupt; chunk at %p has "
+			     "wrong previous-in-use bit", c);
+		}
+		if (!previnuse && M_SIZE(M_PREV(c)) != c->mc_prevsize) {
+			errx(1, "malloc: Heap corrupt; chunk at %p has "
+			     "wrong previous size", c);
 		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+		if (!previnuse && !(c->mc_size & M_INUSE)) {
+			errx(1, "malloc: Heap corrupt; free chunks at %p "
+			     "not merged", c);
 		}
-		rightprevblock = mh->mh_nextblock;
+		previnuse = (c->mc_size & M_INUSE) != 0;
 
-		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
-		      (unsigned long) i + MBLOCKSIZE,
-		      (unsigned long) M_SIZE(mh),
-		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+		warnx("heap: 0x%lx 0x%-6lx %s",
+		      (unsigned long) M_DATA(c),
+		      (unsigned long) M_SIZE(c),
+		      previnuse ? "INUSE" : "FREE");
 	}
+	warnx("heap: top 0x%lx 0x%-6lx", (unsigned long) __top,
+	      (unsigned long) __malloc_topsize());
 
 	warnx("heap: ************************************************");
 }
 
+/*
+ * Fill a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
 #endif /* MALLOCDEBUG */
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and 
- * return a pointer to it.
+ * Get AMOUNT more bytes, which must be at least 2*MINCHUNK, onto the
+ * top chunk using sbrk. Returns 0, or -1 if sbrk fails.
+ *
+ * If something else has moved the break since last time (the host's
+ * libc may), the old top is left as a chunk that's always in use,
+ * covering the gap, and the top starts again above it. The new top is
+ * then smaller than asked for, so callers have to check.
  */
 static
-void *
-__malloc_sbrk(size_t size)
+int
+__malloc_growtop(size_t amount)
 {
-	void *x;
+	size_t topsize, flags;
+	uintptr_t x, newtop;
 
-	x = sbrk(size);
-	if (x == (void *)-1) {
-		return NULL;
+	topsize = __malloc_topsize();
+	flags = (topsize == 0) ? M_PREVINUSE : (__top->mc_size & M_PREVINUSE);
+
+	x = (uintptr_t)sbrk(amount);
+	if (x == (uintptr_t)-1) {
+		return -1;
 	}
 
-	if ((uintptr_t)x != __heaptop) {
-		errx(1, "malloc: Internal error - "
-		     "heap top moved itself from 0x%lx to 0x%lx",
-		     (unsigned long) __heaptop,
-		     (unsigned long) (uintptr_t) x);
+	if (x != __heaptop) {
+		newtop = (x + MALIGN - 1) & ~(uintptr_t)(MALIGN-1);
+		if (topsize == 0 && __top == (struct mchunk *)__heapbase) {
+			/* nothing allocated yet; just move the heap */
+			__heapbase = newtop;
+		}
+		else if (topsize == 0) {
+			errx(1, "malloc: Internal error - top chunk empty");
+		}
+		else {
+			__top->mc_size = (newtop - (uintptr_t)__top) |
+				M_INUSE | flags;
+			flags = M_PREVINUSE;
+		}
+		__top = (struct mchunk *)newtop;
+		__heaptop = x + amount;
 	}
-	__heaptop += size;
-	return x;
+	else {
+		__heaptop += amount;
+	}
+
+	__top->mc_size = __malloc_topsize() | flags;
+	return 0;
 }
 
 /*
- * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
- *
- * Only split if the excess space is at least twice the blocksize -
- * one blocksize to hold a header and one for data.
+ * Give memory at the top back to the system if there's a lot of it.
+ * Not being able to is fine.
  */
 static
 void
-__malloc_split(struct mheader *mh, size_t size)
+__malloc_trim(void)
 {
-	struct mheader *mhnext, *mhnew;
-	size_t oldsize;
+	size_t topsize, amount;
 
-	if (size % MBLOCKSIZE != 0) {
-		errx(1, "malloc: Internal error (size %lu passed to split)",
-		     (unsigned long) size);
+	topsize = __malloc_topsize();
+	if (topsize <= MTRIM) {
+		return;
 	}
-
-	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
-		/* no room */
+	amount = (topsize - MGROW) & ~(size_t)(MTRIMUNIT-1);
+	if (amount == 0 || sbrk(0) != (void *)__heaptop) {
 		return;
 	}
+	if (sbrk(-(intptr_t)amount) == (void *)-1) {
+		return;
+	}
+	__heaptop -= amount;
+	__top->mc_size -= amount;
+}
 
-	mhnext = M_NEXT(mh);
+/*
+ * Allocate a chunk of SIZE bytes off the bottom of the top chunk,
+ * growing it first if needed. The top must always have room for its
+ * own header afterwards.
+ */
+static
+void *
+__malloc_fromtop(size_t size)
+{
+	struct mchunk *c;
+	size_t topsize, amount;
 
-	oldsize = M_SIZE(mh);
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-	
-	mhnew = M_NEXT(mh);
-	if (mhnew==mhnext) {
-		errx(1, "malloc: Internal error (split screwed up?)");
+	while ((topsize = __malloc_topsize()) < size + MINCHUNK) {
+		amount = size + MINCHUNK - topsize;
+		if (amount < MGROW && __malloc_growtop(MGROW) == 0) {
+			continue;
+		}
+		/* try again for just what's needed */
+		if (amount < 2*MINCHUNK) {
+			amount = 2*MINCHUNK;
+		}
+		if (__malloc_growtop(amount)) {
+			errno = ENOMEM;
+			return NULL;
+		}
 	}
 
-	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
-	mhnew->mh_magic1 = MMAGIC;
-	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
-	mhnew->mh_inuse = 0;
-	mhnew->mh_magic2 = MMAGIC;
+	c = __top;
+	__top = M_AT(c, size);
+	__top->mc_size = (topsize - size) | M_PREVINUSE;
+	c->mc_size = size | M_INUSE | (c->mc_size & M_PREVINUSE);
+	return M_DATA(c);
+}
 
-	if (mhnext != (struct mheader *) __heaptop) {
-		mhnext->mh_prevblock = mhnew->mh_nextblock;
+/*
+ * Allocate SIZE bytes from free chunk C, which has been taken out of
+ * its bin. If enough is left over to make a chunk, that goes back
+ * into a bin.
+ */
+static
+void *
+__malloc_carve(struct mchunk *c, size_t size)
+{
+	struct mchunk *rest, *next;
+	size_t csize;
+
+	csize = M_SIZE(c);
+	next = M_AT(c, csize);
+
+	if (csize - size >= MINCHUNK) {
+		rest = M_AT(c, size);
+		rest->mc_size = (csize - size) | M_PREVINUSE;
+		next->mc_prevsize = csize - size;
+		__malloc_link(rest);
+		csize = size;
 	}
+	else {
+		next->mc_size |= M_PREVINUSE;
+	}
+	c->mc_size = csize | M_INUSE | (c->mc_size & M_PREVINUSE);
+	return M_DATA(c);
 }
 
 /*
@@ -332,9 +530,8 @@ __malloc_split(struct mheader *mh, size_t size)
 void *
 malloc(size_t size)
 {
-	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mchunk *head, *c, *best;
+	unsigned b;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -351,137 +548,67 @@ malloc(size_t size)
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
-	if (mh == NULL) {
+	if (size > MAXREQUEST) {
+		errno = ENOMEM;
 		return NULL;
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
-	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: allocating at %p", M_DATA(mh));
-	__malloc_dump();
-#endif
-	return M_DATA(mh);
-}
-
-////////////////////////////////////////////////////////////
-
-/*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
- */
-static
-void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
+	/* Add the header and round up to a chunk size. */
+	size = (size + MHDRSIZE + MALIGN - 1) & ~(size_t)(MALIGN-1);
+	if (size < MINCHUNK) {
+		size = MINCHUNK;
 	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
-{
-	struct mheader *mhnextnext;
 
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
+	b = __malloc_binindex(size);
+	head = &__bins[b];
+	if (b < NSMALLBINS) {
+		/* Small: anything in the bin is exactly right. */
+		c = head->mc_next;
+		if (c != head) {
+			__malloc_unlink(c);
+			return __malloc_carve(c, size);
+		}
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
+	else {
+		/* Large: best fit from the bin. */
+		best = NULL;
+		for (c = head->mc_next; c != head; c = c->mc_next) {
+			if (M_SIZE(c) >= size &&
+			    (best == NULL || M_SIZE(c) < M_SIZE(best))) {
+				best = c;
+				if (M_SIZE(c) == size) {
+					break;
+				}
+			}
+		}
+		if (best != NULL) {
+			__malloc_unlink(best);
+			return __malloc_carve(best, size);
+		}
 	}
 
-	mhnextnext = M_NEXT(mhnext);
-
-	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
-				     MBLOCKSIZE + M_SIZE(mhnext));
-
-	if (mhnextnext != (struct mheader *)__heaptop) {
-		mhnextnext->mh_prevblock = mh->mh_nextblock;
+	/* Anything in a higher bin is big enough. */
+	if (b < NBINS-1) {
+		c = __malloc_firstfree(b+1);
+		if (c != NULL) {
+			__malloc_unlink(c);
+			return __malloc_carve(c, size);
+		}
 	}
 
-	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+	return __malloc_fromtop(size);
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * The actual free() implementation.
  */
 void
 free(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	struct mchunk *c, *prev, *next;
+	size_t size;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -496,42 +623,68 @@ free(void *x)
 	}
 
 	/* Don't allow freeing pointers that aren't on the heap. */
-	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
+	if ((uintptr_t)x < __heapbase + MHDRSIZE ||
+	    (uintptr_t)x >= (uintptr_t)__top) {
 		errx(1, "free: Invalid pointer %p freed (out of range)", x);
 	}
+	if ((uintptr_t)x % MALIGN != 0) {
+		errx(1, "free: Invalid pointer %p freed (misaligned)", x);
+	}
 
 #ifdef MALLOCDEBUG
 	warnx("free: about to free %p", x);
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
-	if (!M_OK(mh)) {
-		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
-	}
-
-	if (!mh->mh_inuse) {
+	c = M_CHUNK(x);
+	if (!(c->mc_size & M_INUSE)) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
+	size = M_SIZE(c);
+	next = M_AT(c, size);
+	if (size < MINCHUNK || (uintptr_t)next > (uintptr_t)__top ||
+	    !(next->mc_size & M_PREVINUSE)) {
+		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
+	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
+#ifdef MALLOCDEBUG
 	/* wipe it */
-	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	__malloc_deadbeef(x, size - MHDRSIZE);
+#endif
+
+	/* Merge with the chunk below if it's free */
+	if (!(c->mc_size & M_PREVINUSE)) {
+		prev = M_PREV(c);
+		if (M_SIZE(prev) != c->mc_prevsize) {
+			errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+			     prev, c);
+		}
+		__malloc_unlink(prev);
+		size += M_SIZE(prev);
+		c = prev;
+	}
 
-	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	/* Merge with the top, and maybe shrink the heap */
+	if (next == __top) {
+		c->mc_size = (size + __malloc_topsize()) |
+			(c->mc_size & M_PREVINUSE);
+		__top = c;
+		__malloc_trim();
+		return;
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
-		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+	/* Merge with the chunk above if it's free */
+	if (!(next->mc_size & M_INUSE)) {
+		__malloc_unlink(next);
+		size += M_SIZE(next);
 	}
 
+	c->mc_size = size | (c->mc_size & M_PREVINUSE);
+	next = M_AT(c, size);
+	next->mc_prevsize = size;
+	next->mc_size &= ~(size_t)M_PREVINUSE;
+	__malloc_link(c);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
@@ -98,6 +98,9 @@ __printerr(int use_errno, const char *fmt, va_list ap)
 		prog = "(program name unknown)";
 	}
 
+	/* get buffered output out first so the message comes after it */
+	fflush(stdout);
+
 	/* print the program name */
 	__senderrstr(prog);
 	__senderrstr(": ");
@@ -0,0 +1,136 @@
+/*
+ * fdbench.c
+ *
+ * 	Times the system call round trip for calls that look up a file
+ * 	descriptor, to see what descriptor lookup and the open file lock
+ * 	cost.
+ *
+ * Usage: fdbench [file [count]]
+ *
+ * Each call is made COUNT times (default 10000) on FILE (default
+ * fdbench.tmp, which is created). getpid doesn't touch the filetable
+ * and gives the bare trap cost to compare against. fstat and pread
+ * take no lock; lseek and a zero-length read take the open file's lock
+ * because they use the offset.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_COUNT 10000
+
+static int fd;
+static char buf[1];
+
+static
+void
+do_getpid(void)
+{
+	(void)getpid();
+}
+
+static
+void
+do_fstat(void)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		err(1, "fstat");
+	}
+}
+
+static
+void
+do_lseek(void)
+{
+	if (lseek(fd, 0, SEEK_CUR) < 0) {
+		err(1, "lseek");
+	}
+}
+
+static
+void
+do_read0(void)
+{
+	if (read(fd, buf, 0) < 0) {
+		err(1, "read");
+	}
+}
+
+static
+void
+do_pread(void)
+{
+	if (pread(fd, buf, 1, 0) < 0) {
+		err(1, "pread");
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "getpid", do_getpid },
+	{ "fstat", do_fstat },
+	{ "lseek", do_lseek },
+	{ "read 0", do_read0 },
+	{ "pread 1", do_pread },
+};
+
+static
+void
+bench(const char *name, void (*func)(void), unsigned count)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long long total;
+	unsigned i;
+
+	__time(&s0, &ns0);
+	for (i=0; i<count; i++) {
+		func();
+	}
+	__time(&s1, &ns1);
+
+	total = (s1 - s0) * 1000000000ULL + ns1 - ns0;
+	printf("%-8s %8u calls %10lu ns/call\n", name, count,
+	       (unsigned long)(total / count));
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "fdbench.tmp";
+	unsigned count = DEFAULT_COUNT;
+	unsigned i;
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+	if (argc > 2) {
+		count = atoi(argv[2]);
+		if (count == 0) {
+			errx(1, "Usage: fdbench [file [count]]");
+		}
+	}
+
+	fd = open(file, O_RDWR|O_CREAT, 0664);
+	if (fd<0) {
+		err(1, "%s: open", file);
+	}
+	if (write(fd, "x", 1) != 1) {
+		err(1, "%s: write", file);
+	}
+
+	for (i=0; i<sizeof(tests)/sizeof(tests[0]); i++) {
+		bench(tests[i].name, tests[i].func, count);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * iovtest.c
+ *
+ * 	Tests readv, writev, pread, and pwrite on a user specified file.
+ *
+ * Writes a file from three buffers in one writev, reads it back into
+ * differently split buffers with readv, then overwrites and reads
+ * pieces of it with pwrite and pread, checking that those don't move
+ * the file's seek position.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define LEN 40
+
+static const char data[LEN+1] = "Twiddle dee dee, Twiddle dum dum.......\n";
+
+static
+void
+check(const char *buf, const char *what)
+{
+	if (memcmp(buf, data, LEN)) {
+		errx(1, "%s: data came back wrong", what);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char readbuf[LEN+1];
+	struct iovec iov[3];
+	int fd, rv;
+	off_t pos;
+
+	if (argc!=2) {
+		errx(1, "Usage: iovtest <filename>");
+	}
+
+	fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: open", argv[1]);
+	}
+
+	/* gather the data from three pieces */
+	iov[0].iov_base = (void *)data;
+	iov[0].iov_len = 8;
+	iov[1].iov_base = (void *)(data + 8);
+	iov[1].iov_len = 0;
+	iov[2].iov_base = (void *)(data + 8);
+	iov[2].iov_len = LEN - 8;
+	rv = writev(fd, iov, 3);
+	if (rv<0) {
+		err(1, "%s: writev", argv[1]);
+	}
+	if (rv != LEN) {
+		errx(1, "%s: writev: short count %d", argv[1], rv);
+	}
+
+	/* scatter it back into two */
+	lseek(fd, 0, SEEK_SET);
+	memset(readbuf, 0, sizeof(readbuf));
+	iov[0].iov_base = readbuf;
+	iov[0].iov_len = 17;
+	iov[1].iov_base = readbuf + 17;
+	iov[1].iov_len = LEN - 17;
+	rv = readv(fd, iov, 2);
+	if (rv<0) {
+		err(1, "%s: readv", argv[1]);
+	}
+	if (rv != LEN) {
+		errx(1, "%s: readv: short count %d", argv[1], rv);
+	}
+	check(readbuf, "readv");
+
+	/* the position is now at the end; pread and pwrite shouldn't move it */
+	memset(readbuf, 0, sizeof(readbuf));
+	rv = pread(fd, readbuf + 20, LEN - 20, 20);
+	if (rv != LEN - 20) {
+		err(1, "%s: pread", argv[1]);
+	}
+	rv = pread(fd, readbuf, 20, 0);
+	if (rv != 20) {
+		err(1, "%s: pread", argv[1]);
+	}
+	check(readbuf, "pread");
+
+	rv = pwrite(fd, "Tweedle", 7, 0);
+	if (rv != 7) {
+		err(1, "%s: pwrite", argv[1]);
+	}
+	rv = pread(fd, readbuf, 7, 0);
+	if (rv != 7 || memcmp(readbuf, "Tweedle", 7)) {
+		errx(1, "%s: pread after pwrite came back wrong", argv[1]);
+	}
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos != LEN) {
+		errx(1, "%s: seek position moved to %ld", argv[1], (long)pos);
+	}
+
+	/* the console can't do positional I/O */
+	rv = pread(STDIN_FILENO, readbuf, 1, 0);
+	if (rv >= 0) {
+		errx(1, "pread on the console succeeded");
+	}
+
+	rv = close(fd);
+	if (rv<0) {
+		err(1, "%s: close", argv[1]);
+	}
+
+	printf("Passed iovtest.\n");
+	return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * mallocbench.c
+ *
+ * 	Times malloc and free under a few allocation patterns, and
+ * 	checks that blocks don't overlap.
+ *
+ * Usage: mallocbench [scale]
+ *
+ * SCALE (default 1) multiplies the amount of work. The patterns are:
+ *    lifo  - bursts of small blocks freed in reverse order
+ *    tree  - a binary search tree built up and then freed in random
+ *            order, so the heap fills with many live blocks
+ *    mixed - random sizes from 13 bytes to 6k, replaced at random
+ *
+ * As host-mallocbench it runs each pattern with the host's malloc and
+ * with the OS/161 libc malloc (compiled in under other names), so they
+ * can be compared on the host.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+
+/*
+ * The OS/161 allocator, under other names so it doesn't replace the
+ * host's.
+ */
+#define malloc os161_malloc
+#define free os161_free
+void *os161_malloc(size_t size);
+void os161_free(void *ptr);
+#include "../../lib/libc/stdlib/malloc.c"
+#undef malloc
+#undef free
+#endif
+
+#define LIFO_ROUNDS	2000
+#define LIFO_DEPTH	64
+#define TREE_NODES	4000
+#define MIXED_SLOTS	64
+#define MIXED_ROUNDS	40000
+
+static const struct {
+	const char *name;
+	void *(*alloc)(size_t);
+	void (*release)(void *);
+} allocators[] = {
+#ifdef HOST
+	{ "host", malloc, free },
+	{ "os161", os161_malloc, os161_free },
+#else
+	{ "malloc", malloc, free },
+#endif
+};
+
+static void *(*m_alloc)(size_t);
+static void (*m_free)(void *);
+
+/*
+ * Allocate and fill with a byte that depends on where the block is
+ * and its size, so a block that overlaps another is noticed when it's
+ * checked.
+ */
+static
+void *
+get(size_t size)
+{
+	unsigned char *p;
+
+	p = m_alloc(size);
+	if (p == NULL) {
+		errx(1, "malloc(%lu) failed", (unsigned long)size);
+	}
+	memset(p, (unsigned char)((uintptr_t)p ^ size), size);
+	return p;
+}
+
+static
+void
+put(void *ptr, size_t size)
+{
+	unsigned char *p = ptr;
+	unsigned char v = (unsigned char)((uintptr_t)p ^ size);
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		if (p[i] != v) {
+			errx(1, "block %p (size %lu) was overwritten at %lu",
+			     p, (unsigned long)size, (unsigned long)i);
+		}
+	}
+	m_free(p);
+}
+
+static
+void
+lifo(unsigned scale)
+{
+	void *ptrs[LIFO_DEPTH];
+	size_t sizes[LIFO_DEPTH];
+	unsigned r, i;
+
+	for (r=0; r<LIFO_ROUNDS*scale; r++) {
+		for (i=0; i<LIFO_DEPTH; i++) {
+			sizes[i] = 8 + random() % 120;
+			ptrs[i] = get(sizes[i]);
+		}
+		for (i=LIFO_DEPTH; i-- > 0; ) {
+			put(ptrs[i], sizes[i]);
+		}
+	}
+}
+
+struct node {
+	struct node *left, *right;
+	long key;
+	char payload[20];
+};
+
+static
+void
+tree(unsigned scale)
+{
+	struct node **all, *root, **pp, *n, *tmp;
+	unsigned count, i, j;
+
+	count = TREE_NODES*scale;
+	all = m_alloc(count * sizeof(*all));
+	if (all == NULL) {
+		errx(1, "malloc failed");
+	}
+
+	root = NULL;
+	for (i=0; i<count; i++) {
+		n = get(sizeof(*n));
+		n->left = n->right = NULL;
+		n->key = random();
+		for (pp = &root; *pp != NULL; ) {
+			pp = n->key < (*pp)->key ? &(*pp)->left : &(*pp)->right;
+		}
+		*pp = n;
+		all[i] = n;
+	}
+
+	/* shuffle, then free */
+	for (i=count; i-- > 1; ) {
+		j = random() % (i+1);
+		tmp = all[i];
+		all[i] = all[j];
+		all[j] = tmp;
+	}
+	for (i=0; i<count; i++) {
+		m_free(all[i]);
+	}
+	m_free(all);
+}
+
+static
+void
+mixed(unsigned scale)
+{
+	static const size_t sizes[8] = { 13, 17, 69, 176, 433, 871, 1150, 6060 };
+	void *ptrs[MIXED_SLOTS];
+	size_t psizes[MIXED_SLOTS];
+	unsigned r, i;
+
+	for (i=0; i<MIXED_SLOTS; i++) {
+		ptrs[i] = NULL;
+	}
+	for (r=0; r<MIXED_ROUNDS*scale; r++) {
+		i = random() % MIXED_SLOTS;
+		if (ptrs[i] != NULL) {
+			put(ptrs[i], psizes[i]);
+		}
+		psizes[i] = sizes[random() % 8] + random() % 64;
+		ptrs[i] = get(psizes[i]);
+	}
+	for (i=0; i<MIXED_SLOTS; i++) {
+		if (ptrs[i] != NULL) {
+			put(ptrs[i], psizes[i]);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*func)(unsigned);
+} patterns[] = {
+	{ "lifo", lifo },
+	{ "tree", tree },
+	{ "mixed", mixed },
+};
+
+int
+main(int argc, char *argv[])
+{
+	unsigned scale = 1;
+	unsigned a, p;
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long long total;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 1) {
+		scale = atoi(argv[1]);
+		if (scale == 0) {
+			errx(1, "Usage: mallocbench [scale]");
+		}
+	}
+
+	for (a=0; a<sizeof(allocators)/sizeof(allocators[0]); a++) {
+		m_alloc = allocators[a].alloc;
+		m_free = allocators[a].release;
+		for (p=0; p<sizeof(patterns)/sizeof(patterns[0]); p++) {
+			srandom(p);
+			__time(&s0, &ns0);
+			patterns[p].func(scale);
+			__time(&s1, &ns1);
+			total = (s1 - s0) * 1000000000ULL + ns1 - ns0;
+			printf("%-6s %-6s %10lu us\n", allocators[a].name,
+			       patterns[p].name,
+			       (unsigned long)(total / 1000));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * membench.c
+ *
+ * 	Checks and times the common libc memcpy, memmove, and bzero
+ * 	(which the kernel uses too) against the simple versions they
+ * 	replaced.
+ *
+ * Usage: membench [iterations]
+ *
+ * Builds both for OS/161 and as host-membench, so the two sets of
+ * routines can be compared on the host as well. Either way, the
+ * routines under test are compiled right into this program from
+ * common/libc/string under other names, so it doesn't matter what
+ * the system's own versions are.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+#endif
+
+/*
+ * The routines under test.
+ */
+#define memcpy new_memcpy
+#define memmove new_memmove
+#define bzero new_bzero
+void *new_memcpy(void *dst, const void *src, size_t len);
+void *new_memmove(void *dst, const void *src, size_t len);
+void new_bzero(void *block, size_t len);
+#include "../../../common/libc/string/memcpy.c"
+#include "../../../common/libc/string/memmove.c"
+#include "../../../common/libc/string/bzero.c"
+#undef memcpy
+#undef memmove
+#undef bzero
+
+/*
+ * The old routines, which copied by words only when everything was
+ * word-aligned.
+ */
+
+static
+void *
+old_memcpy(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=0; i<len/sizeof(long); i++) {
+			d[i] = s[i];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=0; i<len; i++) {
+			d[i] = s[i];
+		}
+	}
+	return dst;
+}
+
+static
+void *
+old_memmove(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst < (uintptr_t)src) {
+		return old_memcpy(dst, src, len);
+	}
+
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=len/sizeof(long); i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=len; i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	return dst;
+}
+
+static
+void
+old_bzero(void *vblock, size_t len)
+{
+	char *block = vblock;
+	size_t i;
+
+	if ((uintptr_t)block % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *lb = (long *)block;
+		for (i=0; i<len/sizeof(long); i++) {
+			lb[i] = 0;
+		}
+	}
+	else {
+		for (i=0; i<len; i++) {
+			block[i] = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+#define BUFSIZE		8192
+#define PAGESIZE	4096
+#define DEFAULT_ITERS	2000
+
+/* long-aligned buffers; the arrays are long to get that */
+static long abuf[BUFSIZE / sizeof(long)];
+static long bbuf[BUFSIZE / sizeof(long)];
+static long cbuf[BUFSIZE / sizeof(long)];
+
+static
+void
+fill(char *buf, unsigned seed)
+{
+	unsigned i;
+
+	for (i=0; i<BUFSIZE; i++) {
+		buf[i] = (char)(seed + i * 7 + (i >> 8));
+	}
+}
+
+/*
+ * Return nonzero if the whole of two buffers differ.
+ */
+static
+int
+differ(const char *x, const char *y)
+{
+	unsigned i;
+
+	for (i=0; i<BUFSIZE; i++) {
+		if (x[i] != y[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the new routines give the same results as the old ones for
+ * all small combinations of alignment, length, and (for memmove)
+ * overlap, and for a page.
+ */
+static
+void
+check(void)
+{
+	char *a = (char *)abuf, *b = (char *)bbuf, *c = (char *)cbuf;
+	size_t doff, soff, len;
+	unsigned lens[] = { 0, 1, 3, 7, 8, 31, 32, 33, 63, 64, 100, 257,
+			    PAGESIZE - 1, PAGESIZE };
+	unsigned i;
+
+	for (i=0; i<sizeof(lens)/sizeof(lens[0]); i++) {
+		len = lens[i];
+		for (doff=0; doff<16; doff++) {
+			for (soff=0; soff<16; soff++) {
+				fill(a, doff);
+				fill(b, soff + 100);
+				fill(c, doff);
+				new_memcpy(a + doff, b + soff, len);
+				old_memcpy(c + doff, b + soff, len);
+				if (differ(a, c)) {
+					errx(1, "memcpy: wrong for dst+%u "
+					     "src+%u len %u", (unsigned)doff,
+					     (unsigned)soff, (unsigned)len);
+				}
+
+				fill(a, 1);
+				fill(c, 1);
+				new_memmove(a + doff, a + soff, len);
+				old_memmove(c + doff, c + soff, len);
+				if (differ(a, c)) {
+					errx(1, "memmove: wrong for dst+%u "
+					     "src+%u len %u", (unsigned)doff,
+					     (unsigned)soff, (unsigned)len);
+				}
+			}
+			fill(a, 2);
+			fill(c, 2);
+			new_bzero(a + doff, len);
+			old_bzero(c + doff, len);
+			if (differ(a, c)) {
+				errx(1, "bzero: wrong for +%u len %u",
+				     (unsigned)doff, (unsigned)len);
+			}
+		}
+	}
+	printf("membench: results match\n");
+}
+
+/*
+ * Timing.
+ */
+
+static
+unsigned long
+now_usecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs * 1000000UL + nsecs / 1000;
+}
+
+/*
+ * Run one copy (or zero) of LEN bytes at the given offsets ITERS
+ * times with the old and the new routine and print both times.
+ */
+static
+void
+bench(const char *what, int op, size_t doff, size_t soff, size_t len,
+      unsigned iters)
+{
+	char *a = (char *)abuf, *b = (char *)bbuf;
+	unsigned long start, oldtime, newtime;
+	unsigned i;
+
+	start = now_usecs();
+	for (i=0; i<iters; i++) {
+		switch (op) {
+		    case 0: old_memcpy(a + doff, b + soff, len); break;
+		    case 1: old_memmove(a + doff, a + soff, len); break;
+		    case 2: old_bzero(a + doff, len); break;
+		}
+	}
+	oldtime = now_usecs() - start;
+
+	start = now_usecs();
+	for (i=0; i<iters; i++) {
+		switch (op) {
+		    case 0: new_memcpy(a + doff, b + soff, len); break;
+		    case 1: new_memmove(a + doff, a + soff, len); break;
+		    case 2: new_bzero(a + doff, len); break;
+		}
+	}
+	newtime = now_usecs() - start;
+
+	printf("%-8s %4u %-22s %8lu us %8lu us", what, (unsigned)len,
+	       ((doff | soff) % sizeof(long)) == 0 ? "aligned" :
+	       ((doff ^ soff) % sizeof(long)) == 0 ? "misaligned alike" :
+	       "misaligned differently", oldtime, newtime);
+	if (newtime > 0) {
+		printf("  %lu.%02lux", oldtime / newtime,
+		       (oldtime * 100 / newtime) % 100);
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned iters = DEFAULT_ITERS;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 1) {
+		iters = atoi(argv[1]);
+		if (iters == 0) {
+			errx(1, "Usage: membench [iterations]");
+		}
+	}
+
+	check();
+
+	printf("%u iterations (bytes, alignment, old, new, speedup):\n", iters);
+	bench("memcpy", 0, 0, 0, PAGESIZE, iters);
+	bench("memcpy", 0, 1, 1, PAGESIZE, iters);
+	bench("memcpy", 0, 1, 2, PAGESIZE, iters);
+	bench("memcpy", 0, 0, 0, PAGESIZE - 3, iters);
+	bench("memmove", 1, 8, 0, PAGESIZE, iters);
+	bench("memmove", 1, 9, 1, PAGESIZE, iters);
+	bench("bzero", 2, 0, 0, PAGESIZE, iters);
+	bench("bzero", 2, 3, 3, PAGESIZE, iters);
+
+	return 0;
+}
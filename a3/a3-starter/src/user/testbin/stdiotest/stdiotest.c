@@ -0,0 +1,252 @@
+/*
+ * stdiotest.c
+ *
+ * 	Checks the stdio streams: writes a file through each buffering
+ * 	mode with putc, fwrite, and fprintf, reads it back with getc and
+ * 	fread, and times both.
+ *
+ * Usage: stdiotest [file]
+ *
+ * FILE defaults to stdiotest.tmp. The last line of output is left in
+ * a fully buffered stdout for exit() to write; if it doesn't show up,
+ * exit isn't flushing.
+ *
+ * Also builds as host-stdiotest, to compare against the host's stdio.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+#endif
+
+#define NLINES 500
+#define LINELEN 16	/* "line 00000 abcd\n" */
+
+static const struct {
+	const char *name;
+	int mode;
+} modes[] = {
+	{ "full", _IOFBF },
+	{ "line", _IOLBF },
+	{ "none", _IONBF },
+};
+
+static time_t s0;
+static unsigned long ns0;
+
+static
+void
+start(void)
+{
+	__time(&s0, &ns0);
+}
+
+static
+void
+stop(const char *what, const char *mode)
+{
+	time_t s1;
+	unsigned long ns1;
+	unsigned long long total;
+
+	__time(&s1, &ns1);
+	total = (s1 - s0) * 1000000000ULL + ns1 - ns0;
+	printf("%-8s %-5s %10lu us\n", what, mode,
+	       (unsigned long)(total / 1000));
+}
+
+/*
+ * Make line I of the file.
+ */
+static
+void
+mkline(char *buf, unsigned i)
+{
+	snprintf(buf, LINELEN+1, "line %05u abcd\n", i);
+}
+
+static
+FILE *
+openmode(const char *file, const char *how, int mode)
+{
+	FILE *f;
+
+	f = fopen(file, how);
+	if (f == NULL) {
+		err(1, "%s: fopen %s", file, how);
+	}
+	if (setvbuf(f, NULL, mode, 0)) {
+		err(1, "%s: setvbuf", file);
+	}
+	return f;
+}
+
+static
+void
+closefile(FILE *f, const char *file)
+{
+	if (ferror(f)) {
+		errx(1, "%s: I/O error", file);
+	}
+	if (fclose(f)) {
+		err(1, "%s: fclose", file);
+	}
+}
+
+static
+void
+writefile(const char *file, int mode, const char *modename)
+{
+	char line[LINELEN+1];
+	FILE *f;
+	unsigned i, j;
+
+	/* lines 0..NLINES/2 with putc, the rest alternating */
+	f = openmode(file, "w", mode);
+	start();
+	for (i=0; i<NLINES/2; i++) {
+		mkline(line, i);
+		for (j=0; j<LINELEN; j++) {
+			putc(line[j], f);
+		}
+	}
+	stop("putc", modename);
+	start();
+	for (; i<NLINES; i++) {
+		if (i % 2) {
+			fprintf(f, "line %05u abcd\n", i);
+		}
+		else {
+			mkline(line, i);
+			if (fwrite(line, 1, LINELEN, f) != LINELEN) {
+				err(1, "%s: fwrite", file);
+			}
+		}
+	}
+	stop("fwrite", modename);
+	closefile(f, file);
+}
+
+static
+void
+readfile(const char *file, int mode, const char *modename)
+{
+	char line[LINELEN+1], got[LINELEN];
+	FILE *f;
+	unsigned i, j;
+	int c;
+
+	f = openmode(file, "r", mode);
+	start();
+	for (i=0; i<NLINES; i++) {
+		mkline(line, i);
+		if (i % 2) {
+			if (fread(got, 1, LINELEN, f) != LINELEN) {
+				errx(1, "%s: short fread at line %u", file, i);
+			}
+		}
+		else {
+			for (j=0; j<LINELEN; j++) {
+				c = getc(f);
+				if (c == EOF) {
+					errx(1, "%s: early EOF at line %u",
+					     file, i);
+				}
+				got[j] = c;
+			}
+		}
+		if (memcmp(got, line, LINELEN)) {
+			errx(1, "%s: line %u is wrong", file, i);
+		}
+	}
+	if (getc(f) != EOF || !feof(f)) {
+		errx(1, "%s: junk at end", file);
+	}
+	stop("read", modename);
+	closefile(f, file);
+}
+
+/*
+ * Add line I to the end of the existing file, opened with HOW.
+ */
+static
+void
+appendline(const char *file, const char *how, unsigned i)
+{
+	FILE *f;
+
+	f = fopen(file, how);
+	if (f == NULL) {
+		err(1, "%s: fopen %s", file, how);
+	}
+	fprintf(f, "line %05u abcd\n", i);
+	closefile(f, file);
+}
+
+/*
+ * Append a line with "a" and another with "a+", then read the whole
+ * file back: the old lines must be untouched and the new ones last.
+ */
+static
+void
+appendfile(const char *file)
+{
+	char line[LINELEN+1], got[LINELEN];
+	FILE *f;
+	unsigned i;
+
+	appendline(file, "a", NLINES);
+	appendline(file, "a+", NLINES+1);
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		err(1, "%s: fopen r", file);
+	}
+	for (i=0; i<NLINES+2; i++) {
+		mkline(line, i);
+		if (fread(got, 1, LINELEN, f) != LINELEN) {
+			errx(1, "%s: short fread at line %u after append",
+			     file, i);
+		}
+		if (memcmp(got, line, LINELEN)) {
+			errx(1, "%s: line %u is wrong after append", file, i);
+		}
+	}
+	if (getc(f) != EOF || !feof(f)) {
+		errx(1, "%s: junk at end after append", file);
+	}
+	closefile(f, file);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "stdiotest.tmp";
+	unsigned i;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	for (i=0; i<sizeof(modes)/sizeof(modes[0]); i++) {
+		writefile(file, modes[i].mode, modes[i].name);
+		readfile(file, modes[i].mode, modes[i].name);
+	}
+	appendfile(file);
+	remove(file);
+
+	/* left for exit() to write out */
+	setvbuf(stdout, NULL, _IOFBF, 0);
+	printf("stdiotest: passed\n");
+	return 0;
+}
@@ -80,6 +80,29 @@ dowait(int index, int pid)
 	return 0;
 }
 
+/*
+ * Print the cpu time, context switches and page faults the copies
+ * used between them.
+ */
+static
+void
+report(const char *prog)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_CHILDREN, &ru) < 0) {
+		warn("getrusage");
+		return;
+	}
+	warnx("%s: user %ld.%03lds sys %ld.%03lds", prog,
+	      (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+	      (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000);
+	warnx("%s: %lu voluntary / %lu involuntary context switches, "
+	      "%lu minor / %lu major faults", prog,
+	      (unsigned long)ru.ru_nvcsw, (unsigned long)ru.ru_nivcsw,
+	      (unsigned long)ru.ru_minflt, (unsigned long)ru.ru_majflt);
+}
+
 void
 triple(const char *prog)
 {
@@ -101,6 +124,8 @@ triple(const char *prog)
 		failures += dowait(i, pids[i]);
 	}
 
+	report(prog);
+
 	if (failures > 0) {
 		warnx("%d failures", failures);
 	}